@@ -93,8 +93,15 @@ void EtherShield::ES_enc28j60Init(uint8_t* macaddr){
  * Flash the 2 MagJack LEDs
  */
 void EtherShield::ES_enc28j60Init( uint8_t* macaddr, uint8_t csPin ) {
+  ES_enc28j60Init(macaddr, csPin, 0);
+}
+
+/**
+ * Initialise the ENC28J60 with a buffer layout, see enc28j60InitWithLayout
+ */
+void EtherShield::ES_enc28j60Init( uint8_t* macaddr, uint8_t csPin, const enc28j60Layout *layout ) {
   /*initialize enc28j60*/
-  enc28j60InitWithCs( macaddr, csPin );
+  enc28j60InitWithLayout( macaddr, csPin, layout );
   enc28j60clkout(2); // change clkout from 6.25MHz to 12.5MHz
   delay(10);
 
@@ -140,6 +147,18 @@ void EtherShield::ES_enc28j60DisableMulticast( void ) {
 	enc28j60DisableMulticast();
 }
 
+void EtherShield::ES_enc28j60SetPattern(uint16_t offset, const uint8_t *mask, const uint8_t *bytes) {
+	enc28j60SetPattern(offset, mask, bytes);
+}
+
+void EtherShield::ES_enc28j60DisablePattern( void ) {
+	enc28j60DisablePattern();
+}
+
+void EtherShield::ES_packet_filter_udp_port(uint16_t port) {
+	packet_filter_udp_port(port);
+}
+
 uint8_t EtherShield::ES_enc28j60Read( uint8_t address ) {
 	return enc28j60Read( address );
 }
@@ -156,6 +175,46 @@ uint16_t EtherShield::ES_enc28j60PacketReceive(uint16_t len, uint8_t* packet){
 	return enc28j60PacketReceive(len, packet);
 }
 
+uint16_t EtherShield::ES_enc28j60PacketBegin(void){
+	return enc28j60PacketBegin();
+}
+
+void EtherShield::ES_enc28j60PacketRead(uint16_t pos, uint16_t len, uint8_t* packet){
+	enc28j60PacketRead(pos, len, packet);
+}
+
+void EtherShield::ES_enc28j60PacketRelease(void){
+	enc28j60PacketRelease();
+}
+
+void EtherShield::ES_enc28j60EnableInterrupt(uint8_t irq){
+	enc28j60EnableInterrupt(irq);
+}
+
+uint8_t EtherShield::ES_enc28j60Events(void){
+	return enc28j60Events();
+}
+
+uint16_t EtherShield::ES_enc28j60RxOverflows(void){
+	return enc28j60RxOverflows();
+}
+
+void EtherShield::ES_enc28j60ScratchWrite(uint16_t pos, uint16_t len, uint8_t* data){
+	enc28j60ScratchWrite(pos, len, data);
+}
+
+void EtherShield::ES_enc28j60ScratchRead(uint16_t pos, uint16_t len, uint8_t* data){
+	enc28j60ScratchRead(pos, len, data);
+}
+
+void EtherShield::ES_enc28j60ScratchToTx(uint16_t txpos, uint16_t pos, uint16_t len){
+	enc28j60ScratchToTx(txpos, pos, len);
+}
+
+uint16_t EtherShield::ES_packet_receive_filtered(uint8_t *buf,uint16_t maxlen){
+	return packet_receive_filtered(buf, maxlen);
+}
+
 void EtherShield::ES_enc28j60PacketSend(uint16_t len, uint8_t* packet){
 	enc28j60PacketSend(len, packet);
 }
@@ -172,6 +231,38 @@ uint8_t EtherShield::ES_eth_type_is_ip_and_my_ip(uint8_t *buf,uint16_t len) {
 	eth_type_is_ip_and_my_ip(buf, len);
 }
 
+#ifdef MULTICAST_GROUPS
+uint8_t EtherShield::ES_multicast_join(uint8_t *groupip) {
+	return multicast_join(groupip);
+}
+
+uint8_t EtherShield::ES_multicast_leave(uint8_t *groupip) {
+	return multicast_leave(groupip);
+}
+
+uint8_t EtherShield::ES_eth_type_is_ip_and_my_group(uint8_t *buf,uint16_t len) {
+	return eth_type_is_ip_and_my_group(buf, len);
+}
+#endif
+
+#ifdef UDP_SOCKETS
+uint8_t EtherShield::ES_udp_bind(uint16_t port,uint8_t *rip,uint16_t rport,void (*callback)(uint8_t fd,uint8_t *buf,uint16_t datapos,uint16_t len)) {
+	return udp_bind(port, rip, rport, callback);
+}
+
+void EtherShield::ES_udp_unbind(uint8_t fd) {
+	udp_unbind(fd);
+}
+
+uint16_t EtherShield::ES_udp_received(uint8_t fd) {
+	return udp_received(fd);
+}
+
+uint16_t EtherShield::ES_udp_dropped(uint8_t fd) {
+	return udp_dropped(fd);
+}
+#endif
+
 void EtherShield::ES_make_echo_reply_from_request(uint8_t *buf,uint16_t len) {
 	make_echo_reply_from_request(buf,len);
 }
@@ -212,6 +303,22 @@ void EtherShield::ES_send_udp_data(uint8_t *buf,uint16_t dlen,uint16_t source_po
 	send_udp_transmit(buf,dlen);
 }
 
+void EtherShield::ES_send_udp_stream_begin(uint8_t *hdr,uint16_t source_port, uint8_t *dest_ip, uint16_t dest_port) {
+	send_udp_stream_begin(hdr,source_port, dest_ip, dest_port);
+}
+
+void EtherShield::ES_send_udp_stream(const uint8_t *s,uint16_t len) {
+	send_udp_stream(s,len);
+}
+
+void EtherShield::ES_send_udp_stream_zero(uint16_t len) {
+	send_udp_stream_zero(len);
+}
+
+void EtherShield::ES_send_udp_stream_end(uint8_t *hdr) {
+	send_udp_stream_end(hdr);
+}
+
 void EtherShield::ES_init_len_info(uint8_t *buf) {
 	init_len_info(buf);
 }
@@ -229,6 +336,18 @@ void EtherShield::ES_fill_ip_hdr_checksum(uint8_t *buf) {
 	fill_ip_hdr_checksum(buf);
 }
 
+uint16_t EtherShield::ES_checksum_update(uint16_t ck,uint16_t oldval,uint16_t newval) {
+	return checksum_update(ck, oldval, newval);
+}
+
+void EtherShield::ES_checksum_update_at(uint8_t *buf,uint16_t ckpos,uint16_t oldval,uint16_t newval) {
+	checksum_update_at(buf, ckpos, oldval, newval);
+}
+
+void EtherShield::ES_ip_hdr_set_len(uint8_t *buf,uint16_t len) {
+	ip_hdr_set_len(buf, len);
+}
+
 uint16_t EtherShield::ES_get_tcp_data_pointer(void) {
 	return get_tcp_data_pointer();
 }
@@ -252,6 +371,31 @@ uint16_t EtherShield::ES_fill_tcp_data_len(uint8_t *buf,uint16_t pos, const char
 void EtherShield::ES_www_server_reply(uint8_t *buf,uint16_t dlen) {
 	www_server_reply(buf,dlen);
 }
+
+void EtherShield::ES_www_server_reply_begin(uint8_t *buf) {
+	www_server_reply_begin(buf);
+}
+
+uint16_t EtherShield::ES_stream_tcp_data_p(const prog_char *progmem_s) {
+	return stream_tcp_data_p(progmem_s);
+}
+
+uint16_t EtherShield::ES_stream_tcp_data(const char *s) {
+	return stream_tcp_data(s);
+}
+
+uint16_t EtherShield::ES_stream_tcp_data_len(const uint8_t *s, uint16_t len) {
+	return stream_tcp_data_len(s, len);
+}
+
+void EtherShield::ES_www_server_reply_end(uint8_t *buf) {
+	www_server_reply_end(buf);
+}
+
+void EtherShield::ES_www_server_reply_multi(uint8_t *buf,uint16_t bufsize,
+		uint16_t (*datafill)(uint8_t fd,uint8_t *buf,uint16_t offset,uint16_t maxlen,uint8_t *last)) {
+	www_server_reply_multi(buf,bufsize,datafill);
+}
 	
 uint8_t EtherShield::ES_client_store_gw_mac(uint8_t *buf) {
 	return client_store_gw_mac(buf);
@@ -279,6 +423,14 @@ uint8_t EtherShield::ES_client_tcp_req(uint8_t (*result_callback)(uint8_t fd,uin
 	return client_tcp_req( result_callback, datafill_callback, port );
 }
 
+uint8_t EtherShield::ES_client_tcp_stream_req(uint16_t (*stream_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf,uint16_t len_of_data,uint32_t offset,uint8_t more),uint16_t (*datafill_callback)(uint8_t fd),uint16_t port ) {
+	return client_tcp_stream_req( stream_callback, datafill_callback, port );
+}
+
+void EtherShield::ES_client_tcp_window(uint16_t wnd) {
+	client_tcp_window( wnd );
+}
+
 void EtherShield::ES_tcp_client_send_packet(uint8_t *buf,uint16_t dest_port, uint16_t src_port, uint8_t flags, uint8_t max_segment_size, 
 	uint8_t clear_seqck, uint16_t next_ack_num, uint16_t dlength, uint8_t *dest_mac, uint8_t *dest_ip){
 	
@@ -381,6 +533,14 @@ uint8_t EtherShield::ES_client_waiting_gw() {
 	return( client_waiting_gw() );
 }
 
+void EtherShield::ES_client_set_netmask(uint8_t *mask) {
+	client_set_netmask(mask);
+}
+
+uint8_t EtherShield::ES_client_waiting_arp(uint8_t *ip) {
+	return( client_waiting_arp(ip) );
+}
+
 #ifdef DNS_client
 uint8_t EtherShield::ES_dnslkup_haveanswer(void)
 {       
@@ -405,66 +565,116 @@ void EtherShield::ES_dnslkup_request(uint8_t *buf,uint8_t *hostname) {
 	return( dnslkup_request(buf, hostname) );
 }
 
+#ifdef DNS_CACHE_SIZE
+uint8_t EtherShield::ES_dnslkup_cached(uint8_t *hostname) {
+	return( dnslkup_cached(hostname) );
+}
+#endif
+
 uint8_t EtherShield::ES_udp_client_check_for_dns_answer(uint8_t *buf,uint16_t plen){
 	return( udp_client_check_for_dns_answer( buf, plen) );
 }
 
 
+// Non-blocking name resolution. resolveHostnameBegin starts it, then
+// resolveHostnamePoll is called from loop() with every packet after
+// packetloop_icmp_tcp and with plen=0 when nothing was received. Requests
+// go out only in the passes without a packet, so a received packet is
+// never overwritten. The hostname must stay valid until the lookup is
+// over, the found ip is also set with client_tcp_set_serverip.
+#ifndef DNS_RETRY_MS
+#define DNS_RETRY_MS 10000
+#endif
+static uint8_t *dnsPollHost;
+static uint8_t dnsPollState=ES_POLL_IDLE;
+static uint8_t dnsPollSent;
+static uint32_t dnsPollStart;
+static uint32_t dnsPollTimeout;
+static uint32_t dnsPollLast;
+static void (*dnsPollCallback)(uint8_t status);
+
+static uint8_t dnsPollEnd(uint8_t status) {
+  dnsPollState=status;
+  if (dnsPollCallback) {
+    (*dnsPollCallback)(status);
+  }
+  return status;
+}
+
+// look up hostname, give up after timeout ms. callback (may be NULL) is
+// called with ES_POLL_DONE or ES_POLL_FAILED when the lookup is over.
+void EtherShield::resolveHostnameBegin(uint8_t *hostname, uint32_t timeout, void (*callback)(uint8_t status)) {
+  dnsPollHost=hostname;
+  dnsPollCallback=callback;
+  dnsPollTimeout=timeout;
+  dnsPollStart=millis();
+  dnsPollSent=0;
+  dnsPollState=ES_POLL_BUSY;
+}
+
+// one step of the lookup, returns the state (ES_POLL_BUSY while it runs)
+uint8_t EtherShield::resolveHostnamePoll(uint8_t *buf, uint16_t plen) {
+  if (dnsPollState!=ES_POLL_BUSY) {
+    return dnsPollState;
+  }
+  if (plen) {
+    if (dnsPollSent && udp_client_check_for_dns_answer(buf, plen)) {
+      client_tcp_set_serverip(dnslkup_getip());
+      return dnsPollEnd(ES_POLL_DONE);
+    }
+    if (dnsPollSent && dnslkup_get_error_info() == 3) {
+      // the name does not exist, no need to ask again
+      return dnsPollEnd(ES_POLL_FAILED);
+    }
+    return ES_POLL_BUSY;
+  }
+#ifdef DNS_CACHE_SIZE
+  if (!dnsPollSent) {
+    // a name we know needs no request, not even the gateway
+    switch (dnslkup_cached(dnsPollHost)) {
+      case 1:
+        client_tcp_set_serverip(dnslkup_getip());
+        return dnsPollEnd(ES_POLL_DONE);
+      case 2:
+        return dnsPollEnd(ES_POLL_FAILED);
+    }
+  }
+#endif
+  if (millis()-dnsPollStart >= dnsPollTimeout) {
+    return dnsPollEnd(ES_POLL_FAILED);
+  }
+  if (client_waiting_gw()) {
+    // No ARP received for gateway
+    return ES_POLL_BUSY;
+  }
+  if (!dnsPollSent || millis()-dnsPollLast >= DNS_RETRY_MS) {
+    dnslkup_request(buf, dnsPollHost);
+    dnsPollLast=millis();
+    dnsPollSent=1;
+  }
+  return ES_POLL_BUSY;
+}
+
+// ES_POLL_IDLE before the first lookup, ES_POLL_BUSY, ES_POLL_DONE or
+// ES_POLL_FAILED. The ip is available with ES_dnslkup_getip.
+uint8_t EtherShield::resolveHostnameResult(void) {
+  return dnsPollState;
+}
+
 // Perform all processing to resolve a hostname to IP address.
 // Returns 1 for successful Name resolution, 0 otherwise
 uint8_t EtherShield::resolveHostname(uint8_t *buf, uint16_t buffer_size, uint8_t *hostname ) {
-  uint16_t dat_p;
-  int plen = 0;
-  long lastDnsRequest = millis();
-  uint8_t dns_state = DNS_STATE_INIT;
-  boolean gotAddress = false;
-  uint8_t dnsTries = 3;	// After 10 attempts fail gracefully so other action can be carried out
-
-  while( !gotAddress ) {
-    // handle ping and wait for a tcp packet
+  uint16_t plen = 0;
+  uint8_t st;
+
+  // give up after 3 minutes so other action can be carried out
+  resolveHostnameBegin(hostname, 180000L, NULL);
+  while( (st = resolveHostnamePoll(buf, plen)) == ES_POLL_BUSY ) {
+    // handle ping and wait for the answer
     plen = enc28j60PacketReceive(buffer_size, buf);
-    dat_p=packetloop_icmp_tcp(buf,plen);
-
-    // We have a packet
-    // Check if IP data
-    if (dat_p == 0) {
-      if (client_waiting_gw() ) {
-        // No ARP received for gateway
-        continue;
-      }
-      // It has IP data
-      if (dns_state==DNS_STATE_INIT) {
-        dns_state=DNS_STATE_REQUESTED;
-        lastDnsRequest = millis();
-        dnslkup_request(buf,hostname);
-        continue;
-      }
-      if (dns_state!=DNS_STATE_ANSWER){
-        // retry every minute if dns-lookup failed:
-        if (millis() > (lastDnsRequest + 60000L) ){
-	  if( --dnsTries <= 0 ) 
-	    return 0;		// Failed to allocate address
-
-          dns_state=DNS_STATE_INIT;
-          lastDnsRequest = millis();
-        }
-        // don't try to use client before
-        // we have a result of dns-lookup
-
-        continue;
-      }
-    } 
-    else {
-      if (dns_state==DNS_STATE_REQUESTED && udp_client_check_for_dns_answer( buf, plen ) ){
-        dns_state=DNS_STATE_ANSWER;
-        //client_set_wwwip(dnslkup_getip());
-        client_tcp_set_serverip(dnslkup_getip());
-	gotAddress = true;
-      }
-    }
+    packetloop_icmp_tcp(buf,plen);
   }
-  
-  return 1;
+  return( st == ES_POLL_DONE );
 }
 
 #endif		// DNS_client
@@ -479,60 +689,123 @@ uint8_t EtherShield::ES_dhcp_state(void)
         return( dhcp_state() );
 }
 
+uint8_t EtherShield::ES_dhcp_poll(uint8_t *buf, uint16_t plen)
+{
+        return( dhcp_poll(buf, plen) );
+}
+
+void EtherShield::ES_dhcp_lease_persist(uint8_t (*load)(uint8_t *lease), void (*save)(uint8_t *lease))
+{
+        dhcp_lease_persist(load, save);
+}
+
+uint8_t EtherShield::ES_dhcp_option_register(uint8_t option, void (*callback)(uint8_t option, uint8_t *data, uint8_t len))
+{
+        return( dhcp_option_register(option, callback) );
+}
+
 uint8_t EtherShield::ES_check_for_dhcp_answer(uint8_t *buf,uint16_t plen){
 	return( check_for_dhcp_answer( buf, plen) );
 }
 
+// Non-blocking address allocation, used like resolveHostnameBegin and
+// resolveHostnamePoll. The address arrays must stay valid, they are
+// filled in as the answers come. Once the lease is there the ip layer is
+// set up with it as allocateIPAddress does.
+#ifndef DHCP_RETRY_MS
+#define DHCP_RETRY_MS 10000
+#endif
+static uint8_t dhcpPollState=ES_POLL_IDLE;
+static uint32_t dhcpPollStart;
+static uint32_t dhcpPollTimeout;
+static uint32_t dhcpPollLast;
+static uint16_t dhcpPollPort;
+static uint8_t *dhcpPollMac;
+static uint8_t *dhcpPollIp;
+static uint8_t *dhcpPollMask;
+static uint8_t *dhcpPollGw;
+static uint8_t *dhcpPollDns;
+static uint8_t *dhcpPollServer;
+static void (*dhcpPollCallback)(uint8_t status);
+
+static uint8_t dhcpPollEnd(uint8_t status) {
+  dhcpPollState=status;
+  if (dhcpPollCallback) {
+    (*dhcpPollCallback)(status);
+  }
+  return status;
+}
+
+// send the first DHCPDISCOVER (buf is used for it), give up after
+// timeout ms
+void EtherShield::allocateIPAddressBegin(uint8_t *buf, uint8_t *mymac, uint16_t myport, uint8_t *myip, uint8_t *mynetmask, uint8_t *gwip, uint8_t *dnsip, uint8_t *dhcpsvrip, uint32_t timeout, void (*callback)(uint8_t status)) {
+  dhcpPollMac=mymac;
+  dhcpPollPort=myport;
+  dhcpPollIp=myip;
+  dhcpPollMask=mynetmask;
+  dhcpPollGw=gwip;
+  dhcpPollDns=dnsip;
+  dhcpPollServer=dhcpsvrip;
+  dhcpPollCallback=callback;
+  dhcpPollTimeout=timeout;
+  dhcpPollStart=millis();
+  dhcpPollLast=dhcpPollStart;
+  dhcpPollState=ES_POLL_BUSY;
+  dhcp_start( buf, mymac, myip, mynetmask, gwip, dnsip, dhcpsvrip );
+}
+
+uint8_t EtherShield::allocateIPAddressPoll(uint8_t *buf, uint16_t plen) {
+  if (dhcpPollState!=ES_POLL_BUSY) {
+    return dhcpPollState;
+  }
+  // answers, and the fallback from INIT-REBOOT to DHCPDISCOVER
+  if (dhcp_poll( buf, plen ) == DHCP_STATE_OK) {
+    //init the ethernet/ip layer:
+    init_ip_arp_udp_tcp(dhcpPollMac, dhcpPollIp, dhcpPollPort);
+    // Set the Router IP
+    client_set_gwip(dhcpPollGw);  // e.g internal IP of dsl router
+    // hosts on our subnet are reached directly
+    client_set_netmask(dhcpPollMask);
+#ifdef DNS_client
+    // Set the DNS server IP address if required, or use default
+    dnslkup_set_dnsip( dhcpPollDns );
+#endif
+    return dhcpPollEnd(ES_POLL_DONE);
+  }
+  if (plen) {
+    return ES_POLL_BUSY;
+  }
+  if (millis()-dhcpPollStart >= dhcpPollTimeout) {
+    return dhcpPollEnd(ES_POLL_FAILED);
+  }
+  if (millis()-dhcpPollLast >= DHCP_RETRY_MS) {
+    // no lease yet, start again
+    dhcpPollLast=millis();
+    dhcp_start( buf, dhcpPollMac, dhcpPollIp, dhcpPollMask, dhcpPollGw, dhcpPollDns, dhcpPollServer );
+  }
+  return ES_POLL_BUSY;
+}
+
+uint8_t EtherShield::allocateIPAddressResult(void) {
+  return dhcpPollState;
+}
+
 // Utility functions 
 
 // Perform all processing to get an IP address plus other addresses returned, e.g. gw, dns, dhcp server.
 // Returns 1 for successful IP address allocation, 0 otherwise
 uint8_t EtherShield::allocateIPAddress(uint8_t *buf, uint16_t buffer_size, uint8_t *mymac, uint16_t myport, uint8_t *myip, uint8_t *mynetmask, uint8_t *gwip, uint8_t *dnsip, uint8_t *dhcpsvrip ) {
-  uint16_t dat_p;
-  int plen = 0;
-  long lastDhcpRequest = millis();
-  uint8_t dhcpState = 0;
-  boolean gotIp = false;
-  uint8_t dhcpTries = 10;	// After 10 attempts fail gracefully so other action can be carried out
-
-  dhcp_start( buf, mymac, myip, mynetmask,gwip, dnsip, dhcpsvrip );
+  uint16_t plen = 0;
+  uint8_t st;
 
-  while( !gotIp ) {
-    // handle ping and wait for a tcp packet
+  // After 10 attempts 10s apart fail gracefully so other action can be carried out
+  allocateIPAddressBegin( buf, mymac, myport, myip, mynetmask, gwip, dnsip, dhcpsvrip, 100000L, NULL );
+  while( (st = allocateIPAddressPoll(buf, plen)) == ES_POLL_BUSY ) {
+    // handle ping and wait for the answers
     plen = enc28j60PacketReceive(buffer_size, buf);
-    dat_p=packetloop_icmp_tcp(buf,plen);
-    if(dat_p==0) {
-      int retstat = check_for_dhcp_answer( buf, plen);
-      dhcpState = dhcp_state();
-      // we are idle here
-      if( dhcpState != DHCP_STATE_OK ) {
-        if (millis() > (lastDhcpRequest + 10000L) ){
-          lastDhcpRequest = millis();
-	  if( --dhcpTries <= 0 ) 
-		  return 0;		// Failed to allocate address
-          // send dhcp
-          dhcp_start( buf, mymac, myip, mynetmask,gwip, dnsip, dhcpsvrip );
-        }
-      } else {
-        if( !gotIp ) {
-          gotIp = true;
-
-          //init the ethernet/ip layer:
-          init_ip_arp_udp_tcp(mymac, myip, myport);
-
-          // Set the Router IP
-          client_set_gwip(gwip);  // e.g internal IP of dsl router
-
-          // Set the DNS server IP address if required, or use default
-          dnslkup_set_dnsip( dnsip );
-
-        }
-      }
-    }
+    packetloop_icmp_tcp(buf,plen);
   }
-
-  return 1;
-
+  return( st == ES_POLL_DONE );
 }
 
 #endif		// DHCP_client
@@ -555,12 +828,14 @@ uint8_t EtherShield::ES_currentTcpState( ) {
 	return currentTcpState( );
 }
 
+#ifdef TCP_client
 uint8_t EtherShield::ES_tcpActiveOpen( uint8_t *buf,uint16_t plen,
        uint8_t (*result_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf, uint16_t len_of_data),
        uint16_t (*datafill_callback)(uint8_t fd),
        uint16_t port ) {
 	return tcpActiveOpen(buf, plen, result_callback, datafill_callback, port );
 }
+#endif
 
 void EtherShield::ES_tcpPassiveOpen( uint8_t *buf,uint16_t plen ) {
 	tcpPassiveOpen(buf, plen );
@@ -26,6 +26,12 @@
 #include "ip_arp_udp_tcp.h"
 #include "net.h"
 
+// state of the non-blocking resolveHostname and allocateIPAddress
+#define ES_POLL_IDLE 0
+#define ES_POLL_BUSY 1
+#define ES_POLL_DONE 2
+#define ES_POLL_FAILED 3
+
 class EtherShield
 {
   public:
@@ -35,10 +41,15 @@ class EtherShield
 	void ES_enc28j60SpiInit( void );
 	void ES_enc28j60Init( uint8_t* macaddr);
 	void ES_enc28j60Init( uint8_t* macaddr, uint8_t csPin );
+	void ES_enc28j60Init( uint8_t* macaddr, uint8_t csPin, const enc28j60Layout *layout );
 	void ES_enc28j60clkout(uint8_t clk);
 	uint8_t ES_enc28j60linkup(void);
 	void ES_enc28j60PhyWrite(uint8_t address, uint16_t data);
 	uint16_t ES_enc28j60PacketReceive(uint16_t len, uint8_t* packet);
+	uint16_t ES_enc28j60PacketBegin(void);
+	void ES_enc28j60PacketRead(uint16_t pos, uint16_t len, uint8_t* packet);
+	void ES_enc28j60PacketRelease(void);
+	uint16_t ES_packet_receive_filtered(uint8_t *buf,uint16_t maxlen);
 	void ES_enc28j60PacketSend(uint16_t len, uint8_t* packet);
 	uint8_t ES_enc28j60Revision(void);
 	uint8_t ES_enc28j60Read( uint8_t address );
@@ -46,13 +57,37 @@ class EtherShield
 	void ES_enc28j60DisableBroadcast( void );
 	void ES_enc28j60EnableMulticast( void );
 	void ES_enc28j60DisableMulticast( void );
+	void ES_enc28j60SetPattern(uint16_t offset, const uint8_t *mask, const uint8_t *bytes);
+	void ES_enc28j60DisablePattern( void );
+	void ES_packet_filter_udp_port(uint16_t port);
 	void ES_enc28j60PowerUp();
 	void ES_enc28j60PowerDown();   
+	// interrupt driven receive, irq is the interrupt the INT pin is wired to
+	void ES_enc28j60EnableInterrupt(uint8_t irq);
+	uint8_t ES_enc28j60Events(void);
+	uint16_t ES_enc28j60RxOverflows(void);
+	// scratch region of the buffer layout
+	void ES_enc28j60ScratchWrite(uint16_t pos, uint16_t len, uint8_t* data);
+	void ES_enc28j60ScratchRead(uint16_t pos, uint16_t len, uint8_t* data);
+	void ES_enc28j60ScratchToTx(uint16_t txpos, uint16_t pos, uint16_t len);
 
 	void ES_init_ip_arp_udp_tcp(uint8_t *mymac,uint8_t *myip,uint16_t port);
 	// for a UDP server:
 	uint8_t ES_eth_type_is_arp_and_my_ip(uint8_t *buf,uint16_t len);
 	uint8_t ES_eth_type_is_ip_and_my_ip(uint8_t *buf,uint16_t len);
+#ifdef MULTICAST_GROUPS
+	// udp to ipv4 multicast groups:
+	uint8_t ES_multicast_join(uint8_t *groupip);
+	uint8_t ES_multicast_leave(uint8_t *groupip);
+	uint8_t ES_eth_type_is_ip_and_my_group(uint8_t *buf,uint16_t len);
+#endif
+#ifdef UDP_SOCKETS
+	// receive udp datagrams to a port through a callback:
+	uint8_t ES_udp_bind(uint16_t port,uint8_t *rip,uint16_t rport,void (*callback)(uint8_t fd,uint8_t *buf,uint16_t datapos,uint16_t len));
+	void ES_udp_unbind(uint8_t fd);
+	uint16_t ES_udp_received(uint8_t fd);
+	uint16_t ES_udp_dropped(uint8_t fd);
+#endif
 
 	void ES_make_echo_reply_from_request(uint8_t *buf,uint16_t len);
 	void ES_make_tcp_synack_from_syn(uint8_t *buf);
@@ -67,10 +102,17 @@ class EtherShield
 	// UDP - dirkx
 	void ES_send_udp_data(uint8_t *buf,uint16_t dlen,uint16_t source_port, uint8_t *dest_ip, uint16_t dest_port);
 	void ES_send_udp_data(uint8_t *buf, uint8_t *destmac,uint16_t dlen,uint16_t source_port, uint8_t *dest_ip, uint16_t dest_port);
+	void ES_send_udp_stream_begin(uint8_t *hdr,uint16_t source_port, uint8_t *dest_ip, uint16_t dest_port);
+	void ES_send_udp_stream(const uint8_t *s,uint16_t len);
+	void ES_send_udp_stream_zero(uint16_t len);
+	void ES_send_udp_stream_end(uint8_t *hdr);
 	
 	void ES_fill_buf_p(uint8_t *buf,uint16_t len, const prog_char *progmem_s);
 	uint16_t ES_checksum(uint8_t *buf, uint16_t len,uint8_t type);
 	void ES_fill_ip_hdr_checksum(uint8_t *buf);
+	uint16_t ES_checksum_update(uint16_t ck,uint16_t oldval,uint16_t newval);
+	void ES_checksum_update_at(uint8_t *buf,uint16_t ckpos,uint16_t oldval,uint16_t newval);
+	void ES_ip_hdr_set_len(uint8_t *buf,uint16_t len);
 
 	// return 0 to just continue in the packet loop and return the position 
 	// of the tcp data if there is tcp data part
@@ -81,6 +123,15 @@ class EtherShield
 	uint16_t ES_fill_tcp_data_len(uint8_t *buf,uint16_t pos, const char *s, uint16_t len );
 	// send data from the web server to the client:
 	void ES_www_server_reply(uint8_t *buf,uint16_t dlen);
+	// or compose it directly in the enc28j60 transmit buffer:
+	void ES_www_server_reply_begin(uint8_t *buf);
+	uint16_t ES_stream_tcp_data_p(const prog_char *progmem_s);
+	uint16_t ES_stream_tcp_data(const char *s);
+	uint16_t ES_stream_tcp_data_len(const uint8_t *s, uint16_t len);
+	void ES_www_server_reply_end(uint8_t *buf);
+	// or in as many segments as needed, datafill fills each of them:
+	void ES_www_server_reply_multi(uint8_t *buf,uint16_t bufsize,
+			uint16_t (*datafill)(uint8_t fd,uint8_t *buf,uint16_t offset,uint16_t maxlen,uint8_t *last));
 	
 	// -- client functions --
 	uint8_t ES_client_store_gw_mac(uint8_t *buf);	//, uint8_t *gwipaddr);
@@ -89,9 +140,13 @@ class EtherShield
 	void ES_client_tcp_set_serverip(uint8_t *ipaddr);
 	void ES_client_arp_whohas(uint8_t *buf,uint8_t *ip_we_search);
 	uint8_t ES_client_waiting_gw( void );
+	void ES_client_set_netmask(uint8_t *mask);
+	uint8_t ES_client_waiting_arp(uint8_t *ip);
 
 #if defined (TCP_client) || defined (WWW_client) || defined (NTP_client)
 	uint8_t ES_client_tcp_req(uint8_t (*result_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf, uint16_t len_of_data),uint16_t (*datafill_callback)(uint8_t fd),uint16_t port );
+	uint8_t ES_client_tcp_stream_req(uint16_t (*stream_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf,uint16_t len_of_data,uint32_t offset,uint8_t more),uint16_t (*datafill_callback)(uint8_t fd),uint16_t port );
+	void ES_client_tcp_window(uint16_t wnd);
 
 	void ES_tcp_client_send_packet(uint8_t *buf,uint16_t dest_port, uint16_t src_port, uint8_t flags, uint8_t max_segment_size, 
 		uint8_t clear_seqck, uint16_t next_ack_num, uint16_t dlength, uint8_t *dest_mac, uint8_t *dest_ip);
@@ -104,18 +159,32 @@ class EtherShield
 	uint8_t *ES_dnslkup_getip( void );
 	void ES_dnslkup_set_dnsip(uint8_t *dnsipaddr);
 	void ES_dnslkup_request(uint8_t *buf, uint8_t *hoststr );
+#ifdef DNS_CACHE_SIZE
+	uint8_t ES_dnslkup_cached(uint8_t *hostname);
+#endif
 	uint8_t ES_udp_client_check_for_dns_answer(uint8_t *buf,uint16_t plen);
 	uint8_t resolveHostname(uint8_t *buf, uint16_t buffer_size, uint8_t *hostname );
+	// the same without blocking: Begin, then Poll from loop() with every
+	// packet (plen=0 if none) until it is no longer ES_POLL_BUSY
+	void resolveHostnameBegin(uint8_t *hostname, uint32_t timeout, void (*callback)(uint8_t status));
+	uint8_t resolveHostnamePoll(uint8_t *buf, uint16_t plen);
+	uint8_t resolveHostnameResult(void);
 #endif
 
 #ifdef DHCP_client
 	uint8_t ES_dhcp_state(void);
+	uint8_t ES_dhcp_poll(uint8_t *buf, uint16_t plen);
+	void ES_dhcp_lease_persist(uint8_t (*load)(uint8_t *lease), void (*save)(uint8_t *lease));
+	uint8_t ES_dhcp_option_register(uint8_t option, void (*callback)(uint8_t option, uint8_t *data, uint8_t len));
 	void ES_dhcp_start(uint8_t *buf, uint8_t *macaddrin, uint8_t *ipaddrin,
 			uint8_t *maskin, uint8_t *gwipin, uint8_t *dhcpsvrin,
 			uint8_t *dnssvrin );
 
 	uint8_t ES_check_for_dhcp_answer(uint8_t *buf,uint16_t plen);
 	uint8_t allocateIPAddress(uint8_t *buf, uint16_t buffer_size, uint8_t *mymac, uint16_t myport, uint8_t *myip, uint8_t *mynetmask, uint8_t *gwip, uint8_t *dnsip, uint8_t *dhcpsvrip );
+	void allocateIPAddressBegin(uint8_t *buf, uint8_t *mymac, uint16_t myport, uint8_t *myip, uint8_t *mynetmask, uint8_t *gwip, uint8_t *dnsip, uint8_t *dhcpsvrip, uint32_t timeout, void (*callback)(uint8_t status));
+	uint8_t allocateIPAddressPoll(uint8_t *buf, uint16_t plen);
+	uint8_t allocateIPAddressResult(void);
 #endif
 
 #define HTTP_HEADER_START ((uint16_t)TCP_SRC_PORT_H_P+(buf[TCP_HEADER_LEN_P]>>4)*4)
@@ -133,6 +202,7 @@ class EtherShield
 	// statuscode=0 means a good webpage was received, with http code 200 OK
 	// statuscode=1 an http error was received
 	// statuscode=2 means the other side in not a web server and in this case datapos is also zero
+	// statuscode=3 means the server did not answer (timeout)
 	// ----- http post 
 	// client web browser using http POST operation:
 	// additionalheaderline must be set to NULL if not used.
@@ -152,6 +222,7 @@ class EtherShield
 	// statuscode=0 means a good webpage was received, with http code 200 OK
 	// statuscode=1 an http error was received
 	// statuscode=2 means the other side in not a web server and in this case datapos is also zero
+	// statuscode=3 means the server did not answer (timeout)
 #endif		// WWW_client
 
 #ifdef NTP_client
@@ -187,7 +258,9 @@ class EtherShield
 
 	uint8_t ES_nextTcpState( uint8_t *buf,uint16_t plen );
 	uint8_t ES_currentTcpState( );
+#ifdef TCP_client
 	uint8_t ES_tcpActiveOpen( uint8_t *buf,uint16_t plen, uint8_t (*result_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf, uint16_t len_of_data),uint16_t (*datafill_callback)(uint8_t fd),uint16_t port );
+#endif
 	void ES_tcpPassiveOpen( uint8_t *buf,uint16_t plen );
 	void ES_tcpClose( uint8_t *buf,uint16_t plen );
 
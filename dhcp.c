@@ -21,6 +21,11 @@
 #include "net.h"
 #include "dhcp.h"
 #include "ip_arp_udp_tcp.h"
+#if (ARDUINO >= 100)
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
 
 #if defined (UDP_client) 
 
@@ -30,7 +35,7 @@
 #define DHCPOFFER  0x02
 #define DHCPREQUEST 0x03
 #define DHCPACK 0x05
-//#define DHCPNACK
+#define DHCPNAK 0x06
 
 // size 236
 typedef struct dhcpData {
@@ -69,6 +74,55 @@ static uint8_t dhcptid_l=0; // a counter for transaction ID
 #define DHCPCLIENT_SRC_PORT_H 0xe0 
 #define DHCP_SRC_PORT 67
 #define DHCP_DEST_PORT 68
+// a lease is held in milliseconds and millis() wraps after 49 days,
+// longer leases are treated as 23 days and are renewed earlier
+#define DHCP_LEASE_MAX 2000000UL
+// minimum time between two requests while renewing or rebinding (RFC 2131: 60s)
+#ifndef DHCP_RENEW_RETRY_MS
+#define DHCP_RENEW_RETRY_MS 60000
+#endif
+// how long to wait for the answer to an INIT-REBOOT request before
+// a new lease is requested with DHCPDISCOVER
+#ifndef DHCP_REBOOT_MS
+#define DHCP_REBOOT_MS 4000
+#endif
+#ifndef DHCP_OPTIONS
+#define DHCP_OPTIONS 4
+#endif
+
+// The options we take from offers and acks ourselves and their
+// minimum length, in the order of the DHCP_I_ indexes below
+static const uint8_t dhcpOptTable[] PROGMEM = {
+        53, 1,  // message type
+        1, 4,   // subnet mask
+        3, 4,   // router
+        6, 4,   // dns server
+        51, 4,  // lease time
+        54, 4,  // server identifier
+        58, 4,  // renewal time T1
+        59, 4,  // rebinding time T2
+        121, 5  // classless static routes, for the default route
+};
+#define DHCP_I_TYPE 0
+#define DHCP_I_MASK 1
+#define DHCP_I_ROUTER 2
+#define DHCP_I_DNS 3
+#define DHCP_I_LEASE 4
+#define DHCP_I_SERVER 5
+#define DHCP_I_T1 6
+#define DHCP_I_T2 7
+#define DHCP_I_ROUTES 8
+#define DHCP_I_BUILTIN 9
+// what we ask for in the parameter request list (55) besides the
+// options the application registers
+static const uint8_t dhcpRequestList[] PROGMEM = {1, 3, 6, 121};
+
+// options registered with dhcp_option_register
+static uint8_t dhcpOptCode[DHCP_OPTIONS];
+static void (*dhcpOptCallback[DHCP_OPTIONS])(uint8_t option, uint8_t *data, uint8_t len);
+// where the options of the last answer are, the length byte of each.
+// First the ones from dhcpOptTable then the registered ones.
+static uint8_t *dhcpOpt[DHCP_I_BUILTIN + DHCP_OPTIONS];
 
 static uint8_t dhcpState = DHCP_STATE_INIT;
 
@@ -87,7 +141,20 @@ uint32_t currentXid = 0;
 uint16_t currentSecs = 0;
 static uint32_t leaseStart = 0;
 static uint32_t leaseTime = 0;
+// renewal time T1 and rebinding time T2, relative to leaseStart
+static uint32_t leaseT1 = 0;
+static uint32_t leaseT2 = 0;
+// when to send the next request while renewing or rebinding, or when
+// the INIT-REBOOT request was sent
+static uint32_t renewNext = 0;
 static uint8_t* bufPtr;
+// lease persistence, see dhcp_lease_persist
+static uint8_t (*leaseLoad)(uint8_t *lease);
+static void (*leaseSave)(uint8_t *lease);
+
+static void dhcp_send(uint8_t requestType );
+static void dhcp_discover(void);
+static uint8_t dhcp_options(uint8_t *buf, uint16_t plen);
 
 static void addToBuf(uint8_t b) {
     *bufPtr++ = b;
@@ -99,18 +166,112 @@ uint8_t dhcp_state(void)
         // leaseStart - start time in millis
         // leaseTime - length of lease in millis
         //
-        if( dhcpState == DHCP_STATE_OK && (leaseStart + leaseTime) <= millis() ) {
+        if( (dhcpState == DHCP_STATE_OK || dhcpState == DHCP_STATE_RENEWING ||
+             dhcpState == DHCP_STATE_REBINDING) && (millis() - leaseStart) >= leaseTime ) {
                 // Calling app needs to detect this and init renewal
                 dhcpState = DHCP_STATE_RENEW;
         }
         return(dhcpState);
 }
 
+// Keep the lease alive. Call it from the main loop with every packet
+// received and with plen=0 when there is none, before packetloop_icmp_tcp.
+// Answers are checked when plen>0, requests are only sent when plen=0.
+// At T1 the server that gave us the lease is asked to extend it
+// (DHCP_STATE_RENEWING), at T2 any server (DHCP_STATE_REBINDING).
+// Our address stays in use all the time. Only if the lease runs
+// out or a server sends a DHCPNAK the state is DHCP_STATE_RENEW and the
+// application has to call dhcp_start again.
+uint8_t dhcp_poll(uint8_t *buf, uint16_t plen)
+{
+        uint32_t t;
+        uint32_t wait;
+        if (plen){
+                check_for_dhcp_answer(buf,plen);
+                return(dhcp_state());
+        }
+        if (dhcpState == DHCP_STATE_REBOOT){
+                if ((millis() - renewNext) >= DHCP_REBOOT_MS){
+                        // nobody confirmed the old lease, get a new one
+                        dhcp_discover();
+                }
+                return(dhcpState);
+        }
+        if (dhcp_state() == DHCP_STATE_OK){
+                if ((millis() - leaseStart) < leaseT1){
+                        return(DHCP_STATE_OK);
+                }
+                currentXid = 0x00654321 + rand();
+                dhcpState = DHCP_STATE_RENEWING;
+                renewNext = leaseT1;
+        }
+        t = millis() - leaseStart;
+        if (dhcpState == DHCP_STATE_RENEWING && t >= leaseT2){
+                // answers may come as broadcast now
+                enc28j60EnableBroadcast();
+                dhcpState = DHCP_STATE_REBINDING;
+                renewNext = leaseT2;
+        }
+        if (dhcpState != DHCP_STATE_RENEWING && dhcpState != DHCP_STATE_REBINDING){
+                return(dhcpState);
+        }
+        if (t < renewNext){
+                return(dhcpState);
+        }
+        // retry after half of the time left, but not more often than
+        // DHCP_RENEW_RETRY_MS
+        if (dhcpState == DHCP_STATE_RENEWING){
+                if (client_waiting_arp(dhcpserver)){
+                        // packetloop_icmp_tcp asks for the mac of the server
+                        return(dhcpState);
+                }
+                wait = (leaseT2 - t) / 2;
+        }else{
+                wait = (leaseTime - t) / 2;
+        }
+        if (wait < DHCP_RENEW_RETRY_MS){
+                wait = DHCP_RENEW_RETRY_MS;
+        }
+        renewNext = t + wait;
+        dhcp_send( DHCPREQUEST );
+        return(dhcpState);
+}
+
+// Keep the lease in e.g. the EEPROM so that after a reset we can ask
+// the server to confirm it (INIT-REBOOT) instead of going through
+// DISCOVER/OFFER/REQUEST/ACK. The lease is DHCP_LEASE_LEN bytes: ip,
+// netmask, gateway, dns server and dhcp server, 4 bytes each.
+// load fills it in and returns 1 if there is one, save is called when
+// a server has given us a new lease. Either can be NULL.
+void dhcp_lease_persist(uint8_t (*load)(uint8_t *lease), void (*save)(uint8_t *lease))
+{
+        leaseLoad = load;
+        leaseSave = save;
+}
+
+// Forget all values and ask for a new lease
+static void dhcp_discover(void)
+{
+        uint8_t n;
+        for( n=0; n<4; n++ ) {
+          dhcpip[n] = 0;
+          dhcpmask[n] = 0;
+          gwaddr[n] = 0;
+          dhcpserver[n] = 0;
+          dnsserver[n] = 0;
+        }
+        dhcp_send( DHCPDISCOVER );
+        dhcpState = DHCP_STATE_DISCOVER;
+}
+
 // Start request sequence, send DHCPDISCOVER
 // Wait for DHCPOFFER
 // Send DHCPREQUEST
 // Wait for DHCPACK
 // All configured
+// The first time after a reset a lease from dhcp_lease_persist is
+// requested directly, if the server does not confirm it within
+// DHCP_REBOOT_MS or sends a DHCPNAK we fall back to DHCPDISCOVER.
 void dhcp_start(uint8_t *buf, uint8_t *macaddrin, uint8_t *ipaddrin,
                 uint8_t *maskin, uint8_t *gwipin, uint8_t *dhcpsvrin,
                 uint8_t *dnssvrin )
@@ -121,17 +282,10 @@ void dhcp_start(uint8_t *buf, uint8_t *macaddrin, uint8_t *ipaddrin,
         gwaddr = gwipin;
         dhcpserver = dhcpsvrin;
         dnsserver = dnssvrin;
+        (void)buf; // kept for API compatibility, the requests are streamed
         srand(analogRead(0));
         currentXid = 0x00654321 + rand();
         currentSecs = 0;
-        int n;
-        for( n=0; n<4; n++ ) {
-          dhcpip[n] = 0;
-          dhcpmask[n] = 0;
-          gwaddr[n] = 0;
-          dhcpserver[n] = 0;
-          dnsserver[n] = 0;
-        }
         // Set a unique hostname, use Arduino- plus last octet of mac address
         hostname[8] = 'A' + (macaddr[5] >> 4);
         hostname[9] = 'A' + (macaddr[5] & 0x0F);
@@ -140,58 +294,133 @@ void dhcp_start(uint8_t *buf, uint8_t *macaddrin, uint8_t *ipaddrin,
         // it has been shown that some routers send responses as
         // broadcasts. Enable here and disable later
         enc28j60EnableBroadcast();
-        dhcp_send( buf, DHCPDISCOVER );
-        dhcpState = DHCP_STATE_DISCOVER;
+        if( dhcpState == DHCP_STATE_INIT && leaseLoad ) {
+                uint8_t lease[DHCP_LEASE_LEN];
+                if( (*leaseLoad)(lease) && lease[0] != 0 && lease[0] != 0xff ) {
+                        memcpy(dhcpip, lease, 4);
+                        memcpy(dhcpmask, lease + 4, 4);
+                        memcpy(gwaddr, lease + 8, 4);
+                        memcpy(dnsserver, lease + 12, 4);
+                        memcpy(dhcpserver, lease + 16, 4);
+                        dhcpState = DHCP_STATE_REBOOT;
+                        renewNext = millis();
+                        dhcp_send( DHCPREQUEST );
+                        return;
+                }
+        }
+        dhcp_discover();
 }
 
 void dhcp_request_ip(uint8_t *buf )
 {
-        dhcp_send( buf, DHCPREQUEST );
+        (void)buf; // kept for API compatibility, the request is streamed
+        dhcp_send( DHCPREQUEST );
         dhcpState = DHCP_STATE_REQUEST;
 }
 
 
+// 1 if option is in our own part of the parameter request list
+static uint8_t dhcp_requested(uint8_t option)
+{
+        uint8_t i=0;
+        while(i<sizeof(dhcpRequestList)){
+                if (pgm_read_byte(&dhcpRequestList[i])==option){
+                        return(1);
+                }
+                i++;
+        }
+        return(0);
+}
+
+// Ask for option in every request and call callback with its data when
+// an ack has it, e.g. DHCP_OPTION_NTP for the ntp servers. A second call
+// for the same option replaces the callback, a NULL callback removes it.
+// Returns 0 if there are already DHCP_OPTIONS registered.
+uint8_t dhcp_option_register(uint8_t option, void (*callback)(uint8_t option, uint8_t *data, uint8_t len))
+{
+        uint8_t i=0;
+        uint8_t freeslot=DHCP_OPTIONS;
+        while(i<DHCP_OPTIONS){
+                if (dhcpOptCallback[i] && dhcpOptCode[i]==option){
+                        break;
+                }
+                if (dhcpOptCallback[i]==0 && freeslot==DHCP_OPTIONS){
+                        freeslot=i;
+                }
+                i++;
+        }
+        if (i==DHCP_OPTIONS){
+                if (callback==0){
+                        return(1);
+                }
+                if (freeslot==DHCP_OPTIONS){
+                        return(0);
+                }
+                i=freeslot;
+        }
+        dhcpOptCode[i]=option;
+        dhcpOptCallback[i]=callback;
+        return(1);
+}
+
+// The part of a request we write, up to and with the mac in chaddr.
+// The rest of the 236 bytes (chaddr padding, sname and file) is zero.
+#define DHCP_HEAD_LEN 34
+// the longest option list we send
+#define DHCP_OPTS_LEN (4+3+9+12+6+6+2+sizeof(dhcpRequestList)+DHCP_OPTIONS+1)
+
+static uint8_t allOnes[4] = {255, 255, 255, 255};
+
 // Main DHCP message sending function, either DHCPDISCOVER or DHCPREQUEST
-void dhcp_send(uint8_t *buf, uint8_t requestType ) {
-        uint8_t lenpos,lencnt;
-        int i=0;
-        char c;
+// The message is streamed into the transmit buffer of the chip, the
+// packet buffer of the caller is not needed and stays intact.
+static void dhcp_send(uint8_t requestType ) {
+        uint8_t hdr[UDP_DATA_P];
+        uint8_t msg[DHCP_OPTS_LEN];
+        uint8_t lenpos;
+        uint8_t lencnt;
+        uint8_t i;
         haveDhcpAnswer=0;
         dhcp_ansError=0;
         dhcptid_l++; // increment for next request, finally wrap
-        // destination IP gets replaced after this call
-       
-        memset(buf, 0, 400); //XXX OUCH!   
-        send_udp_prepare(buf,(DHCPCLIENT_SRC_PORT_H<<8)|(dhcptid_l&0xff),dhcpip,DHCP_DEST_PORT);
-
-        memcpy(buf + ETH_SRC_MAC, macaddr, 6);
-        memset(buf + ETH_DST_MAC, 0xFF, 6);
-        buf[IP_TOTLEN_L_P]=0x82;
-        buf[IP_PROTO_P]=IP_PROTO_UDP_V;
-        memset(buf + IP_DST_P, 0xFF, 4);
-        buf[UDP_DST_PORT_L_P]=DHCP_SRC_PORT; 
-        buf[UDP_SRC_PORT_H_P]=0;
-        buf[UDP_SRC_PORT_L_P]=DHCP_DEST_PORT;
-
-        // Build DHCP Packet from buf[UDP_DATA_P]
-        // Make dhcpPtr start of UDP data buffer
-        dhcpData *dhcpPtr = &buf[UDP_DATA_P];
+
+        if( dhcpState == DHCP_STATE_RENEWING ) {
+                // renewing is unicast from our address to the server
+                send_udp_stream_begin(hdr,DHCP_DEST_PORT,dhcpserver,DHCP_SRC_PORT);
+        } else {
+                send_udp_stream_begin(hdr,(DHCPCLIENT_SRC_PORT_H<<8)|(dhcptid_l&0xff),allOnes,DHCP_DEST_PORT);
+
+                memcpy(hdr + ETH_SRC_MAC, macaddr, 6);
+                memset(hdr + ETH_DST_MAC, 0xFF, 6);
+                // without a lease we have no address yet
+                if( dhcpState != DHCP_STATE_REBINDING )
+                        memset(hdr + IP_SRC_P, 0, 4);
+                hdr[UDP_DST_PORT_L_P]=DHCP_SRC_PORT; 
+                hdr[UDP_SRC_PORT_H_P]=0;
+                hdr[UDP_SRC_PORT_L_P]=DHCP_DEST_PORT;
+        }
+
+        // Build the DHCP packet in msg, all fields not set are zero
+        // at the offsets of struct dhcpData, msg is too short to map it
+        memset(msg, 0, DHCP_HEAD_LEN);
         // 0-3 op, htype, hlen, hops
-        dhcpPtr->op = DHCP_BOOTREQUEST;
-        dhcpPtr->htype = 1;
-        dhcpPtr->hlen = 6;
-        dhcpPtr->hops = 0;
+        msg[0] = DHCP_BOOTREQUEST;
+        msg[1] = 1;
+        msg[2] = 6;
         // 4-7 xid
-        dhcpPtr->xid = currentXid;
+        memcpy(msg + 4, &currentXid, 4);
         // 8-9 secs
-        dhcpPtr->secs = currentSecs;
-        // 16-19 yiaddr
-        memset(dhcpPtr->yiaddr, 0, 4);
+        memcpy(msg + 8, &currentSecs, 2);
+        // 12-15 ciaddr, only set while we have a lease
+        if( dhcpState == DHCP_STATE_RENEWING || dhcpState == DHCP_STATE_REBINDING )
+                memcpy(msg + 12, dhcpip, 4);
         // 28-43 chaddr(16)
-        memcpy(dhcpPtr->chaddr, macaddr, 6);
+        memcpy(msg + 28, macaddr, 6);
+        send_udp_stream(msg, DHCP_HEAD_LEN);
+        send_udp_stream_zero(sizeof( dhcpData ) - DHCP_HEAD_LEN);
 
         // options defined as option, length, value
-        bufPtr = buf + UDP_DATA_P + sizeof( dhcpData );
+        bufPtr = msg;
         // Magic cookie 99, 130, 83 and 99
         addToBuf(99);
         addToBuf(130);
@@ -217,30 +446,43 @@ void dhcp_send(uint8_t *buf, uint8_t requestType ) {
         for( i=0; i<10; i++)
                 addToBuf(hostname[i]);
 
-        if( requestType == DHCPREQUEST ) {
+        if( requestType == DHCPREQUEST && dhcpState != DHCP_STATE_RENEWING &&
+            dhcpState != DHCP_STATE_REBINDING ) {
                 // Request IP address
                 addToBuf(50);     // Requested IP address
                 addToBuf(4);      // Length 
                 for( i=0; i<4; i++)
                         addToBuf(dhcpip[i]);
 
-                // Request using server ip address
-                addToBuf(54);     // Server IP address
-                addToBuf(4);      // Length 
-                for( i=0; i<4; i++)
-                        addToBuf(dhcpserver[i]);
+                // Request using server ip address, not in INIT-REBOOT
+                if( dhcpState != DHCP_STATE_REBOOT ) {
+                        addToBuf(54);     // Server IP address
+                        addToBuf(4);      // Length 
+                        for( i=0; i<4; i++)
+                                addToBuf(dhcpserver[i]);
+                }
         }
 
-        // Additional information in parameter list - minimal list for what we need
+        // Additional information in parameter list - what we need
+        // plus what the application registered
         addToBuf(55);     // Parameter request list
-        addToBuf(3);      // Length 
-        addToBuf(1);      // Subnet mask
-        addToBuf(3);      // Route/Gateway
-        addToBuf(6);      // DNS Server
+        lenpos = bufPtr - msg;
+        addToBuf(0);      // Length, filled in below
+        for( i=0; i<sizeof(dhcpRequestList); i++)
+                addToBuf(pgm_read_byte(&dhcpRequestList[i]));
+        lencnt = sizeof(dhcpRequestList);
+        for( i=0; i<DHCP_OPTIONS; i++) {
+                if( dhcpOptCallback[i] == 0 || dhcp_requested(dhcpOptCode[i]) )
+                        continue;
+                addToBuf(dhcpOptCode[i]);
+                lencnt++;
+        }
+        msg[lenpos] = lencnt;
 
         // payload len should be around 300
         addToBuf(255);      // end option
-        send_udp_transmit(buf, bufPtr - buf - UDP_DATA_P);
+        send_udp_stream(msg, bufPtr - msg);
+        send_udp_stream_end(hdr);
 }
 
 // Examine packet, if dhcp then process, if just exit.
@@ -252,55 +494,179 @@ void dhcp_send(uint8_t *buf, uint8_t requestType ) {
 // Return 0 for nothing processed, 1 for done soemthing
 uint8_t check_for_dhcp_answer(uint8_t *buf, uint16_t plen){
     // Map struct onto payload
-    dhcpData *dhcpPtr = &buf[UDP_DATA_P];
-    if (plen >= 70 && buf[UDP_SRC_PORT_L_P] == DHCP_SRC_PORT &&
+    dhcpData *dhcpPtr = (dhcpData *)&buf[UDP_DATA_P];
+    if (plen >= UDP_DATA_P + sizeof( dhcpData ) && buf[IP_PROTO_P] == IP_PROTO_UDP_V &&
+            buf[UDP_SRC_PORT_H_P] == 0 && buf[UDP_SRC_PORT_L_P] == DHCP_SRC_PORT &&
             dhcpPtr->op == DHCP_BOOTREPLY && dhcpPtr->xid == currentXid ) {
-        // Check for lease expiry
-        // uint32_t currentSecs = millis();
-        int optionIndex = UDP_DATA_P + sizeof( dhcpData ) + 4;
-        if( buf[optionIndex] == 53 )
-            switch( buf[optionIndex+2] ) {
-                case DHCPOFFER: return have_dhcpoffer( buf, plen );
-                case DHCPACK:   return have_dhcpack( buf, plen );
-            }
+        switch( dhcp_options( buf, plen ) ) {
+                case DHCPOFFER: if( dhcpState == DHCP_STATE_DISCOVER )
+                                    return have_dhcpoffer( buf, plen );
+                                break;
+                case DHCPACK:   if( dhcpState == DHCP_STATE_REQUEST ||
+                                    dhcpState == DHCP_STATE_REBOOT ||
+                                    dhcpState == DHCP_STATE_RENEWING ||
+                                    dhcpState == DHCP_STATE_REBINDING )
+                                    return have_dhcpack( buf, plen );
+                                break;
+                case DHCPNAK:   if( dhcpState == DHCP_STATE_REQUEST ||
+                                    dhcpState == DHCP_STATE_REBOOT ||
+                                    dhcpState == DHCP_STATE_RENEWING ||
+                                    dhcpState == DHCP_STATE_REBINDING )
+                                    return have_dhcpnak( buf, plen );
+                                break;
+        }
+    }
+    return 0;
+}
+
+// Find the options of a dhcp answer in a single bounds checked pass.
+// Pad options are skipped, it stops at the end option or at an option
+// that does not fit into the udp data. Fills dhcpOpt and returns the
+// message type, 0 if there is none or no magic cookie.
+static uint8_t dhcp_options(uint8_t *buf, uint16_t plen) {
+    uint8_t *ptr;
+    uint8_t *end;
+    uint16_t udplen;
+    uint8_t option;
+    uint8_t i;
+    memset(dhcpOpt, 0, sizeof(dhcpOpt));
+    // the ethernet frame may be padded
+    udplen = ((uint16_t)buf[UDP_LEN_H_P] << 8) | buf[UDP_LEN_L_P];
+    if (plen > UDP_SRC_PORT_H_P + udplen)
+        plen = UDP_SRC_PORT_H_P + udplen;
+    if (plen < UDP_DATA_P + sizeof( dhcpData ) + 4)
+        return 0;
+    ptr = buf + UDP_DATA_P + sizeof( dhcpData );
+    // Magic cookie 99, 130, 83 and 99
+    if (ptr[0] != 99 || ptr[1] != 130 || ptr[2] != 83 || ptr[3] != 99)
+        return 0;
+    ptr += 4;
+    end = buf + plen;
+    while (ptr < end) {
+        option = *ptr++;
+        if (option == 0)
+            continue;
+        if (option == 255)
+            break;
+        // the length byte and the data must be there
+        if (ptr >= end || *ptr >= end - ptr)
+            break;
+        for (i = 0; i < DHCP_I_BUILTIN; i++) {
+            if (pgm_read_byte(&dhcpOptTable[i * 2]) == option &&
+                    *ptr >= pgm_read_byte(&dhcpOptTable[i * 2 + 1]))
+                dhcpOpt[i] = ptr;
+        }
+        for (i = 0; i < DHCP_OPTIONS; i++) {
+            if (dhcpOptCallback[i] && dhcpOptCode[i] == option)
+                dhcpOpt[DHCP_I_BUILTIN + i] = ptr;
+        }
+        ptr += *ptr + 1;
+    }
+    if (dhcpOpt[DHCP_I_TYPE] == 0)
+        return 0;
+    return dhcpOpt[DHCP_I_TYPE][1];
+}
+
+// The router of the default route (0.0.0.0/0) in option 121, ptr is at
+// the length byte. Each route is the prefix width, the significant
+// octets of the destination and the router. RFC 3442.
+static uint8_t *dhcp_default_route(uint8_t *ptr) {
+    uint8_t len = *ptr++;
+    uint8_t n;
+    while (len) {
+        if (*ptr > 32)
+            return 0;
+        n = 1 + (*ptr + 7) / 8 + 4;
+        if (len < n)
+            return 0;
+        if (*ptr == 0)
+            return ptr + 1;
+        len -= n;
+        ptr += n;
     }
     return 0;
 }
 
+// lease times are in seconds, we keep milliseconds
+static uint32_t dhcp_option_ms(uint8_t *ptr) {
+    uint32_t secs = ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) |
+                    ((uint16_t)ptr[2] << 8) | ptr[3];
+    if (secs > DHCP_LEASE_MAX)
+        secs = DHCP_LEASE_MAX;
+    return secs * 1000;
+}
 
-uint8_t have_dhcpoffer (uint8_t *buf,uint16_t plen) {
+
+// Take our address and the options we want from an offer or ack,
+// dhcp_options has found them
+static void dhcp_parse_options(uint8_t *buf) {
     // Map struct onto payload
-    dhcpData *dhcpPtr = buf + UDP_DATA_P;
+    dhcpData *dhcpPtr = (dhcpData *)(buf + UDP_DATA_P);
+    uint8_t *route = 0;
     // Offered IP address is in yiaddr
     memcpy(dhcpip, dhcpPtr->yiaddr, 4);
-    // Scan through variable length option list identifying options we want
-    uint8_t *ptr = (uint8_t*) (dhcpPtr + 1) + 4;
-    do {
-        uint8_t option = *ptr++;
-        uint8_t optionLen = *ptr++;
-        uint8_t i;
-        switch (option) {
-            case 1:  memcpy(dhcpmask, ptr, 4);
-                     break;
-            case 3:  memcpy(gwaddr, ptr, 4);
-                     break;
-            case 6:  memcpy(dnsserver, ptr, 4);
-                     break;
-            case 51: leaseTime = 0;
-                     for (i = 0; i<4; i++)
-                         leaseTime = (leaseTime + ptr[i]) << 8;
-                     leaseTime *= 1000;      // milliseconds
-                     break;
-            case 54: memcpy(dhcpserver, ptr, 4);
-                     break;
-        }
-        ptr += optionLen;
-    } while (ptr < buf + plen);
+    if (dhcpOpt[DHCP_I_MASK])
+        memcpy(dhcpmask, dhcpOpt[DHCP_I_MASK] + 1, 4);
+    // with classless routes the router option is to be ignored
+    if (dhcpOpt[DHCP_I_ROUTES])
+        route = dhcp_default_route(dhcpOpt[DHCP_I_ROUTES]);
+    if (route == 0 && dhcpOpt[DHCP_I_ROUTER])
+        route = dhcpOpt[DHCP_I_ROUTER] + 1;
+    if (route)
+        memcpy(gwaddr, route, 4);
+    if (dhcpOpt[DHCP_I_DNS])
+        memcpy(dnsserver, dhcpOpt[DHCP_I_DNS] + 1, 4);
+    if (dhcpOpt[DHCP_I_LEASE])
+        leaseTime = dhcp_option_ms(dhcpOpt[DHCP_I_LEASE] + 1);
+    if (dhcpOpt[DHCP_I_SERVER])
+        memcpy(dhcpserver, dhcpOpt[DHCP_I_SERVER] + 1, 4);
+    leaseT1 = 0;
+    leaseT2 = 0;
+    if (dhcpOpt[DHCP_I_T1])
+        leaseT1 = dhcp_option_ms(dhcpOpt[DHCP_I_T1] + 1);
+    if (dhcpOpt[DHCP_I_T2])
+        leaseT2 = dhcp_option_ms(dhcpOpt[DHCP_I_T2] + 1);
+    // without options 58/59 or when they make no sense
+    // T1 is half the lease and T2 is 7/8 of it
+    if (leaseT2 == 0 || leaseT2 >= leaseTime)
+        leaseT2 = leaseTime / 8 * 7;
+    if (leaseT1 == 0 || leaseT1 > leaseT2)
+        leaseT1 = leaseTime / 2;
+    if (leaseT1 > leaseT2)
+        leaseT1 = leaseT2;
+}
+
+// have_dhcpoffer, have_dhcpack and have_dhcpnak are called by
+// check_for_dhcp_answer once dhcp_options has checked the packet
+// against plen, they rely on that and must not be called directly.
+uint8_t have_dhcpoffer (uint8_t *buf,uint16_t plen) {
+    (void)plen;
+    dhcp_parse_options( buf );
     dhcp_request_ip( buf );
     return 1;
 }
 
+// The ack to a request, also while renewing or rebinding. The values in
+// it replace those of the offer, the lease starts again now.
 uint8_t have_dhcpack (uint8_t *buf,uint16_t plen) {
+    uint8_t i;
+    (void)plen;
+    dhcp_parse_options( buf );
+    // the options the application asked for
+    for (i = 0; i < DHCP_OPTIONS; i++) {
+        if (dhcpOpt[DHCP_I_BUILTIN + i] && dhcpOptCallback[i])
+            (*dhcpOptCallback[i])(dhcpOptCode[i], dhcpOpt[DHCP_I_BUILTIN + i] + 1, *dhcpOpt[DHCP_I_BUILTIN + i]);
+    }
+    // a new lease or a new server, keep it for the next reset
+    if (leaseSave && (dhcpState == DHCP_STATE_REQUEST || dhcpState == DHCP_STATE_REBINDING)) {
+        uint8_t lease[DHCP_LEASE_LEN];
+        memcpy(lease, dhcpip, 4);
+        memcpy(lease + 4, dhcpmask, 4);
+        memcpy(lease + 8, gwaddr, 4);
+        memcpy(lease + 12, dnsserver, 4);
+        memcpy(lease + 16, dhcpserver, 4);
+        (*leaseSave)(lease);
+    }
     dhcpState = DHCP_STATE_OK;
     leaseStart = millis();
     // Turn off broadcast. Application if it needs it can re-enable it
@@ -308,6 +674,20 @@ uint8_t have_dhcpack (uint8_t *buf,uint16_t plen) {
     return 2;
 }
 
+// The server refused our request or does not want us to keep the
+// address. Report DHCP_STATE_RENEW so the application starts over.
+// A refused INIT-REBOOT goes on with DHCPDISCOVER.
+uint8_t have_dhcpnak (uint8_t *buf,uint16_t plen) {
+    (void)buf;
+    (void)plen;
+    if (dhcpState == DHCP_STATE_REBOOT) {
+        dhcp_discover();
+        return 3;
+    }
+    dhcpState = DHCP_STATE_RENEW;
+    return 3;
+}
+
 #endif
 
 /* end of dhcp.c */
@@ -25,11 +25,17 @@ extern void dhcp_start(uint8_t *buf, uint8_t *macaddrin, uint8_t *ipaddrin,
                 uint8_t *dnssvrin );
 
 extern uint8_t dhcp_state( void );
+extern uint8_t dhcp_poll(uint8_t *buf, uint16_t plen);
+
+extern void dhcp_lease_persist(uint8_t (*load)(uint8_t *lease), void (*save)(uint8_t *lease));
+extern uint8_t dhcp_option_register(uint8_t option, void (*callback)(uint8_t option, uint8_t *data, uint8_t len));
 
 uint8_t check_for_dhcp_answer(uint8_t *buf,uint16_t plen);
 
+// only valid after check_for_dhcp_answer has parsed the options of buf
 uint8_t have_dhcpoffer(uint8_t *buf,uint16_t plen);
 uint8_t have_dhcpack(uint8_t *buf,uint16_t plen);
+uint8_t have_dhcpnak(uint8_t *buf,uint16_t plen);
 
 #endif /* UDP_client */
 #endif /* DHCP_H */
@@ -16,6 +16,11 @@
 #include "ip_config.h"
 #include "net.h"
 #include "ip_arp_udp_tcp.h"
+#if (ARDUINO >= 100)
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
 
 #if defined (UDP_client) 
 static uint8_t dnstid_l=0; // a counter for transaction ID
@@ -26,6 +31,129 @@ static uint8_t haveDNSanswer=0;
 static uint8_t dns_answerip[4];
 static uint8_t dns_ansError=0;
 
+#ifdef DNS_CACHE_SIZE
+// The dns cache: names we looked up with their ip until the ttl of the
+// answer runs out, and names that do not exist (NXDOMAIN) for
+// DNS_CACHE_NEG_TTL seconds. Names are kept as a hash only. The most
+// recently used entry is at the front, a new name takes the first free
+// entry or, if there is none, replaces the last one.
+// Longer ttls than DNS_CACHE_MAX_TTL seconds are cut, millis() wraps.
+#ifndef DNS_CACHE_MAX_TTL
+#define DNS_CACHE_MAX_TTL 86400
+#endif
+#ifndef DNS_CACHE_NEG_TTL
+#define DNS_CACHE_NEG_TTL 60
+#endif
+#define DNS_FREE 0
+#define DNS_RESOLVED 1
+#define DNS_NXDOMAIN 2
+
+typedef struct dnsEntry {
+        uint16_t hash;          // of the name, see dns_hash
+        uint8_t ip[4];
+        uint8_t state;          // DNS_xxx
+        uint32_t expires;       // millis() when the entry is no longer valid
+} dnsEntry;
+
+static dnsEntry dns_cache[DNS_CACHE_SIZE];
+// hash of the name in the last request
+static uint16_t dns_reqhash;
+
+// hash of a host name, upper and lower case are the same
+static uint16_t dns_hash(uint8_t *name)
+{
+        uint16_t h=5381;
+        uint8_t c;
+        while((c=*name++)){
+                if (c>='A' && c<='Z'){
+                        c+='a'-'A';
+                }
+                h=((h<<5)+h)^c;
+        }
+        return(h);
+}
+
+// position of the entry for hash in the cache or DNS_CACHE_SIZE,
+// entries that have run out are dropped on the way
+static uint8_t dns_cache_find(uint16_t hash)
+{
+        uint8_t i=0;
+        while(i<DNS_CACHE_SIZE){
+                if (dns_cache[i].state!=DNS_FREE){
+                        if ((int32_t)(dns_cache[i].expires-millis())<=0){
+                                dns_cache[i].state=DNS_FREE;
+                        }else if (dns_cache[i].hash==hash){
+                                return(i);
+                        }
+                }
+                i++;
+        }
+        return(i);
+}
+
+// move entry i to the front, the entry at the end is the one to replace
+static dnsEntry *dns_cache_touch(uint8_t i)
+{
+        dnsEntry e=dns_cache[i];
+        while(i>0){
+                dns_cache[i]=dns_cache[i-1];
+                i--;
+        }
+        dns_cache[0]=e;
+        return(&dns_cache[0]);
+}
+
+// keep the answer to the last request for ttl seconds
+static void dns_cache_store(uint8_t state,uint8_t *ip,uint32_t ttl)
+{
+        dnsEntry *e;
+        uint8_t i;
+        if (ttl==0){
+                return;
+        }
+        if (ttl>DNS_CACHE_MAX_TTL){
+                ttl=DNS_CACHE_MAX_TTL;
+        }
+        i=dns_cache_find(dns_reqhash);
+        if (i==DNS_CACHE_SIZE){
+                // dns_cache_find has freed the entries that ran out
+                i=0;
+                while(i<DNS_CACHE_SIZE-1 && dns_cache[i].state!=DNS_FREE){
+                        i++;
+                }
+        }
+        e=dns_cache_touch(i);
+        e->hash=dns_reqhash;
+        e->state=state;
+        if (ip){
+                memcpy(e->ip,ip,4);
+        }
+        e->expires=millis()+ttl*1000;
+}
+
+// Look hostname up in the cache. Returns 1 if its ip is known, it is
+// then available with dnslkup_getip and dnslkup_haveanswer returns 1.
+// Returns 2 if the name is known not to exist, 0 if it is not in the
+// cache and has to be requested with dnslkup_request.
+uint8_t dnslkup_cached(uint8_t *hostname)
+{
+        uint8_t i=dns_cache_find(dns_hash(hostname));
+        if (i==DNS_CACHE_SIZE){
+                return(0);
+        }
+        dns_cache_touch(i);
+        if (dns_cache[0].state==DNS_NXDOMAIN){
+                haveDNSanswer=0;
+                dns_ansError=3;
+                return(2);
+        }
+        memcpy(dns_answerip,dns_cache[0].ip,4);
+        haveDNSanswer=1;
+        dns_ansError=0;
+        return(1);
+}
+#endif // DNS_CACHE_SIZE
+
 
 uint8_t dnslkup_haveanswer(void)
 {       
@@ -54,6 +182,9 @@ void dnslkup_request(uint8_t *buf, uint8_t  *hostname)
         haveDNSanswer=0;
         dns_ansError=0;
         dnstid_l++; // increment for next request, finally wrap
+#ifdef DNS_CACHE_SIZE
+        dns_reqhash=dns_hash(hostname);
+#endif
         send_udp_prepare(buf,(DNSCLIENT_SRC_PORT_H<<8)|(dnstid_l&0xff),dnsip,53);
         // fill tid:
         //buf[UDP_DATA_P] see below
@@ -108,7 +239,9 @@ void dnslkup_request(uint8_t *buf, uint8_t  *hostname)
 // return 1 on sucessful processing of answer.
 // We set also the variable haveDNSanswer
 uint8_t udp_client_check_for_dns_answer(uint8_t *buf,uint16_t plen){
-        uint8_t j,i;
+        uint8_t j;
+        uint16_t i;
+        uint16_t rdlen;
         if (plen<70){
                 return(0);
         }
@@ -135,6 +268,14 @@ uint8_t udp_client_check_for_dns_answer(uint8_t *buf,uint16_t plen){
                 return(0);
         }
         // check flags lower byte:
+        if ((buf[UDP_DATA_P+3]&0x0F)==3){
+                // the name does not exist
+                dns_ansError=3;
+#ifdef DNS_CACHE_SIZE
+                dns_cache_store(DNS_NXDOMAIN,0,DNS_CACHE_NEG_TTL);
+#endif
+                return(0);
+        }
         if ((buf[UDP_DATA_P+3]&0x8F)!=0x80){ 
                 // there is an error or server does not support recursive
                 // queries. We can only work with servers that support recursive
@@ -149,6 +290,10 @@ uint8_t udp_client_check_for_dns_answer(uint8_t *buf,uint16_t plen){
         // jump over it to find the IP. This part can be abbreviated by
         // the use of 2 byte pointers. See RFC 1035.
         i=12+buf[UDP_DATA_P]; // we encoded the query len into tid
+        if (UDP_DATA_P+i+12>plen){
+                dns_ansError=2;
+                return(0);
+        }
         if (buf[UDP_DATA_P+i] & 0xc0){
                 // pointer
                 i+=2;
@@ -167,8 +312,23 @@ uint8_t udp_client_check_for_dns_answer(uint8_t *buf,uint16_t plen){
         int numAnswers = buf[UDP_DATA_P+7];
         int ansNum = 0;
 
-        while( buf[UDP_DATA_P+i+1] != 1 && ansNum < numAnswers ) {
-                i += buf[UDP_DATA_P+i+9] + 12;
+        // skip answers that are not an A record (e.g. a CNAME), each is
+        // type, class, ttl, data length, data and the 2 byte name
+        // pointer of the next one. Stop at the end of the packet.
+        while( ansNum < numAnswers ) {
+                if (UDP_DATA_P+i+12>plen){
+                        dns_ansError=2;
+                        return(0);
+                }
+                if (buf[UDP_DATA_P+i]==0 && buf[UDP_DATA_P+i+1]==1){
+                        break;
+                }
+                rdlen=((uint16_t)buf[UDP_DATA_P+i+8]<<8)|buf[UDP_DATA_P+i+9];
+                if (rdlen>plen){
+                        dns_ansError=2;
+                        return(0);
+                }
+                i += rdlen + 12;
                 ansNum++;
         }
         
@@ -176,6 +336,11 @@ uint8_t udp_client_check_for_dns_answer(uint8_t *buf,uint16_t plen){
                 dns_ansError=2; // not IPv4
                 return(0);
         }
+        // an A record has exactly 4 bytes of data
+        if (UDP_DATA_P+i+14>plen || buf[UDP_DATA_P+i+8]!=0 || buf[UDP_DATA_P+i+9]!=4){
+                dns_ansError=2;
+                return(0);
+        }
         i+=10;
         j=0;
         while(j<4){
@@ -183,6 +348,12 @@ uint8_t udp_client_check_for_dns_answer(uint8_t *buf,uint16_t plen){
                 j++;
         }
         haveDNSanswer=1;
+#ifdef DNS_CACHE_SIZE
+        // the ttl is in the 4 bytes before the data length
+        dns_cache_store(DNS_RESOLVED,dns_answerip,
+                        ((uint32_t)buf[UDP_DATA_P+i-6]<<24)|((uint32_t)buf[UDP_DATA_P+i-5]<<16)|
+                        ((uint16_t)buf[UDP_DATA_P+i-4]<<8)|buf[UDP_DATA_P+i-3]);
+#endif
         return(1);
 }
 
@@ -21,7 +21,8 @@ extern void dnslkup_request(uint8_t *buf, uint8_t *progmem_hostname);
 //extern void dnslkup_request(uint8_t *buf,const prog_char *progmem_hostname);
 // returns 1 if we have an answer from an DNS server and an IP
 extern uint8_t dnslkup_haveanswer(void);
-// get information about any error (zero means no error, otherwise see dnslkup.c)
+// get information about any error (zero means no error, 3 means the name
+// does not exist, otherwise see dnslkup.c)
 extern uint8_t dnslkup_get_error_info(void);
 // loop over this function to search for the answer of the
 // DNS server.
@@ -34,6 +35,12 @@ extern uint8_t *dnslkup_getip(void);
 // set DNS server to be used for lookups.
 extern void dnslkup_set_dnsip(uint8_t *dnsipaddr);
 
+#ifdef DNS_CACHE_SIZE
+// answer from the cache: 1 if the ip of hostname is known (see
+// dnslkup_getip), 2 if the name does not exist, 0 if it is not cached
+extern uint8_t dnslkup_cached(uint8_t *hostname);
+#endif
+
 #endif /* UDP_client */
 #endif /* DNSLKUP_H */
 //@}
@@ -15,9 +15,11 @@
 // Updated 16/06/2010 ADL Added configurable CS, 16 bit writes and reads.
 
 
+#include "ip_config.h"
 #include "enc28j60.h"
 #include <avr/io.h>
 #include <inttypes.h>
+#include <string.h>
 #include <avr/interrupt.h>
 #if (ARDUINO >= 100)
 #include <Arduino.h>
@@ -27,11 +29,60 @@
 
 static uint8_t Enc28j60Bank;
 static uint16_t gNextPacketPtr;
+// packet being read with enc28j60PacketBegin/enc28j60PacketRead
+static uint16_t gPacketStart;
+static uint16_t gPacketReadPos;
+// buffer layout set up by enc28j60InitWithLayout: end of the receive
+// buffer, number and start of the transmit slots, scratch region
+static uint16_t gRxStop;
+static uint8_t gTxSlots;
+static uint16_t gTxFirst;
+static uint16_t gScratchStart;
+static uint16_t gScratchSize;
+// receive buffer overflows (EIR_RXERIF) seen so far, and whether the
+// receive buffer is too small to skip the check with one packet waiting
+static uint16_t gRxOverflows;
+static uint8_t gRxCheckAlways;
+// transmit slot being filled, its start address, the slot whose
+// frame was handed to the chip last and the frame end for ETXND
+static uint8_t gTxSlot;
+static uint16_t gTxBase;
+static uint8_t gTxBusy;
+static uint16_t gTxEnd;
+// ETXST as last written
+static uint16_t gTxStart;
+// slots whose frame is kept to be sent again (a bit per slot) and the
+// frame end of each, see enc28j60TxHold
+static uint8_t gTxHeld;
+static uint16_t gTxHeldEnd[4];
 static uint8_t erxfcon;
 
+// Interrupt driven receive, see enc28j60EnableInterrupt. The interrupt
+// handler is the only writer of evHead, the main loop the only writer
+// of evTail, so the ring needs no locking. It must be a power of 2.
+#ifndef ENC28J60_EV_RING
+#define ENC28J60_EV_RING 4
+#endif
+static uint8_t irqMode;
+static volatile uint8_t evRing[ENC28J60_EV_RING];
+static volatile uint8_t evHead;
+static volatile uint8_t evTail;
+// events taken off the ring but not yet handled
+static uint8_t evPending;
+
+#ifdef ENC28J60_SPI_STATS
+// chip select cycles per SPI opcode (op>>5) and bank switches
+static uint32_t spiCount[8];
+static uint32_t spiBankCount;
+#define SPI_COUNT(op) spiCount[(op)>>5]++
+#else
+#define SPI_COUNT(op)
+#endif
+
 // Where we set the CS pin number
 static uint8_t enc28j60ControlCs = DEFAULT_ENC28J60_CONTROL_CS;
 
+#ifndef ENC28J60_HOST
 #define waitspi() while(!(SPSR&(1<<SPIF)))
 
 // Enable ENC28J60 after disabling interupts
@@ -61,7 +112,7 @@ static void sendSPI(byte data) {
 }
 
 
-uint8_t enc28j60ReadOp(uint8_t op, uint8_t address)
+static uint8_t spiReadOp(uint8_t op, uint8_t address)
 {
         enableChip();
         // issue read command
@@ -76,7 +127,7 @@ uint8_t enc28j60ReadOp(uint8_t op, uint8_t address)
         return result;
 }
 
-void enc28j60WriteOp(uint8_t op, uint8_t address, uint8_t data)
+static void spiWriteOp(uint8_t op, uint8_t address, uint8_t data)
 {
     enableChip();
     sendSPI(op | (address & ADDR_MASK));
@@ -84,20 +135,7 @@ void enc28j60WriteOp(uint8_t op, uint8_t address, uint8_t data)
     disableChip();
 }
 
-void enc28j60PowerDown() {
- enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_RXEN);
- while(enc28j60Read(ESTAT) & ESTAT_RXBUSY);
- while(enc28j60Read(ECON1) & ECON1_TXRTS);
- enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PWRSV);
-}
-
-void enc28j60PowerUp() {
- enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON2, ECON2_PWRSV);
- while(!enc28j60Read(ESTAT) & ESTAT_CLKRDY);
-}
-
-
-void enc28j60ReadBuffer(uint16_t len, uint8_t* data)
+static void spiReadBuffer(uint16_t len, uint8_t* data)
 {
     enableChip();
     sendSPI(ENC28J60_READ_BUF_MEM);
@@ -110,14 +148,7 @@ void enc28j60ReadBuffer(uint16_t len, uint8_t* data)
 //    *data='\0';
 }
 
-static word enc28j60ReadBufferWord() {
-    word result;
-    enc28j60ReadBuffer(2, (byte*) &result);
-    return result;
-}
-
-
-void enc28j60WriteBuffer(uint16_t len, uint8_t* data)
+static void spiWriteBuffer(uint16_t len, uint8_t* data)
 {
     enableChip();
     sendSPI(ENC28J60_WRITE_BUF_MEM);
@@ -127,12 +158,108 @@ void enc28j60WriteBuffer(uint16_t len, uint8_t* data)
     disableChip();
 }
 
+static const enc28j60Transport spiTransport = {
+    spiReadOp, spiWriteOp, spiReadBuffer, spiWriteBuffer
+};
+
+static const enc28j60Transport *transport = &spiTransport;
+#else
+// Native build: there is no SPI port, a transport must be set with
+// enc28j60SetTransport before enc28j60InitWithCs is called.
+static const enc28j60Transport *transport = 0;
+#endif
+
+void enc28j60SetTransport(const enc28j60Transport *t)
+{
+    transport = t;
+}
+
+uint8_t enc28j60ReadOp(uint8_t op, uint8_t address)
+{
+    SPI_COUNT(op);
+    return transport->readOp(op, address);
+}
+
+void enc28j60WriteOp(uint8_t op, uint8_t address, uint8_t data)
+{
+    SPI_COUNT(op);
+    transport->writeOp(op, address, data);
+}
+
+void enc28j60ReadBuffer(uint16_t len, uint8_t* data)
+{
+    SPI_COUNT(ENC28J60_READ_BUF_MEM);
+    transport->readBuffer(len, data);
+}
+
+void enc28j60WriteBuffer(uint16_t len, uint8_t* data)
+{
+    SPI_COUNT(ENC28J60_WRITE_BUF_MEM);
+    transport->writeBuffer(len, data);
+}
+
+#ifdef ENC28J60_SPI_STATS
+// Number of chip select cycles with the given SPI opcode, e.g.
+// ENC28J60_WRITE_CTRL_REG, since the last enc28j60SpiCountClear.
+// ENC28J60_BANK_SWITCH gives the bank switches, which are part of
+// the bit field set/clear count.
+uint32_t enc28j60SpiCount(uint8_t op)
+{
+    if (op == ENC28J60_BANK_SWITCH) {
+        return spiBankCount;
+    }
+    return spiCount[op>>5];
+}
+
+void enc28j60SpiCountClear(void)
+{
+    uint8_t i=0;
+    while(i<8){
+        spiCount[i]=0;
+        i++;
+    }
+    spiBankCount=0;
+}
+#endif
+
+void enc28j60PowerDown() {
+ enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_RXEN);
+ while(enc28j60Read(ESTAT) & ESTAT_RXBUSY);
+ while(enc28j60Read(ECON1) & ECON1_TXRTS);
+ enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PWRSV);
+}
+
+void enc28j60PowerUp() {
+ enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON2, ECON2_PWRSV);
+ while(!enc28j60Read(ESTAT) & ESTAT_CLKRDY);
+}
+
+
+// Select the register bank of address. The current bank is kept in
+// Enc28j60Bank, so only a change costs SPI transfers, and then only
+// the BSEL bits that differ are cleared or set. The registers from
+// EIE up are mapped into every bank and never need a switch.
 void enc28j60SetBank(uint8_t address)
 {
-    if ((address & BANK_MASK) != Enc28j60Bank) {
-        enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_BSEL1|ECON1_BSEL0);
-        Enc28j60Bank = address & BANK_MASK;
-        enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, Enc28j60Bank>>5);
+    uint8_t bank;
+    uint8_t bits;
+    if ((address & ADDR_MASK) >= (EIE & ADDR_MASK)) {
+        return;
+    }
+    bank = address & BANK_MASK;
+    if (bank != Enc28j60Bank) {
+#ifdef ENC28J60_SPI_STATS
+        spiBankCount++;
+#endif
+        bits = (Enc28j60Bank & ~bank)>>5;
+        if (bits) {
+            enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, bits);
+        }
+        bits = (bank & ~Enc28j60Bank)>>5;
+        if (bits) {
+            enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, bits);
+        }
+        Enc28j60Bank = bank;
     }
 }
 
@@ -144,9 +271,13 @@ uint8_t enc28j60Read(uint8_t address)
         return enc28j60ReadOp(ENC28J60_READ_CTRL_REG, address);
 }
 
+// 16 bit registers, the low byte must be written first. The chip does
+// not step the register address within one chip select, so these are
+// always two write operations, but both halves are in the same bank.
 void enc28j60WriteWord(byte address, word data) {
-    enc28j60Write(address, data & 0xff);
-    enc28j60Write(address + 1, data >> 8);
+    enc28j60SetBank(address);
+    enc28j60WriteOp(ENC28J60_WRITE_CTRL_REG, address, data & 0xff);
+    enc28j60WriteOp(ENC28J60_WRITE_CTRL_REG, address + 1, data >> 8);
 }
 
 // read upper 8 bits
@@ -204,6 +335,7 @@ void enc28j60clkout(uint8_t clk)
 }
 
 void enc28j60SpiInit() {
+#ifndef ENC28J60_HOST
 	pinMode(SPI_SS, OUTPUT);
        	digitalWrite(SPI_SS, HIGH);
 	pinMode(SPI_MOSI, OUTPUT);
@@ -221,6 +353,7 @@ void enc28j60SpiInit() {
         SPCR = _BV(SPE) | _BV(MSTR) | _BV(SPR0);
 #endif
         SPSR |= _BV(SPI2X);
+#endif
 }
 
 // Single parameter init
@@ -229,17 +362,62 @@ void enc28j60Init(uint8_t* macaddr)
         enc28j60InitWithCs(macaddr, DEFAULT_ENC28J60_CONTROL_CS );
 }
 
+// init with the default buffer layout (ENC28J60_TX_SLOTS, no scratch)
 void enc28j60InitWithCs( uint8_t* macaddr, uint8_t csPin )
 {
+        enc28j60InitWithLayout(macaddr, csPin, 0);
+}
+
+// Init with a buffer layout chosen at run time. The 8K buffer RAM is
+// split from the top: layout->txSlots transmit slots of TXSLOT_SIZE
+// bytes, below them layout->scratchSize bytes of scratch memory (see
+// enc28j60ScratchWrite) and the rest is the receive buffer. A sketch
+// that mostly sends takes more slots, a server keeps the receive buffer
+// large. At least one slot and TXSLOT_SIZE bytes of receive buffer are
+// always kept, the scratch size is cut down if needed. layout=0 gives
+// the default layout.
+void enc28j60InitWithLayout( uint8_t* macaddr, uint8_t csPin, const enc28j60Layout *layout )
+{
+        uint8_t pattern[14];
+        uint8_t mask[8];
+        uint16_t scratch = 0;
+        gTxSlots = ENC28J60_TX_SLOTS;
+        if (layout) {
+                gTxSlots = layout->txSlots;
+                scratch = layout->scratchSize;
+        }
+        if (gTxSlots==0){
+                gTxSlots=1;
+        }
+        if (gTxSlots>4){
+                gTxSlots=4;
+        }
+        gTxFirst = TXSTOP_INIT - gTxSlots*TXSLOT_SIZE;
+        // keep the receive buffer end where it was for an even size
+        scratch &= 0xfffe;
+        if (scratch > gTxFirst - TXSLOT_SIZE) {
+                scratch = (gTxFirst - TXSLOT_SIZE) & 0xfffe;
+        }
+        gScratchSize = scratch;
+        gScratchStart = gTxFirst - scratch;
+        gRxStop = gScratchStart - 1;
+        // with room for two full frames the buffer can only overflow
+        // while more than one packet is waiting
+        gRxCheckAlways = (gRxStop - RXSTART_INIT + 1) < 2*TXSLOT_SIZE;
+        gRxOverflows = 0;
 	// initialize I/O
         enc28j60ControlCs = csPin; 
         // ss as output:
 	pinMode(csPin, OUTPUT);
+#ifndef ENC28J60_HOST
 	disableChip(); // ss=0
+#endif
 
 	// perform system reset
 	enc28j60WriteOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
 	delay(50);
+        // the reset selects bank 0
+        Enc28j60Bank = 0;
 	// check CLKRDY bit to see if reset is complete
         // The CLKRDY does not work. See Rev. B4 Silicon Errata point. Just wait.
 	//while(!(enc28j60Read(ESTAT) & ESTAT_CLKRDY));
@@ -253,11 +431,16 @@ void enc28j60InitWithCs( uint8_t* macaddr, uint8_t csPin )
 	// set receive pointer address
 	enc28j60WriteWord(ERXRDPTL, RXSTART_INIT);
 	// RX end
-	enc28j60WriteWord(ERXNDL, RXSTOP_INIT);
+	enc28j60WriteWord(ERXNDL, gRxStop);
 	// TX start
-	enc28j60WriteWord(ETXSTL, TXSTART_INIT);
+	enc28j60WriteWord(ETXSTL, gTxFirst);
 	// TX end
 	enc28j60WriteWord(ETXNDL, TXSTOP_INIT);
+        gTxStart = gTxFirst;
+        // the first frame goes into slot 0
+        gTxSlot = gTxSlots-1;
+        gTxBusy = 0xff;
+        gTxHeld = 0;
 	// do bank 1 stuff, packet filter:
         // For broadcast packets we allow only ARP packtets
         // All other packets should be unicast only for our mac (MAADR)
@@ -274,8 +457,13 @@ void enc28j60InitWithCs( uint8_t* macaddr, uint8_t csPin )
 	//enc28j60Write(ERXFCON, ERXFCON_UCEN|ERXFCON_CRCEN|ERXFCON_PMEN|ERXFCON_BCEN);
         erxfcon =  ERXFCON_UCEN|ERXFCON_CRCEN|ERXFCON_PMEN|ERXFCON_BCEN;
 	enc28j60Write(ERXFCON, erxfcon );
-	enc28j60WriteWord(EPMM0, 0x303f);
-	enc28j60WriteWord(EPMCSL, 0xf7f9);
+        memset(pattern, 0xff, 6);
+        pattern[12] = 0x08;
+        pattern[13] = 0x06;
+        memset(mask, 0, 8);
+        mask[0] = 0x3f;
+        mask[1] = 0x30;
+        enc28j60SetPattern(0, mask, pattern);
         //
 	// do bank 2 stuff
 	// enable MAC receive
@@ -303,7 +491,7 @@ void enc28j60InitWithCs( uint8_t* macaddr, uint8_t csPin )
 	// no loopback of transmitted frames
 	enc28j60PhyWrite(PHCON2, PHCON2_HDLDIS);
 	// switch to bank 0
-	enc28j60SetBank(ECON1);
+	enc28j60SetBank(ERDPTL);
 	// enable interrutps
 	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE|EIE_PKTIE);
 	// enable packet reception
@@ -323,27 +511,125 @@ uint8_t enc28j60getrev(void)
 	return(rev);
 }
 
+// ERXFCON is shadowed in erxfcon, it is only written if it changes
+static void enc28j60SetRxFilter(uint8_t f)
+{
+        if (f != erxfcon) {
+                erxfcon = f;
+                enc28j60Write(ERXFCON, erxfcon);
+        }
+}
+
 // A number of utility functions to enable/disable broadcast and multicast bits
 void enc28j60EnableBroadcast( void ) {
-	erxfcon |= ERXFCON_BCEN;
-	enc28j60Write(ERXFCON, erxfcon);
+	enc28j60SetRxFilter(erxfcon | ERXFCON_BCEN);
 }
 
 void enc28j60DisableBroadcast( void ) {
-	erxfcon &= (0xff ^ ERXFCON_BCEN);
-	enc28j60Write(ERXFCON, erxfcon);
+	enc28j60SetRxFilter(erxfcon & (0xff ^ ERXFCON_BCEN));
 }
 
 void enc28j60EnableMulticast( void ) {
-	erxfcon |= ERXFCON_MCEN;
-	enc28j60Write(ERXFCON, erxfcon);
+	enc28j60SetRxFilter(erxfcon | ERXFCON_MCEN);
 }
 
 void enc28j60DisableMulticast( void ) {
-	erxfcon &= (0xff ^ ERXFCON_MCEN);
-	enc28j60Write(ERXFCON, erxfcon);
+	enc28j60SetRxFilter(erxfcon & (0xff ^ ERXFCON_MCEN));
+}
+
+
+// Program the pattern match filter. The chip looks at a window of 64
+// bytes starting offset bytes into the frame (0 is the first byte of
+// the destination mac). Bit n of the 8 byte mask (bit 0 of mask[0] is
+// the first byte) selects the window bytes that must be equal to
+// bytes[n]; bytes is indexed like the window and only the selected
+// positions are used. The chip compares the IP checksum of the selected
+// bytes, which is calculated here (datasheet 8.2). The filter is
+// or-ed with the others in ERXFCON, e.g. to admit only some broadcasts
+// call enc28j60DisableBroadcast and match on the broadcast address.
+void enc28j60SetPattern(uint16_t offset, const uint8_t *mask, const uint8_t *bytes)
+{
+        uint32_t sum=0;
+        uint8_t odd=0;
+        uint8_t i=0;
+        while(i<64){
+                if (mask[i>>3] & (1<<(i&7))){
+                        // the selected bytes are summed as one stream
+                        if (odd){
+                                sum+=bytes[i];
+                        }else{
+                                sum+=(uint16_t)bytes[i]<<8;
+                        }
+                        odd^=1;
+                }
+                i++;
+        }
+        while(sum>>16){
+                sum=(sum & 0xffff)+(sum>>16);
+        }
+        i=0;
+        while(i<8){
+                enc28j60Write(EPMM0+i, mask[i]);
+                i++;
+        }
+        enc28j60WriteWord(EPMCSL, (uint16_t)~sum);
+        enc28j60WriteWord(EPMOL, offset);
+        enc28j60SetRxFilter(erxfcon | ERXFCON_PMEN);
 }
 
+// switch the pattern match filter off
+void enc28j60DisablePattern(void)
+{
+        enc28j60SetRxFilter(erxfcon & (0xff ^ ERXFCON_PMEN));
+}
+
+// Bucket 0-63 of the hash table filter for a destination mac address:
+// bits 28:23 of the ethernet CRC-32 over the address (datasheet 8.2).
+// The bucket is bit h&7 of register EHT0+(h>>3).
+uint8_t enc28j60Hash(const uint8_t *mac)
+{
+        uint32_t crc=0xffffffff;
+        uint8_t i=0;
+        uint8_t j;
+        uint8_t b;
+        uint8_t bit;
+        while(i<6){
+                b=mac[i];
+                j=0;
+                // the bytes go over the wire least significant bit first
+                while(j<8){
+                        bit=((uint8_t)(crc>>31) ^ b) & 1;
+                        crc<<=1;
+                        if (bit){
+                                crc^=0x04c11db7;
+                        }
+                        b>>=1;
+                        j++;
+                }
+                i++;
+        }
+        return((crc>>23) & 0x3f);
+}
+
+// Load the 8 bytes of the hash table filter (EHT0-EHT7) and accept the
+// multicast frames whose bucket is set. An empty table switches the
+// filter off. Frames to the other multicast addresses are dropped by
+// the chip unless enc28j60EnableMulticast was called.
+void enc28j60SetHashTable(const uint8_t *eht)
+{
+        uint8_t i=0;
+        uint8_t any=0;
+        while(i<8){
+                enc28j60Write(EHT0+i, eht[i]);
+                any|=eht[i];
+                i++;
+        }
+        if (any){
+                enc28j60SetRxFilter(erxfcon | ERXFCON_HTEN);
+        }else{
+                enc28j60SetRxFilter(erxfcon & (0xff ^ ERXFCON_HTEN));
+        }
+}
 
 // link status
 uint8_t enc28j60linkup(void)
@@ -352,9 +638,98 @@ uint8_t enc28j60linkup(void)
 	return(enc28j60PhyReadH(PHSTAT2) && 4);
 }
 
-void enc28j60PacketSend(uint16_t len, uint8_t* packet)
+// Switch from polling EPKTCNT to interrupt driven receive. irq is the
+// number of the external interrupt the INT pin of the ENC28J60 is
+// wired to (0 is digital pin 2 on an Uno). From then on
+// enc28j60PacketBegin does not touch the SPI bus until the chip has
+// signaled an event.
+void enc28j60EnableInterrupt(uint8_t irq)
+{
+        // INT stays high until the main loop is ready for events
+        enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIE, EIE_INTIE);
+        evHead = 0;
+        evTail = 0;
+        // look once for packets that came in before
+        evPending = ENC28J60_EV_RX;
+        irqMode = 1;
+        // link changes are signaled by the PHY
+        enc28j60PhyWrite(PHIE, PHIE_PGEIE|PHIE_PLNKIE);
+        enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_PKTIE|EIE_LINKIE|EIE_TXERIE|EIE_RXERIE);
+#ifndef ENC28J60_HOST
+        attachInterrupt(irq, enc28j60IrqHandler, FALLING);
+#else
+        (void)irq;
+#endif
+}
+
+// Interrupt service routine for the INT pin. It only uses the EIE and
+// EIR registers which are reachable from every bank, so it does not
+// disturb a register access of the main loop it interrupts. INTIE is
+// cleared which releases the INT pin until enc28j60PacketBegin has
+// handled everything and sets it again. Therefore at most one entry
+// is queued at a time and the ring never fills up.
+void enc28j60IrqHandler(void)
+{
+        uint8_t ev;
+        uint8_t next;
+        enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIE, EIE_INTIE);
+        ev = enc28j60ReadOp(ENC28J60_READ_CTRL_REG, EIR) & (EIR_LINKIF|EIR_TXERIF|EIR_RXERIF);
+        // PKTIF can not be trusted (Rev. B4 Silicon Errata point 6),
+        // after every interrupt EPKTCNT is checked
+        ev |= ENC28J60_EV_RX;
+        next = (evHead + 1) & (ENC28J60_EV_RING - 1);
+        if (next != evTail) {
+                evRing[evHead] = ev;
+                evHead = next;
+        }
+}
+
+// take the queued events off the ring and clear their sources in the
+// chip. Costs no SPI transfer if nothing happened.
+static void enc28j60ServiceEvents(void)
+{
+        uint8_t ev = 0;
+        while (evTail != evHead) {
+                ev |= evRing[evTail];
+                evTail = (evTail + 1) & (ENC28J60_EV_RING - 1);
+        }
+        if (ev & ENC28J60_EV_LINK) {
+                // reading PHIR clears LINKIF
+                enc28j60PhyReadH(PHIR);
+        }
+        if (ev & ENC28J60_EV_TXERR) {
+                // Reset the transmit logic problem. See Rev. B4 Silicon Errata point 12.
+                // The frame is lost, tcp sends it again.
+                enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRST);
+                enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST|ECON1_TXRTS);
+        }
+        if (ev & ENC28J60_EV_RXERR) {
+                gRxOverflows++;
+        }
+        if (ev & (ENC28J60_EV_TXERR|ENC28J60_EV_RXERR)) {
+                enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIR, ev & (EIR_TXERIF|EIR_RXERIF));
+        }
+        evPending |= ev;
+}
+
+// Link, transmit error and receive overflow events since the last call
+// (ENC28J60_EV_LINK, ENC28J60_EV_TXERR, ENC28J60_EV_RXERR). Only
+// available after enc28j60EnableInterrupt, returns 0 otherwise.
+uint8_t enc28j60Events(void)
+{
+        uint8_t ev;
+        if (!irqMode) {
+                return(0);
+        }
+        enc28j60ServiceEvents();
+        ev = evPending & (ENC28J60_EV_LINK|ENC28J60_EV_TXERR|ENC28J60_EV_RXERR);
+        evPending &= ENC28J60_EV_RX;
+        return(ev);
+}
+
+// wait until the chip has sent the frame handed over last
+static void enc28j60TxWait(void)
 {
-        // Check no transmit in progress
         while (enc28j60ReadOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_TXRTS)
         {
                 // Reset the transmit logic problem. See Rev. B4 Silicon Errata point 12.
@@ -363,18 +738,141 @@ void enc28j60PacketSend(uint16_t len, uint8_t* packet)
                         enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST);
                 }
         }
+}
 
+// Start a new packet in the transmit buffer. Everything written with
+// enc28j60WriteBuffer after this is appended to the packet, so it can
+// be composed in chip memory piece by piece. Finish with enc28j60TxEnd.
+// The packet goes into the next transmit slot that is not held. Only if
+// that slot still holds the frame on the wire (always with one slot)
+// this waits.
+void enc28j60TxBegin(void)
+{
+        do {
+                gTxSlot++;
+                if (gTxSlot>=gTxSlots){
+                        gTxSlot=0;
+                }
+        } while (gTxHeld & (1<<gTxSlot));
+        gTxBase = gTxFirst + gTxSlot*TXSLOT_SIZE;
+        if (gTxSlot==gTxBusy){
+                enc28j60TxWait();
+        }
 	// Set the write pointer to start of transmit buffer area
-	enc28j60WriteWord(EWRPTL, TXSTART_INIT);
-	// Set the TXND pointer to correspond to the packet size given
-	enc28j60WriteWord(ETXNDL, (TXSTART_INIT+len));
+	enc28j60WriteWord(EWRPTL, gTxBase);
 	// write per-packet control byte (0x00 means use macon3 settings)
 	enc28j60WriteOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
+}
+
+// len is the total length of the packet written since enc28j60TxBegin
+void enc28j60TxEnd(uint16_t len)
+{
+        // ETXND may only change once the frame before has left, it is
+        // set in enc28j60PacketTransmit
+        gTxEnd = gTxBase+len;
+}
+
+// Copy a packet into the transmit buffer without sending it.
+// The copy in chip memory can then be changed, e.g. to fill in a
+// checksum computed with enc28j60TxChecksum, before it is sent
+// with enc28j60PacketTransmit.
+void enc28j60PacketPrepare(uint16_t len, uint8_t* packet)
+{
+        enc28j60TxBegin();
 	// copy the packet into the transmit buffer
 	enc28j60WriteBuffer(len, packet);
-	// send the contents of the transmit buffer onto the network
+        enc28j60TxEnd(len);
+}
+
+// send the packet that is in the transmit buffer onto the network
+void enc28j60PacketTransmit(void)
+{
+        // the chip sends one frame at a time
+        enc28j60TxWait();
+        if (gTxStart != gTxBase){
+                gTxStart = gTxBase;
+                enc28j60WriteWord(ETXSTL, gTxStart);
+        }
+	// Set the TXND pointer to correspond to the packet size given
+	enc28j60WriteWord(ETXNDL, gTxEnd);
 	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
-        // Reset the transmit logic problem. See Rev. B4 Silicon Errata point 12.
+        gTxBusy = gTxSlot;
+}
+
+void enc28j60PacketSend(uint16_t len, uint8_t* packet)
+{
+        enc28j60PacketPrepare(len, packet);
+        enc28j60PacketTransmit();
+}
+
+// Keep the frame just sent with enc28j60PacketTransmit in its slot, e.g.
+// a tcp segment until the peer has acknowledged it, and send it again
+// with enc28j60TxResend. New frames go into the other slots until
+// enc28j60TxRelease. One slot always stays free, so with one slot or
+// when all others are held this returns 0, otherwise a handle.
+uint8_t enc28j60TxHold(void)
+{
+        uint8_t i = 0;
+        uint8_t n = 0;
+        if (gTxBusy == 0xff || (gTxHeld & (1<<gTxBusy))) {
+                return(0);
+        }
+        while (i < gTxSlots) {
+                if (gTxHeld & (1<<i)) {
+                        n++;
+                }
+                i++;
+        }
+        if (n+1 >= gTxSlots) {
+                return(0);
+        }
+        gTxHeld |= 1<<gTxBusy;
+        gTxHeldEnd[gTxBusy] = gTxEnd;
+        return(gTxBusy+1);
+}
+
+// send the frame kept with enc28j60TxHold again
+void enc28j60TxResend(uint8_t handle)
+{
+        uint8_t slot = handle-1;
+        enc28j60TxWait();
+        gTxStart = gTxFirst + slot*TXSLOT_SIZE;
+        enc28j60WriteWord(ETXSTL, gTxStart);
+        enc28j60WriteWord(ETXNDL, gTxHeldEnd[slot]);
+        enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+        gTxBusy = slot;
+}
+
+// the frame kept with enc28j60TxHold is no longer needed, its slot
+// takes new frames again
+void enc28j60TxRelease(uint8_t handle)
+{
+        gTxHeld &= ~(1<<(handle-1));
+}
+
+// Overwrite len bytes of the prepared packet at offset pos
+// (pos=0 is the first byte of the ethernet header)
+void enc28j60TxWrite(uint16_t pos, uint16_t len, uint8_t* data)
+{
+	enc28j60WriteWord(EWRPTL, gTxBase+1+pos);
+	enc28j60WriteBuffer(len, data);
+}
+
+// Let the DMA engine of the chip calculate the IP checksum over len
+// bytes of the prepared packet starting at offset pos. The checksum
+// field inside that range must be zero. The result is the same as
+// checksum(&buf[pos],len,0) would give, see datasheet section 14.
+uint16_t enc28j60TxChecksum(uint16_t pos, uint16_t len)
+{
+        uint16_t start = gTxBase+1+pos;
+	enc28j60WriteWord(EDMASTL, start);
+	enc28j60WriteWord(EDMANDL, start+len-1);
+	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_CSUMEN|ECON1_DMAST);
+        // the chip needs about 1 instruction cycle per byte
+        while (enc28j60ReadOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST)
+                ;
+	enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_CSUMEN);
+        return ((uint16_t)enc28j60Read(EDMACSH) << 8) | enc28j60Read(EDMACSL);
 }
 
 // just probe if there might be a packet
@@ -383,118 +881,169 @@ void enc28j60PacketSend(uint16_t len, uint8_t* packet)
 //       return enc28j60ReadByte(EPKTCNT) > 0;
 //}
 
-// Gets a packet from the network receive buffer, if one is available.
-// The packet will by headed by an ethernet header.
-//      maxlen  The maximum acceptable length of a retrieved packet.
-//      packet  Pointer where packet data should be stored.
-// Returns: Packet length in bytes if a packet was retrieved, zero otherwise.
-uint16_t enc28j60PacketReceive(uint16_t maxlen, uint8_t* packet)
+// Start reading the next packet from the network receive buffer without
+// copying anything but its 6 byte header. The packet stays in chip memory
+// and parts of it can be fetched with enc28j60PacketRead until
+// enc28j60PacketRelease frees it. This allows to look at the headers
+// first and to drop unwanted packets without moving them over SPI.
+// Returns: Packet length in bytes if a valid packet is waiting, zero otherwise.
+uint16_t enc28j60PacketBegin(void)
 {
-        	uint16_t rxstat;
+        uint8_t hdr[6];
+        uint8_t cnt;
+        uint16_t rxstat;
 	uint16_t len;
+        if (irqMode) {
+                enc28j60ServiceEvents();
+                if (!(evPending & ENC28J60_EV_RX)) {
+                        // nothing arrived since EPKTCNT was last 0
+                        return(0);
+                }
+        }
 	// check if a packet has been received and buffered
 	//if( !(enc28j60Read(EIR) & EIR_PKTIF) ){
         // The above does not work. See Rev. B4 Silicon Errata point 6.
-	if( enc28j60Read(EPKTCNT) ==0 ){
+        cnt = enc28j60Read(EPKTCNT);
+	if( cnt ==0 ){
+                if (irqMode) {
+                        // all packets are read, let the chip interrupt
+                        // again. If one came in meanwhile INT falls at once.
+                        evPending &= ~ENC28J60_EV_RX;
+                        enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE);
+                }
 		return(0);
         }
+        if (!irqMode && (cnt>1 || gRxCheckAlways)) {
+                // the receive buffer ran full and dropped a packet
+                if (enc28j60ReadOp(ENC28J60_READ_CTRL_REG, EIR) & EIR_RXERIF) {
+                        gRxOverflows++;
+                        enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_RXERIF);
+                }
+        }
 
 	// Set the read pointer to the start of the received packet
 	enc28j60WriteWord(ERDPTL, gNextPacketPtr);
-	//enc28j60Write(ERDPTL, (gNextPacketPtr &0xFF));
-	//enc28j60Write(ERDPTH, (gNextPacketPtr)>>8);
-	// read the next packet pointer
-	gNextPacketPtr  = enc28j60ReadBufferWord();
-	//gNextPacketPtr  = enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0);
-	//gNextPacketPtr |= enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0)<<8;
-	// read the packet length (see datasheet page 43)
-	len = enc28j60ReadBufferWord() - 4;
-	//len = enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0);
-	//len |= enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0)<<8;
-        //len-=4; //remove the CRC count
-	// read the receive status (see datasheet page 43)
-	rxstat  = enc28j60ReadBufferWord();
-	//rxstat  = enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0);
-	//rxstat |= ((uint16_t)enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0))<<8;
-	// limit retrieve length
-        if (len>maxlen-1){
-                len=maxlen-1;
+        // the ethernet header follows the 6 byte header of the chip
+        gPacketStart = gNextPacketPtr + 6;
+        if (gPacketStart > gRxStop) {
+                gPacketStart -= gRxStop - RXSTART_INIT + 1;
         }
+        gPacketReadPos = 0;
+        // next packet pointer, packet length and receive status in
+        // one transfer (see datasheet page 43)
+        enc28j60ReadBuffer(6, hdr);
+	gNextPacketPtr  = hdr[0] | ((uint16_t)hdr[1] << 8);
+	len = (hdr[2] | ((uint16_t)hdr[3] << 8)) - 4;
+	rxstat  = hdr[4] | ((uint16_t)hdr[5] << 8);
         // check CRC and symbol errors (see datasheet page 44, table 7-3):
         // The ERXFCON.CRCEN is set by default. Normally we should not
         // need to check this.
         if ((rxstat & 0x80)==0){
                 // invalid
-                len=0;
-        }else{
-                // copy the packet from the receive buffer
-                enc28j60ReadBuffer(len, packet);
+                enc28j60PacketRelease();
+                return(0);
         }
+        return(len);
+}
+
+// Copy len bytes starting at offset pos of the current packet into data.
+// Consecutive reads continue where the previous one stopped and do not
+// need to move the read pointer.
+void enc28j60PacketRead(uint16_t pos, uint16_t len, uint8_t* data)
+{
+        uint16_t addr;
+        if (pos != gPacketReadPos) {
+                // the packet may wrap around the end of the receive buffer
+                addr = gPacketStart + pos;
+                if (addr > gRxStop) {
+                        addr -= gRxStop - RXSTART_INIT + 1;
+                }
+                enc28j60WriteWord(ERDPTL, addr);
+        }
+        enc28j60ReadBuffer(len, data);
+        gPacketReadPos = pos + len;
+}
+
+// Free the memory of the current packet in the receive buffer
+void enc28j60PacketRelease(void)
+{
 	// Move the RX read pointer to the start of the next received packet
 	// This frees the memory we just read out
-	enc28j60WriteWord(ERXRDPTL, gNextPacketPtr );
-	//enc28j60Write(ERXRDPTL, (gNextPacketPtr &0xFF));
-	//enc28j60Write(ERXRDPTH, (gNextPacketPtr)>>8);
         // However, compensate for the errata point 13, rev B4: enver write an even address!
         if ((gNextPacketPtr - 1 < RXSTART_INIT)
-                || (gNextPacketPtr -1 > RXSTOP_INIT)) {
-                enc28j60WriteWord(ERXRDPTL, RXSTOP_INIT);
-                //enc28j60Write(ERXRDPTL, (RXSTOP_INIT)&0xFF);
-                //enc28j60Write(ERXRDPTH, (RXSTOP_INIT)>>8);
+                || (gNextPacketPtr -1 > gRxStop)) {
+                enc28j60WriteWord(ERXRDPTL, gRxStop);
         } else {
                 enc28j60WriteWord(ERXRDPTL, (gNextPacketPtr-1));
-                //enc28j60Write(ERXRDPTL, (gNextPacketPtr-1)&0xFF);
-                //enc28j60Write(ERXRDPTH, (gNextPacketPtr-1)>>8);
         }
 	// decrement the packet counter indicate we are done with this packet
 	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
-	return(len);
+}
 
-/*
-  uint16_t rxstat;
+// Gets a packet from the network receive buffer, if one is available.
+// The packet will by headed by an ethernet header.
+//      maxlen  The maximum acceptable length of a retrieved packet.
+//      packet  Pointer where packet data should be stored.
+// Returns: Packet length in bytes if a packet was retrieved, zero otherwise.
+uint16_t enc28j60PacketReceive(uint16_t maxlen, uint8_t* packet)
+{
 	uint16_t len;
-	// check if a packet has been received and buffered
-	//if( !(enc28j60Read(EIR) & EIR_PKTIF) ){
-        // The above does not work. See Rev. B4 Silicon Errata point 6.
-	if( enc28j60Read(EPKTCNT) ==0 ){
-		return(0);
+        len = enc28j60PacketBegin();
+        if (len == 0) {
+                return(0);
         }
-
-	// Set the read pointer to the start of the received packet
-	enc28j60WriteWord(ERDPTL, gNextPacketPtr);
-	// read the next packet pointer
-	gNextPacketPtr  = enc28j60ReadBufferWord();
-	// read the packet length (see datasheet page 43)
-	len  = enc28j60ReadBufferWord() - 4;
-	// read the receive status (see datasheet page 43)
-	rxstat  = enc28j60ReadBufferWord();
 	// limit retrieve length
         if (len>maxlen-1){
                 len=maxlen-1;
         }
-        // check CRC and symbol errors (see datasheet page 44, table 7-3):
-        // The ERXFCON.CRCEN is set by default. Normally we should not
-        // need to check this.
-        if ((rxstat & 0x80)==0){
-                // invalid
-                len=0;
-        }else{
-                // copy the packet from the receive buffer
-                enc28j60ReadBuffer(len, packet);
-        }
-	// Move the RX read pointer to the start of the next received packet
-	// This frees the memory we just read out
-//	enc28j60WriteWord(ERXRDPTL, gNextPacketPtr );
-        // However, compensate for the errata point 13, rev B4: enver write an even address!
-        if ((gNextPacketPtr - 1 < RXSTART_INIT)
-                || (gNextPacketPtr -1 > RXSTOP_INIT)) {
-                enc28j60WriteWord(ERXRDPTL, RXSTOP_INIT);
-        } else {
-                enc28j60WriteWord(ERXRDPTL, (gNextPacketPtr-1));
-        }
-	// decrement the packet counter indicate we are done with this packet
-	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
+        // copy the packet from the receive buffer
+        enc28j60PacketRead(0, len, packet);
+        enc28j60PacketRelease();
 	return(len);
-*/
 }
 
+// Number of times the receive buffer was full and a packet was dropped,
+// counted when the packets that filled it are read. Helps to choose
+// the buffer layout.
+uint16_t enc28j60RxOverflows(void)
+{
+        return(gRxOverflows);
+}
+
+// size of the scratch region of the buffer layout
+uint16_t enc28j60ScratchSize(void)
+{
+        return(gScratchSize);
+}
+
+// Copy len bytes into the scratch region at offset pos, e.g. to keep
+// a response that is sent often. Not while a packet is composed with
+// enc28j60TxBegin as both use the write pointer.
+void enc28j60ScratchWrite(uint16_t pos, uint16_t len, uint8_t* data)
+{
+	enc28j60WriteWord(EWRPTL, gScratchStart+pos);
+	enc28j60WriteBuffer(len, data);
+}
+
+// Copy len bytes at offset pos of the scratch region into data
+void enc28j60ScratchRead(uint16_t pos, uint16_t len, uint8_t* data)
+{
+	enc28j60WriteWord(ERDPTL, gScratchStart+pos);
+	enc28j60ReadBuffer(len, data);
+        // the read pointer has to be set again for the current packet
+        gPacketReadPos = 0xffff;
+}
+
+// Let the DMA engine copy len bytes at offset pos of the scratch region
+// to offset txpos of the packet being composed (txpos=0 is the first
+// byte of the ethernet header), no data goes over SPI. Call
+// enc28j60TxEnd with the total length afterwards.
+void enc28j60ScratchToTx(uint16_t txpos, uint16_t pos, uint16_t len)
+{
+	enc28j60WriteWord(EDMASTL, gScratchStart+pos);
+	enc28j60WriteWord(EDMANDL, gScratchStart+pos+len-1);
+	enc28j60WriteWord(EDMADSTL, gTxBase+1+txpos);
+	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST);
+        while (enc28j60ReadOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST)
+                ;
+}
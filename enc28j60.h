@@ -262,6 +262,9 @@
 #define PHCON2_TXDIS     0x2000
 #define PHCON2_JABBER    0x0400
 #define PHCON2_HDLDIS    0x0100
+// ENC28J60 PHY PHIE Register Bit Definitions
+#define PHIE_PLNKIE      0x0010
+#define PHIE_PGEIE       0x0002
 
 // ENC28J60 Packet Control Byte Bit Definitions
 #define PKTCTRL_PHUGEEN  0x08
@@ -277,27 +280,69 @@
 #define ENC28J60_BIT_FIELD_SET       0x80
 #define ENC28J60_BIT_FIELD_CLR       0xA0
 #define ENC28J60_SOFT_RESET          0xFF
+// not an opcode, bank switches for enc28j60SpiCount
+#define ENC28J60_BANK_SWITCH         0x01
 
 
 // The RXSTART_INIT should be zero. See Rev. B4 Silicon Errata
 // buffer boundaries applied to internal 8K ram
 // the entire available packet buffer space is allocated
 //
+// The TX buffer is split into ENC28J60_TX_SLOTS slots of TXSLOT_SIZE
+// bytes, each with space for the control byte, one full ethernet
+// frame (~1500 bytes) and the 7 byte transmit status. With two or
+// more the next frame is copied into a free slot while the previous
+// one is still being sent.
+#ifndef ENC28J60_TX_SLOTS
+#define ENC28J60_TX_SLOTS 2
+#endif
+#define TXSLOT_SIZE      0x0600
+//
+// These are the defaults, enc28j60InitWithLayout can choose the number
+// of slots and put a scratch region between the RX and TX buffers.
+//
 // start with recbuf at 0/
 #define RXSTART_INIT     0x0
 // receive buffer end
-#define RXSTOP_INIT      (0x1FFF-0x0600-1)
-// start TX buffer at 0x1FFF-0x0600, pace for one full ethernet frame (~1500 bytes)
-#define TXSTART_INIT     (0x1FFF-0x0600)
+#define RXSTOP_INIT      (TXSTART_INIT-1)
+// start TX buffer at 0x1FFF-ENC28J60_TX_SLOTS*0x0600
+#define TXSTART_INIT     (0x1FFF-ENC28J60_TX_SLOTS*TXSLOT_SIZE)
 // stp TX buffer at end of mem
 #define TXSTOP_INIT      0x1FFF
 //
-// max frame length which the conroller will accept:
-#define        MAX_FRAMELEN        1500        // (note: maximum ethernet frame length would be 1518)
+// max frame length which the conroller will accept and send, this
+// counts the 4 byte CRC. Longer frames are aborted by the chip:
+#define        MAX_FRAMELEN        1518        // maximum ethernet frame length
 //#define MAX_FRAMELEN     600
 
 
+// Transport: the four SPI level primitives that everything else in the
+// driver is built on. By default they drive the AVR SPI port. Another
+// implementation can be plugged in with enc28j60SetTransport, e.g. the
+// software ENC28J60 in extras/host when the stack is built natively
+// with ENC28J60_HOST defined.
+typedef struct enc28j60Transport {
+        uint8_t (*readOp)(uint8_t op, uint8_t address);
+        void (*writeOp)(uint8_t op, uint8_t address, uint8_t data);
+        void (*readBuffer)(uint16_t len, uint8_t* data);
+        void (*writeBuffer)(uint16_t len, uint8_t* data);
+} enc28j60Transport;
+
+// buffer layout for enc28j60InitWithLayout
+typedef struct enc28j60Layout {
+        uint8_t txSlots;        // transmit slots of TXSLOT_SIZE bytes, 1-4
+        uint16_t scratchSize;   // bytes of scratch memory, may be 0
+} enc28j60Layout;
+
+// Events recorded by the interrupt handler, see enc28j60EnableInterrupt.
+// They use the bit positions of the EIR register.
+#define ENC28J60_EV_RX     EIR_PKTIF
+#define ENC28J60_EV_LINK   EIR_LINKIF
+#define ENC28J60_EV_TXERR  EIR_TXERIF
+#define ENC28J60_EV_RXERR  EIR_RXERIF
+
 // functions
+extern void enc28j60SetTransport(const enc28j60Transport *transport);
 extern uint8_t enc28j60ReadOp(uint8_t op, uint8_t address);
 extern void enc28j60WriteOp(uint8_t op, uint8_t address, uint8_t data);
 extern void enc28j60ReadBuffer(uint16_t len, uint8_t* data);
@@ -310,8 +355,21 @@ extern void enc28j60clkout(uint8_t clk);
 extern void enc28j60SpiInit(void);
 extern void enc28j60Init(uint8_t* macaddr);
 extern void enc28j60InitWithCs( uint8_t* macaddr, uint8_t csPin );
+extern void enc28j60InitWithLayout( uint8_t* macaddr, uint8_t csPin, const enc28j60Layout *layout );
 extern void enc28j60PacketSend(uint16_t len, uint8_t* packet);
+extern void enc28j60PacketPrepare(uint16_t len, uint8_t* packet);
+extern void enc28j60TxBegin(void);
+extern void enc28j60TxEnd(uint16_t len);
+extern void enc28j60PacketTransmit(void);
+extern uint8_t enc28j60TxHold(void);
+extern void enc28j60TxResend(uint8_t handle);
+extern void enc28j60TxRelease(uint8_t handle);
+extern void enc28j60TxWrite(uint16_t pos, uint16_t len, uint8_t* data);
+extern uint16_t enc28j60TxChecksum(uint16_t pos, uint16_t len);
 extern uint16_t enc28j60PacketReceive(uint16_t maxlen, uint8_t* packet);
+extern uint16_t enc28j60PacketBegin(void);
+extern void enc28j60PacketRead(uint16_t pos, uint16_t len, uint8_t* packet);
+extern void enc28j60PacketRelease(void);
 extern uint8_t enc28j60getrev(void);
 extern uint8_t enc28j60hasRxPkt(void);
 extern uint8_t enc28j60linkup(void);
@@ -319,8 +377,24 @@ extern void enc28j60EnableBroadcast( void );
 extern void enc28j60DisableBroadcast( void );
 extern void enc28j60EnableMulticast( void );
 extern void enc28j60DisableMulticast( void );
+extern void enc28j60SetPattern(uint16_t offset, const uint8_t *mask, const uint8_t *bytes);
+extern void enc28j60DisablePattern(void);
+extern uint8_t enc28j60Hash(const uint8_t *mac);
+extern void enc28j60SetHashTable(const uint8_t *eht);
 extern void enc28j60PowerDown();
 extern void enc28j60PowerUp();
+extern void enc28j60EnableInterrupt(uint8_t irq);
+extern void enc28j60IrqHandler(void);
+extern uint8_t enc28j60Events(void);
+extern uint16_t enc28j60RxOverflows(void);
+extern uint16_t enc28j60ScratchSize(void);
+extern void enc28j60ScratchWrite(uint16_t pos, uint16_t len, uint8_t* data);
+extern void enc28j60ScratchRead(uint16_t pos, uint16_t len, uint8_t* data);
+extern void enc28j60ScratchToTx(uint16_t txpos, uint16_t pos, uint16_t len);
+#ifdef ENC28J60_SPI_STATS
+extern uint32_t enc28j60SpiCount(uint8_t op);
+extern void enc28j60SpiCountClear(void);
+#endif
 
 #endif
 //@}
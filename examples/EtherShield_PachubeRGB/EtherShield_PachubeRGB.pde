@@ -363,11 +363,13 @@ void loop()
   }
 
   // Main processing loop now we have our addresses
-  while( es.ES_dhcp_state() == DHCP_STATE_OK ) {
-    // Stays within this loop as long as DHCP state is ok
-    // If it changes then it drops out and forces a renewal of details
+  while( es.ES_dhcp_state() != DHCP_STATE_RENEW ) {
+    // Stays within this loop as long as we have a lease, ES_dhcp_poll
+    // renews it in time. If it is lost then it drops out and forces
+    // a new allocation of details
     // handle ping and wait for a tcp packet - calling this routine powers the sending and receiving of data
     plen = es.ES_enc28j60PacketReceive(BUFFER_SIZE, buf);
+    es.ES_dhcp_poll(buf, plen);
     dat_p=es.ES_packetloop_icmp_tcp(buf,plen);
     if( plen > 0 ) {
       // We have a packet
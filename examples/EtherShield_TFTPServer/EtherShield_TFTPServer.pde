@@ -120,6 +120,10 @@ void setup() {
     return;
   }
 
+  // write requests come to the tftp port, the data to our transfer port (TID)
+  es.ES_udp_bind(LISTEN_TFTP, NULL, 0, tftpStart);
+  es.ES_udp_bind((srcport_h << 8) | srcport_l, NULL, 0, tftpData);
+
 #ifdef DEBUG
   Serial.println("Waiting for request");
 #endif
@@ -137,30 +141,20 @@ void loop(){
   // handle ping and wait for a tcp packet
   int plen = es.ES_enc28j60PacketReceive(BUFFER_SIZE, buf);
 
-  if( plen > 0 ) {
-    //      dump.packetDump( buf, plen );
-
-    // Check if Initial UDP
-    if( isTftpStart( buf ) ) {
-      handleTftpInit( plen );
-    }
-    if( isTftpData( buf ) ) {
-      handleTftpData( plen );
-    }
-  }
+  // the tftp datagrams go to the callbacks bound in setup
   dat_p=es.ES_packetloop_icmp_tcp(buf,plen);
 }
 
-// Test if this is a UDP TFTP start, its on port 69
-boolean isTftpStart( uint8_t *buf ) {
-  return ( buf[IP_PROTO_P] == IP_PROTO_UDP_V && buf[UDP_DST_PORT_L_P] == LISTEN_TFTP);
+// A UDP TFTP start, its on port 69
+void tftpStart( uint8_t fd, uint8_t *pkt, uint16_t datapos, uint16_t len ) {
+  handleTftpInit( datapos + len );
 }
 
-// test if this is a data packet, port already set
-boolean isTftpData( uint8_t *buf ) {
-  return ( buf[UDP_DST_PORT_L_P] == srcport_l &&
-    buf[UDP_DST_PORT_H_P] == srcport_h && 
-    buf[UDP_TFTP_TYPE_L_P] == 3 );
+// a packet to our transfer port, only data is expected
+void tftpData( uint8_t fd, uint8_t *pkt, uint16_t datapos, uint16_t len ) {
+  if( pkt[UDP_TFTP_TYPE_L_P] == TFTP_DATA ) {
+    handleTftpData( datapos + len );
+  }
 }
 
 
@@ -0,0 +1,585 @@
+/*********************************************
+ * vim:sw=8:ts=8:si:et
+ * Copyright: GPL V2
+ *
+ * Test of the dhcp client (dhcp.c) on top of the software ENC28J60
+ * (enc28j60emu.c). The answers of a dhcp server are injected into
+ * the model and go through enc28j60PacketReceive, dhcp_poll and
+ * packetloop_icmp_tcp like in a sketch. Timers are run out with
+ * delay(), which advances millis() without waiting.
+ *
+ * Every request the client sends is checked: message type, where it
+ * goes, ciaddr, the requested ip and server identifier options and
+ * the ip and udp checksums of the frame, which is streamed into the
+ * transmit buffer and never exists in one piece.
+ *
+ * The scenarios are getting a lease, renewing it at T1 with unicast
+ * requests to the server and their retries, rebinding at T2 with
+ * broadcasts, a DHCPNAK in the REQUEST and RENEWING states, the
+ * lease running out and INIT-REBOOT with a saved lease: confirmed
+ * by a DHCPACK, refused by a DHCPNAK or not answered within
+ * DHCP_REBOOT_MS, the last two fall back to DHCPDISCOVER. The lease
+ * must be saved only when a server gave us a new one.
+ * dhcp.c keeps its state in static variables and takes the
+ * INIT-REBOOT path only on the first dhcp_start after a reset, so
+ * each scenario runs in its own process.
+ *
+ * usage: dhcptest, the exit code is the number of failed checks
+ *********************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "Arduino.h"
+#include "ip_config.h"
+#include "enc28j60.h"
+#include "ip_arp_udp_tcp.h"
+#include "net.h"
+#include "dhcp.h"
+#include "enc28j60emu.h"
+
+#define BUFFER_SIZE 1500
+#define MYWWWPORT 80
+#define DHCPDISCOVER 1
+#define DHCPOFFER 2
+#define DHCPREQUEST 3
+#define DHCPACK 5
+#define DHCPNAK 6
+// as in dhcp.c
+#ifndef DHCP_REBOOT_MS
+#define DHCP_REBOOT_MS 4000
+#endif
+// the lease the server gives, T1 and T2 are the defaults of 1/2 and 7/8
+#define LEASE_S 3600UL
+#define T1_MS (LEASE_S * 1000 / 2)
+#define T2_MS (LEASE_S * 1000 / 8 * 7)
+// host time passing between two checks is much shorter than this
+#define SLACK_MS 100
+// offset of the options in the udp data, after the magic cookie
+#define DHCP_OPT_P (UDP_DATA_P + 240)
+
+static uint8_t buf[BUFFER_SIZE+1];
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x25};
+static uint8_t myip[4];
+static uint8_t mymask[4];
+static uint8_t gwip[4];
+static uint8_t dnsip[4];
+static uint8_t dhcpsvrip[4];
+static uint8_t servermac[6] = {0x00,0x1b,0x21,0x0a,0x0b,0x01};
+static uint8_t serverip[4] = {192,168,1,1};
+static uint8_t leaseip[4] = {192,168,1,77};
+static uint8_t leasemask[4] = {255,255,255,0};
+static uint8_t broadcastip[4] = {255,255,255,255};
+static uint8_t zeroip[4];
+
+// the last dhcp request the client sent and how many since the last check
+static uint8_t txFrame[BUFFER_SIZE+1];
+static uint16_t txLen;
+static uint8_t txRequests;
+static uint8_t txArps;
+
+// what the lease persistence callbacks saw
+static uint8_t savedLease[DHCP_LEASE_LEN];
+static uint8_t haveSavedLease;
+static uint8_t leaseSaves;
+
+static int failures;
+static const char *scenario;
+
+static void watchTx(const uint8_t *frame, uint16_t len)
+{
+        if (frame[ETH_TYPE_H_P] == ETHTYPE_ARP_H_V && frame[ETH_TYPE_L_P] == ETHTYPE_ARP_L_V) {
+                txArps++;
+                return;
+        }
+        if (frame[ETH_TYPE_H_P] != ETHTYPE_IP_H_V || frame[IP_PROTO_P] != IP_PROTO_UDP_V ||
+            frame[UDP_DST_PORT_H_P] != 0 || frame[UDP_DST_PORT_L_P] != 67 || len > BUFFER_SIZE) {
+                return;
+        }
+        memcpy(txFrame, frame, len);
+        txLen = len;
+        txRequests++;
+}
+
+static uint16_t ipChecksum(const uint8_t *p, uint16_t len, uint32_t sum)
+{
+        while (len > 1) {
+                sum += (p[0] << 8) | p[1];
+                p += 2;
+                len -= 2;
+        }
+        if (len) {
+                sum += p[0] << 8;
+        }
+        while (sum >> 16) {
+                sum = (sum & 0xffff) + (sum >> 16);
+        }
+        return((uint16_t)~sum);
+}
+
+static void check(const char *what, int ok)
+{
+        if (!ok) {
+                printf("FAIL %s: %s\n", scenario, what);
+                failures++;
+        }
+}
+
+static void checkState(const char *what, uint8_t got, uint8_t want)
+{
+        if (got != want) {
+                printf("FAIL %s: %s, dhcp state is %u, expected %u\n", scenario, what, got, want);
+                failures++;
+        }
+}
+
+// the value of option in the last request, NULL if it is not there
+static const uint8_t *txOption(uint8_t option)
+{
+        uint16_t i = DHCP_OPT_P;
+        while (i + 1 < txLen && txFrame[i] != 255) {
+                if (txFrame[i] == 0) {
+                        i++;
+                        continue;
+                }
+                if (txFrame[i] == option) {
+                        return(txFrame + i + 2);
+                }
+                i += txFrame[i + 1] + 2;
+        }
+        return(NULL);
+}
+
+// the client sent exactly one request of type to dst (broadcast or the
+// server) from src with ciaddr and the requested ip and the server
+// identifier options when opt50 and opt54 are set. Lengths and
+// checksums of the frame must be right. No request at all when type is 0.
+static void checkRequest(const char *what, uint8_t type, const uint8_t *dst, const uint8_t *src,
+                         const uint8_t *ciaddr, uint8_t opt50, uint8_t opt54)
+{
+        uint16_t iplen, udplen, i;
+        const uint8_t *opt;
+        char msg[160];
+        if (type == 0) {
+                snprintf(msg, sizeof(msg), "%s sent %u requests, expected none", what, txRequests);
+                check(msg, txRequests == 0);
+                txRequests = 0;
+                return;
+        }
+        snprintf(msg, sizeof(msg), "%s sent %u requests, expected one", what, txRequests);
+        check(msg, txRequests == 1);
+        txRequests = 0;
+        if (txLen < DHCP_OPT_P) {
+                snprintf(msg, sizeof(msg), "%s frame of %u bytes is too short", what, txLen);
+                check(msg, 0);
+                return;
+        }
+        iplen = (txFrame[IP_TOTLEN_H_P] << 8) | txFrame[IP_TOTLEN_L_P];
+        udplen = (txFrame[UDP_LEN_H_P] << 8) | txFrame[UDP_LEN_L_P];
+        snprintf(msg, sizeof(msg), "%s lengths frame %u ip %u udp %u", what, txLen, iplen, udplen);
+        check(msg, txLen == ETH_HEADER_LEN + iplen && udplen == iplen - IP_HEADER_LEN);
+        snprintf(msg, sizeof(msg), "%s ip header checksum", what);
+        check(msg, ipChecksum(txFrame + IP_P, IP_HEADER_LEN, 0) == 0);
+        snprintf(msg, sizeof(msg), "%s udp checksum", what);
+        check(msg, ipChecksum(txFrame + IP_SRC_P, 8 + udplen, IP_PROTO_UDP_V + udplen) == 0);
+        snprintf(msg, sizeof(msg), "%s ip destination", what);
+        check(msg, memcmp(txFrame + IP_DST_P, dst, 4) == 0);
+        snprintf(msg, sizeof(msg), "%s ethernet destination", what);
+        if (dst == broadcastip) {
+                check(msg, memcmp(txFrame + ETH_DST_MAC, "\xff\xff\xff\xff\xff\xff", 6) == 0);
+        } else {
+                check(msg, memcmp(txFrame + ETH_DST_MAC, servermac, 6) == 0);
+        }
+        snprintf(msg, sizeof(msg), "%s ip source", what);
+        check(msg, memcmp(txFrame + IP_SRC_P, src, 4) == 0);
+        snprintf(msg, sizeof(msg), "%s ports", what);
+        check(msg, txFrame[UDP_SRC_PORT_H_P] == 0 && txFrame[UDP_SRC_PORT_L_P] == 68);
+        snprintf(msg, sizeof(msg), "%s op, chaddr or ciaddr", what);
+        check(msg, txFrame[UDP_DATA_P] == 1 && memcmp(txFrame + UDP_DATA_P + 28, mymac, 6) == 0 &&
+              memcmp(txFrame + UDP_DATA_P + 12, ciaddr, 4) == 0);
+        snprintf(msg, sizeof(msg), "%s sname and file are not zero", what);
+        i = 34;
+        while (i < 236 && txFrame[UDP_DATA_P + i] == 0) {
+                i++;
+        }
+        check(msg, i == 236);
+        snprintf(msg, sizeof(msg), "%s magic cookie", what);
+        check(msg, memcmp(txFrame + UDP_DATA_P + 236, "\x63\x82\x53\x63", 4) == 0);
+        opt = txOption(53);
+        snprintf(msg, sizeof(msg), "%s message type %u, expected %u", what, opt ? *opt : 0, type);
+        check(msg, opt && *opt == type);
+        opt = txOption(50);
+        snprintf(msg, sizeof(msg), "%s requested ip option", what);
+        check(msg, opt50 ? opt && memcmp(opt, leaseip, 4) == 0 : opt == NULL);
+        opt = txOption(54);
+        snprintf(msg, sizeof(msg), "%s server identifier option", what);
+        check(msg, opt54 ? opt && memcmp(opt, serverip, 4) == 0 : opt == NULL);
+}
+
+// an answer of the server to the last request, to our mac and to
+// the broadcast address like most servers do
+static void serverAnswer(uint8_t type)
+{
+        static const uint8_t cookie[4] = {99,130,83,99};
+        uint8_t f[600];
+        uint8_t lease[4] = {LEASE_S >> 24, LEASE_S >> 16, LEASE_S >> 8, LEASE_S & 0xff};
+        uint8_t *d = f + UDP_DATA_P;
+        uint16_t p = 236;
+        uint16_t ck;
+        memset(f, 0, sizeof(f));
+        memcpy(f + ETH_DST_MAC, mymac, 6);
+        memcpy(f + ETH_SRC_MAC, servermac, 6);
+        f[ETH_TYPE_H_P] = ETHTYPE_IP_H_V;
+        f[ETH_TYPE_L_P] = ETHTYPE_IP_L_V;
+        f[IP_P] = 0x45;
+        f[IP_TTL_P] = 64;
+        f[IP_PROTO_P] = IP_PROTO_UDP_V;
+        memcpy(f + IP_SRC_P, serverip, 4);
+        memcpy(f + IP_DST_P, broadcastip, 4);
+        f[UDP_SRC_PORT_L_P] = 67;
+        f[UDP_DST_PORT_L_P] = 68;
+        d[0] = 2;
+        d[1] = 1;
+        d[2] = 6;
+        // the xid of the request
+        memcpy(d + 4, txFrame + UDP_DATA_P + 4, 4);
+        if (type != DHCPNAK) {
+                memcpy(d + 16, leaseip, 4);
+        }
+        memcpy(d + 28, mymac, 6);
+        memcpy(d + p, cookie, 4);
+        p += 4;
+        d[p++] = 53;
+        d[p++] = 1;
+        d[p++] = type;
+        d[p++] = 54;
+        d[p++] = 4;
+        memcpy(d + p, serverip, 4);
+        p += 4;
+        if (type != DHCPNAK) {
+                d[p++] = 1;
+                d[p++] = 4;
+                memcpy(d + p, leasemask, 4);
+                p += 4;
+                d[p++] = 3;
+                d[p++] = 4;
+                memcpy(d + p, serverip, 4);
+                p += 4;
+                d[p++] = 6;
+                d[p++] = 4;
+                memcpy(d + p, serverip, 4);
+                p += 4;
+                d[p++] = 51;
+                d[p++] = 4;
+                memcpy(d + p, lease, 4);
+                p += 4;
+        }
+        d[p++] = 255;
+        f[IP_TOTLEN_H_P] = (IP_HEADER_LEN + UDP_HEADER_LEN + p) >> 8;
+        f[IP_TOTLEN_L_P] = (IP_HEADER_LEN + UDP_HEADER_LEN + p) & 0xff;
+        ck = ipChecksum(f + IP_P, IP_HEADER_LEN, 0);
+        f[IP_CHECKSUM_H_P] = ck >> 8;
+        f[IP_CHECKSUM_L_P] = ck & 0xff;
+        f[UDP_LEN_H_P] = (UDP_HEADER_LEN + p) >> 8;
+        f[UDP_LEN_L_P] = (UDP_HEADER_LEN + p) & 0xff;
+        ck = ipChecksum(f + IP_SRC_P, 8 + UDP_HEADER_LEN + p, IP_PROTO_UDP_V + UDP_HEADER_LEN + p);
+        f[UDP_CHECKSUM_H_P] = ck >> 8;
+        f[UDP_CHECKSUM_L_P] = ck & 0xff;
+        enc28j60EmuInject(f, UDP_DATA_P + p);
+}
+
+// the server answers the arp request of the client
+static void serverArpReply(void)
+{
+        static const uint8_t hdr[8] = {0,1,8,0,6,4,0,2};
+        uint8_t f[60];
+        memset(f, 0, sizeof(f));
+        memcpy(f + ETH_DST_MAC, mymac, 6);
+        memcpy(f + ETH_SRC_MAC, servermac, 6);
+        f[ETH_TYPE_H_P] = ETHTYPE_ARP_H_V;
+        f[ETH_TYPE_L_P] = ETHTYPE_ARP_L_V;
+        memcpy(f + ETH_ARP_P, hdr, 8);
+        memcpy(f + ETH_ARP_SRC_MAC_P, servermac, 6);
+        memcpy(f + ETH_ARP_SRC_IP_P, serverip, 4);
+        memcpy(f + ETH_ARP_DST_MAC_P, mymac, 6);
+        memcpy(f + ETH_ARP_DST_IP_P, myip, 4);
+        enc28j60EmuInject(f, sizeof(f));
+}
+
+// one pass of the main loop of a sketch
+static uint8_t poll(void)
+{
+        uint16_t plen;
+        uint8_t state;
+        plen = enc28j60PacketReceive(BUFFER_SIZE, buf);
+        state = dhcp_poll(buf, plen);
+        packetloop_icmp_tcp(buf, plen);
+        return(state);
+}
+
+// let ms pass, calling the main loop every second
+static uint8_t idle(unsigned long ms)
+{
+        while (ms > 1000) {
+                delay(1000);
+                poll();
+                ms -= 1000;
+        }
+        delay(ms);
+        return(poll());
+}
+
+static uint8_t loadLease(uint8_t *lease)
+{
+        if (!haveSavedLease) {
+                return(0);
+        }
+        memcpy(lease, savedLease, DHCP_LEASE_LEN);
+        return(1);
+}
+
+static void saveLease(uint8_t *lease)
+{
+        memcpy(savedLease, lease, DHCP_LEASE_LEN);
+        haveSavedLease = 1;
+        leaseSaves++;
+}
+
+// a lease from before the reset
+static void haveLease(void)
+{
+        memcpy(savedLease, leaseip, 4);
+        memcpy(savedLease + 4, leasemask, 4);
+        memcpy(savedLease + 8, serverip, 4);
+        memcpy(savedLease + 12, serverip, 4);
+        memcpy(savedLease + 16, serverip, 4);
+        haveSavedLease = 1;
+}
+
+static void start(void)
+{
+        dhcp_lease_persist(loadLease, saveLease);
+        dhcp_start(buf, mymac, myip, mymask, gwip, dhcpsvrip, dnsip);
+}
+
+// configure the stack with the lease like allocateIPAddress does
+static void configure(void)
+{
+        init_ip_arp_udp_tcp(mymac, myip, MYWWWPORT);
+        client_set_netmask(mymask);
+        client_set_gwip(gwip);
+}
+
+static void checkLease(const char *what)
+{
+        char msg[80];
+        snprintf(msg, sizeof(msg), "%s ip, mask, gateway, dns or server", what);
+        check(msg, memcmp(myip, leaseip, 4) == 0 && memcmp(mymask, leasemask, 4) == 0 &&
+              memcmp(gwip, serverip, 4) == 0 && memcmp(dnsip, serverip, 4) == 0 &&
+              memcmp(dhcpsvrip, serverip, 4) == 0);
+}
+
+// DISCOVER, OFFER, REQUEST, ACK
+static void getLease(void)
+{
+        start();
+        checkRequest("start", DHCPDISCOVER, broadcastip, zeroip, zeroip, 0, 0);
+        checkState("start", dhcp_state(), DHCP_STATE_DISCOVER);
+        serverAnswer(DHCPOFFER);
+        checkState("offer", poll(), DHCP_STATE_REQUEST);
+        checkRequest("offer", DHCPREQUEST, broadcastip, zeroip, zeroip, 1, 1);
+        serverAnswer(DHCPACK);
+        checkState("ack", poll(), DHCP_STATE_OK);
+        checkRequest("ack", 0, NULL, NULL, NULL, 0, 0);
+        checkLease("ack");
+        check("new lease saved", leaseSaves == 1 && memcmp(savedLease, leaseip, 4) == 0 &&
+              memcmp(savedLease + 16, serverip, 4) == 0);
+        configure();
+}
+
+static void allocate(void)
+{
+        getLease();
+        checkState("short of T1", idle(T1_MS - SLACK_MS), DHCP_STATE_OK);
+        checkRequest("short of T1", 0, NULL, NULL, NULL, 0, 0);
+}
+
+static void requestNak(void)
+{
+        start();
+        checkRequest("start", DHCPDISCOVER, broadcastip, zeroip, zeroip, 0, 0);
+        serverAnswer(DHCPOFFER);
+        poll();
+        checkRequest("offer", DHCPREQUEST, broadcastip, zeroip, zeroip, 1, 1);
+        serverAnswer(DHCPNAK);
+        checkState("nak", poll(), DHCP_STATE_RENEW);
+        check("nothing saved", leaseSaves == 0);
+}
+
+// at T1 the mac of the server is looked up and a request is sent to it
+static void renewStart(void)
+{
+        getLease();
+        idle(T1_MS);
+        check("arp request for the server", txArps > 0);
+        checkRequest("T1 without the server mac", 0, NULL, NULL, NULL, 0, 0);
+        checkState("T1", dhcp_state(), DHCP_STATE_RENEWING);
+        serverArpReply();
+        poll();
+        checkState("T1", poll(), DHCP_STATE_RENEWING);
+        checkRequest("T1", DHCPREQUEST, serverip, leaseip, leaseip, 0, 0);
+}
+
+static void renew(void)
+{
+        unsigned long retry = (T2_MS - T1_MS) / 2;
+        renewStart();
+        // the next try after half the time left until T2
+        checkState("renew retry", idle(retry - SLACK_MS), DHCP_STATE_RENEWING);
+        checkRequest("short of the renew retry", 0, NULL, NULL, NULL, 0, 0);
+        idle(SLACK_MS);
+        checkRequest("renew retry", DHCPREQUEST, serverip, leaseip, leaseip, 0, 0);
+        serverAnswer(DHCPACK);
+        checkState("renew ack", poll(), DHCP_STATE_OK);
+        checkLease("renew ack");
+        check("renewed lease not saved", leaseSaves == 1);
+        // the lease starts again
+        checkState("short of the next T1", idle(T1_MS - SLACK_MS), DHCP_STATE_OK);
+        checkRequest("short of the next T1", 0, NULL, NULL, NULL, 0, 0);
+        idle(SLACK_MS);
+        checkRequest("next T1", DHCPREQUEST, serverip, leaseip, leaseip, 0, 0);
+}
+
+static void renewNak(void)
+{
+        renewStart();
+        serverAnswer(DHCPNAK);
+        checkState("renew nak", poll(), DHCP_STATE_RENEW);
+        check("refused lease not saved", leaseSaves == 1);
+}
+
+// no answer while renewing, at T2 any server is asked with a broadcast
+static void rebind(void)
+{
+        unsigned long retries = 0;
+        renewStart();
+        delay(1000);
+        while (poll() == DHCP_STATE_RENEWING) {
+                if (txRequests) {
+                        checkRequest("renew retry", DHCPREQUEST, serverip, leaseip, leaseip, 0, 0);
+                        retries++;
+                }
+                delay(1000);
+        }
+        check("renew retries between T1 and T2", retries >= 2);
+        checkState("T2", dhcp_state(), DHCP_STATE_REBINDING);
+        checkRequest("T2", DHCPREQUEST, broadcastip, leaseip, leaseip, 0, 0);
+        serverAnswer(DHCPACK);
+        checkState("rebind ack", poll(), DHCP_STATE_OK);
+        checkLease("rebind ack");
+        check("lease from rebinding saved", leaseSaves == 2);
+}
+
+// nobody answers at all, the address has to go at the end of the lease
+static void expire(void)
+{
+        renewStart();
+        idle(T2_MS - T1_MS);
+        checkState("T2", dhcp_state(), DHCP_STATE_REBINDING);
+        txRequests = 0;
+        checkState("short of the end of the lease", idle(LEASE_S * 1000 - T2_MS - 2 * SLACK_MS),
+                   DHCP_STATE_REBINDING);
+        checkState("end of the lease", idle(2 * SLACK_MS), DHCP_STATE_RENEW);
+}
+
+// the server confirms the lease from before the reset
+static void rebootAck(void)
+{
+        haveLease();
+        start();
+        checkState("start", dhcp_state(), DHCP_STATE_REBOOT);
+        checkRequest("start", DHCPREQUEST, broadcastip, zeroip, zeroip, 1, 0);
+        serverAnswer(DHCPACK);
+        checkState("ack", poll(), DHCP_STATE_OK);
+        checkLease("ack");
+        check("confirmed lease not saved", leaseSaves == 0);
+}
+
+static void rebootNak(void)
+{
+        haveLease();
+        start();
+        checkRequest("start", DHCPREQUEST, broadcastip, zeroip, zeroip, 1, 0);
+        serverAnswer(DHCPNAK);
+        checkState("nak", poll(), DHCP_STATE_DISCOVER);
+        checkRequest("nak", DHCPDISCOVER, broadcastip, zeroip, zeroip, 0, 0);
+        check("address cleared", memcmp(myip, zeroip, 4) == 0);
+        serverAnswer(DHCPOFFER);
+        poll();
+        checkRequest("offer", DHCPREQUEST, broadcastip, zeroip, zeroip, 1, 1);
+        serverAnswer(DHCPACK);
+        checkState("ack", poll(), DHCP_STATE_OK);
+        check("new lease saved", leaseSaves == 1);
+}
+
+static void rebootTimeout(void)
+{
+        haveLease();
+        start();
+        checkRequest("start", DHCPREQUEST, broadcastip, zeroip, zeroip, 1, 0);
+        checkState("short of the timeout", idle(DHCP_REBOOT_MS - SLACK_MS), DHCP_STATE_REBOOT);
+        checkRequest("short of the timeout", 0, NULL, NULL, NULL, 0, 0);
+        checkState("timeout", idle(SLACK_MS), DHCP_STATE_DISCOVER);
+        checkRequest("timeout", DHCPDISCOVER, broadcastip, zeroip, zeroip, 0, 0);
+        serverAnswer(DHCPOFFER);
+        poll();
+        serverAnswer(DHCPACK);
+        checkState("ack", poll(), DHCP_STATE_OK);
+        check("new lease saved", leaseSaves == 1);
+}
+
+// run a scenario on a freshly reset chip and dhcp client, returns the
+// number of failed checks
+static int run(const char *name, void (*test)(void))
+{
+        pid_t pid;
+        int status;
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+                scenario = name;
+                enc28j60EmuReset();
+                enc28j60EmuSetTxHook(watchTx);
+                enc28j60SetTransport(&enc28j60EmuTransport);
+                enc28j60Init(mymac);
+                (*test)();
+                fflush(stdout);
+                _exit(failures);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+                printf("FAIL %s: did not run to its end\n", name);
+                return(1);
+        }
+        return(WEXITSTATUS(status));
+}
+
+int main(void)
+{
+        int failed = 0;
+        failed += run("allocate", allocate);
+        failed += run("request nak", requestNak);
+        failed += run("renew", renew);
+        failed += run("renew nak", renewNak);
+        failed += run("rebind", rebind);
+        failed += run("expire", expire);
+        failed += run("reboot ack", rebootAck);
+        failed += run("reboot nak", rebootNak);
+        failed += run("reboot timeout", rebootTimeout);
+        if (failed) {
+                printf("%d checks failed\n", failed);
+        } else {
+                printf("all dhcp checks passed\n");
+        }
+        return(failed);
+}
@@ -0,0 +1,206 @@
+/*********************************************
+ * vim:sw=8:ts=8:si:et
+ * Copyright: GPL V2
+ *
+ * Test of the dns cache (DNS_CACHE_SIZE in dnslkup.c) on top of the
+ * software ENC28J60 (enc28j60emu.c). Each name is requested with
+ * dnslkup_request, the answer of the dns server is made from the
+ * request and injected into the model and goes through
+ * enc28j60PacketReceive and udp_client_check_for_dns_answer like in a
+ * sketch. Timers are run out with delay(), which advances millis()
+ * without waiting.
+ *
+ * Checked are the ip from the cache, that entries go when their ttl
+ * runs out, names that do not exist, that a new name takes an entry
+ * that has run out before the least recently used one is replaced and
+ * which one that is when the cache is full.
+ *
+ * usage: dnstest, the exit code is the number of failed checks
+ *********************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Arduino.h"
+#include "ip_config.h"
+#include "enc28j60.h"
+#include "ip_arp_udp_tcp.h"
+#include "net.h"
+#include "dnslkup.h"
+#include "enc28j60emu.h"
+
+#define BUFFER_SIZE 1500
+#define MYWWWPORT 80
+#define RCODE_NXDOMAIN 3
+
+// the checks of which entry is replaced count on 4 of them
+#if !defined(DNS_CACHE_SIZE) || DNS_CACHE_SIZE != 4
+#error "dnstest needs DNS_CACHE_SIZE 4 in ip_config.h"
+#endif
+
+static uint8_t buf[BUFFER_SIZE+1];
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x25};
+static uint8_t myip[4] = {192,168,1,25};
+static uint8_t gwip[4] = {192,168,1,1};
+static uint8_t dnsip[4] = {192,168,1,53};
+static uint8_t dnsmac[6] = {0x00,0x1b,0x21,0x0a,0x0b,0x35};
+
+// the last dns request the stack sent and how many since the last check
+static uint8_t txFrame[BUFFER_SIZE+1];
+static uint16_t txLen;
+static uint8_t txRequests;
+
+static int failures;
+
+static void watchTx(const uint8_t *frame, uint16_t len)
+{
+        if (frame[ETH_TYPE_H_P] != ETHTYPE_IP_H_V || frame[IP_PROTO_P] != IP_PROTO_UDP_V ||
+            frame[UDP_DST_PORT_H_P] != 0 || frame[UDP_DST_PORT_L_P] != 53 || len > BUFFER_SIZE) {
+                return;
+        }
+        memcpy(txFrame, frame, len);
+        txLen = len;
+        txRequests++;
+}
+
+static void check(const char *what, const char *name, int ok)
+{
+        if (!ok) {
+                printf("FAIL %s %s\n", what, name);
+                failures++;
+        }
+}
+
+// the answer of the server to the last request, an A record with ip
+// and ttl or an error in rcode
+static void serverAnswer(uint8_t rcode, uint8_t last, uint32_t ttl)
+{
+        uint8_t f[BUFFER_SIZE];
+        uint16_t qlen = ((txFrame[UDP_LEN_H_P] << 8) | txFrame[UDP_LEN_L_P]) - UDP_HEADER_LEN;
+        uint16_t p = UDP_DATA_P + qlen;
+        memcpy(f, txFrame, p);
+        memcpy(f + ETH_DST_MAC, mymac, 6);
+        memcpy(f + ETH_SRC_MAC, dnsmac, 6);
+        memcpy(f + IP_SRC_P, dnsip, 4);
+        memcpy(f + IP_DST_P, myip, 4);
+        f[UDP_SRC_PORT_H_P] = 0;
+        f[UDP_SRC_PORT_L_P] = 53;
+        f[UDP_DST_PORT_H_P] = txFrame[UDP_SRC_PORT_H_P];
+        f[UDP_DST_PORT_L_P] = txFrame[UDP_SRC_PORT_L_P];
+        f[UDP_DATA_P + 2] = 0x81;
+        f[UDP_DATA_P + 3] = 0x80 | rcode;
+        if (rcode == 0) {
+                f[UDP_DATA_P + 7] = 1;
+                // name pointer to the question, type A, class IN
+                f[p++] = 0xc0;
+                f[p++] = 12;
+                f[p++] = 0;
+                f[p++] = 1;
+                f[p++] = 0;
+                f[p++] = 1;
+                f[p++] = ttl >> 24;
+                f[p++] = ttl >> 16;
+                f[p++] = ttl >> 8;
+                f[p++] = ttl & 0xff;
+                f[p++] = 0;
+                f[p++] = 4;
+                f[p++] = 10;
+                f[p++] = 0;
+                f[p++] = 0;
+                f[p++] = last;
+        }
+        f[IP_TOTLEN_H_P] = (p - IP_P) >> 8;
+        f[IP_TOTLEN_L_P] = (p - IP_P) & 0xff;
+        f[UDP_LEN_H_P] = (p - UDP_SRC_PORT_H_P) >> 8;
+        f[UDP_LEN_L_P] = (p - UDP_SRC_PORT_H_P) & 0xff;
+        enc28j60EmuInject(f, p);
+}
+
+// ask the server for name, it answers with 10.0.0.last or rcode
+static void resolve(const char *name, uint8_t rcode, uint8_t last, uint32_t ttl)
+{
+        uint16_t plen;
+        txRequests = 0;
+        dnslkup_request(buf, (uint8_t *)name);
+        check("request sent for", name, txRequests == 1);
+        serverAnswer(rcode, last, ttl);
+        plen = enc28j60PacketReceive(BUFFER_SIZE, buf);
+        packetloop_icmp_tcp(buf, plen);
+        udp_client_check_for_dns_answer(buf, plen);
+        if (rcode == 0) {
+                check("answer taken for", name, dnslkup_haveanswer() && dnslkup_getip()[3] == last);
+        } else {
+                check("error reported for", name, dnslkup_get_error_info() == rcode);
+        }
+}
+
+// name is in the cache with 10.0.0.last, or not at all if last is 0
+static void cached(const char *name, uint8_t last)
+{
+        uint8_t r = dnslkup_cached((uint8_t *)name);
+        if (last == 0) {
+                check("still cached:", name, r == 0);
+                return;
+        }
+        check("not cached:", name, r == 1 && dnslkup_haveanswer() && dnslkup_getip()[3] == last);
+}
+
+int main(void)
+{
+        enc28j60EmuReset();
+        enc28j60EmuSetTxHook(watchTx);
+        enc28j60SetTransport(&enc28j60EmuTransport);
+        enc28j60Init(mymac);
+        init_ip_arp_udp_tcp(mymac, myip, MYWWWPORT);
+        client_set_gwip(gwip);
+        dnslkup_set_dnsip(dnsip);
+
+        resolve("a.example.com", 0, 1, 3600);
+        cached("a.example.com", 1);
+        cached("A.Example.COM", 1);
+        cached("b.example.com", 0);
+
+        // the ttl runs out
+        resolve("b.example.com", 0, 2, 10);
+        delay(9000);
+        cached("b.example.com", 2);
+        delay(1000);
+        cached("b.example.com", 0);
+
+        // a name that does not exist is kept for DNS_CACHE_NEG_TTL
+        resolve("nx.example.com", RCODE_NXDOMAIN, 0, 0);
+        check("not cached as nonexistent:", "nx.example.com",
+              dnslkup_cached((uint8_t *)"nx.example.com") == 2 && dnslkup_get_error_info() == 3);
+        delay(60000);
+        cached("nx.example.com", 0);
+
+        // an entry that ran out is taken first, the others all stay
+        resolve("a.example.com", 0, 1, 3600);
+        resolve("b.example.com", 0, 2, 10);
+        resolve("c.example.com", 0, 3, 3600);
+        resolve("d.example.com", 0, 4, 3600);
+        delay(10000);
+        resolve("e.example.com", 0, 5, 3600);
+        cached("a.example.com", 1);
+        cached("b.example.com", 0);
+        cached("c.example.com", 3);
+        cached("d.example.com", 4);
+        cached("e.example.com", 5);
+
+        // when it is full the least recently used one (a) goes
+        cached("c.example.com", 3);
+        cached("d.example.com", 4);
+        cached("e.example.com", 5);
+        resolve("f.example.com", 0, 6, 3600);
+        cached("a.example.com", 0);
+        cached("c.example.com", 3);
+        cached("d.example.com", 4);
+        cached("e.example.com", 5);
+        cached("f.example.com", 6);
+
+        if (failures) {
+                printf("%d checks failed\n", failures);
+        } else {
+                printf("all dns cache checks passed\n");
+        }
+        return(failures);
+}
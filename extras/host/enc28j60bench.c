@@ -0,0 +1,518 @@
+/*********************************************
+ * vim:sw=8:ts=8:si:et
+ * Copyright: GPL V2
+ *
+ * Native throughput benchmark of the stack on top of the software
+ * ENC28J60 (enc28j60emu.c). Each workload injects prebuilt frames,
+ * runs them through enc28j60PacketReceive (or packet_receive_filtered
+ * for the runs marked /f) and packetloop_icmp_tcp and sends the
+ * answer like a sketch would. The http runs go through a whole tcp
+ * session per request, http/s streams the page into the transmit
+ * buffer with www_server_reply_begin/end and http/m sends a 4KB page
+ * in several segments with www_server_reply_multi. idle is a pass of the
+ * main loop without traffic and the runs marked /i take the packets
+ * interrupt driven after enc28j60EnableInterrupt. It reports packets (or
+ * requests) per second and microseconds of host CPU time together
+ * with the SPI traffic, which is what dominates on the real board.
+ * Built with -DENC28J60_SPI_STATS it also breaks the transfers of the
+ * driver down by SPI opcode. At the end the checksum kernel is timed
+ * against the plain loop checksum() had before (cksum/<len>) and the
+ * incremental ip_hdr_set_len against fill_ip_hdr_checksum (iplen).
+ *
+ * usage: enc28j60bench [iterations]
+ *********************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Arduino.h"
+#include "ip_config.h"
+#include "enc28j60.h"
+#include "ip_arp_udp_tcp.h"
+#include "net.h"
+#include "enc28j60emu.h"
+
+#define BUFFER_SIZE 1500
+#define MYWWWPORT 80
+
+static uint8_t buf[BUFFER_SIZE+1];
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x25};
+static uint8_t myip[4] = {192,168,1,25};
+static uint8_t peermac[6] = {0x00,0x1b,0x21,0x0a,0x0b,0x0c};
+static uint8_t peerip[4] = {192,168,1,10};
+
+static uint32_t txCount;
+static uint32_t txBytes;
+static uint8_t lastTx[BUFFER_SIZE];
+// end of the tcp sequence space the server has sent so far
+static uint32_t txSeqEnd;
+static uint8_t txFin;
+
+static uint32_t getLong(const uint8_t *p);
+
+static void countTx(const uint8_t *frame, uint16_t len)
+{
+        uint32_t end;
+        txCount++;
+        txBytes += len;
+        memcpy(lastTx, frame, len);
+        if (frame[ETH_TYPE_H_P] == ETHTYPE_IP_H_V && frame[IP_PROTO_P] == IP_PROTO_TCP_V) {
+                end = getLong(frame + TCP_SEQ_H_P) + ((frame[IP_TOTLEN_H_P] << 8) | frame[IP_TOTLEN_L_P])
+                        - IP_HEADER_LEN - (frame[TCP_HEADER_LEN_P] >> 4) * 4;
+                if (frame[TCP_FLAGS_P] & TCP_FLAGS_FIN_V) {
+                        end++;
+                        txFin = 1;
+                }
+                if ((int32_t)(end - txSeqEnd) > 0) {
+                        txSeqEnd = end;
+                }
+        }
+}
+
+static uint16_t ipChecksum(const uint8_t *p, uint16_t len, uint32_t sum)
+{
+        while (len > 1) {
+                sum += (p[0] << 8) | p[1];
+                p += 2;
+                len -= 2;
+        }
+        if (len) {
+                sum += p[0] << 8;
+        }
+        while (sum >> 16) {
+                sum = (sum & 0xffff) + (sum >> 16);
+        }
+        return((uint16_t)~sum);
+}
+
+static uint16_t makeEth(uint8_t *f, const uint8_t *dst, uint8_t th, uint8_t tl)
+{
+        memcpy(f + ETH_DST_MAC, dst, 6);
+        memcpy(f + ETH_SRC_MAC, peermac, 6);
+        f[ETH_TYPE_H_P] = th;
+        f[ETH_TYPE_L_P] = tl;
+        return(ETH_HEADER_LEN);
+}
+
+static void makeIp(uint8_t *f, uint8_t proto, uint16_t len, const uint8_t *dst)
+{
+        uint16_t ck;
+        memset(f + IP_P, 0, IP_HEADER_LEN);
+        f[IP_P] = 0x45;
+        f[IP_TOTLEN_H_P] = len >> 8;
+        f[IP_TOTLEN_L_P] = len & 0xff;
+        f[IP_TTL_P] = 64;
+        f[IP_PROTO_P] = proto;
+        memcpy(f + IP_SRC_P, peerip, 4);
+        memcpy(f + IP_DST_P, dst, 4);
+        ck = ipChecksum(f + IP_P, IP_HEADER_LEN, 0);
+        f[IP_CHECKSUM_H_P] = ck >> 8;
+        f[IP_CHECKSUM_L_P] = ck & 0xff;
+}
+
+static uint16_t arpRequest(uint8_t *f)
+{
+        static const uint8_t hdr[8] = {0,1,8,0,6,4,0,1};
+        static const uint8_t bcast[6] = {0xff,0xff,0xff,0xff,0xff,0xff};
+        makeEth(f, bcast, ETHTYPE_ARP_H_V, ETHTYPE_ARP_L_V);
+        memcpy(f + ETH_ARP_P, hdr, 8);
+        memcpy(f + ETH_ARP_SRC_MAC_P, peermac, 6);
+        memcpy(f + ETH_ARP_SRC_IP_P, peerip, 4);
+        memset(f + ETH_ARP_DST_MAC_P, 0, 6);
+        memcpy(f + ETH_ARP_DST_IP_P, myip, 4);
+        return(42);
+}
+
+static uint16_t echoRequest(uint8_t *f)
+{
+        uint16_t ck;
+        makeEth(f, mymac, ETHTYPE_IP_H_V, ETHTYPE_IP_L_V);
+        makeIp(f, IP_PROTO_ICMP_V, IP_HEADER_LEN + 8 + 56, myip);
+        memset(f + ICMP_TYPE_P, 0, 8 + 56);
+        f[ICMP_TYPE_P] = ICMP_TYPE_ECHOREQUEST_V;
+        f[ICMP_IDENT_H_P] = 0x12;
+        memset(f + ICMP_DATA_P, 0x42, 56);
+        ck = ipChecksum(f + ICMP_TYPE_P, 8 + 56, 0);
+        f[ICMP_CHECKSUM_H_P] = ck >> 8;
+        f[ICMP_CHECKSUM_L_P] = ck & 0xff;
+        return(ETH_HEADER_LEN + IP_HEADER_LEN + 8 + 56);
+}
+
+static void putLong(uint8_t *p, uint32_t v)
+{
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+}
+
+static uint32_t getLong(const uint8_t *p)
+{
+        return(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static uint16_t tcpSegmentFrom(uint8_t *f, uint16_t port, uint32_t seq, uint32_t ack, uint8_t flags, const char *data)
+{
+        uint16_t dlen = data ? strlen(data) : 0;
+        uint16_t ck;
+        uint32_t sum;
+        makeEth(f, mymac, ETHTYPE_IP_H_V, ETHTYPE_IP_L_V);
+        makeIp(f, IP_PROTO_TCP_V, IP_HEADER_LEN + TCP_HEADER_LEN_PLAIN + dlen, myip);
+        memset(f + TCP_SRC_PORT_H_P, 0, TCP_HEADER_LEN_PLAIN);
+        f[TCP_SRC_PORT_H_P] = port >> 8;
+        f[TCP_SRC_PORT_L_P] = port & 0xff;
+        f[TCP_DST_PORT_H_P] = MYWWWPORT >> 8;
+        f[TCP_DST_PORT_L_P] = MYWWWPORT & 0xff;
+        putLong(f + TCP_SEQ_H_P, seq);
+        putLong(f + TCP_SEQACK_H_P, ack);
+        f[TCP_HEADER_LEN_P] = 0x50;
+        f[TCP_FLAGS_P] = flags;
+        f[TCP_WIN_SIZE] = 0x16;
+        f[TCP_WIN_SIZE + 1] = 0xd0;
+        if (dlen) {
+                memcpy(f + TCP_DATA_P, data, dlen);
+        }
+        sum = IP_PROTO_TCP_V + TCP_HEADER_LEN_PLAIN + dlen;
+        ck = ipChecksum(f + IP_SRC_P, 8 + TCP_HEADER_LEN_PLAIN + dlen, sum);
+        f[TCP_CHECKSUM_H_P] = ck >> 8;
+        f[TCP_CHECKSUM_L_P] = ck & 0xff;
+        return(ETH_HEADER_LEN + IP_HEADER_LEN + TCP_HEADER_LEN_PLAIN + dlen);
+}
+
+static uint16_t tcpSegment(uint8_t *f, uint8_t flags, const char *data)
+{
+        return(tcpSegmentFrom(f, 0xc350, 1, 0x0a01, flags, data));
+}
+
+static uint16_t foreignUdp(uint8_t *f)
+{
+        static const uint8_t bcast[6] = {0xff,0xff,0xff,0xff,0xff,0xff};
+        static const uint8_t bcastip[4] = {192,168,1,255};
+        uint16_t dlen = 400;
+        makeEth(f, bcast, ETHTYPE_IP_H_V, ETHTYPE_IP_L_V);
+        makeIp(f, IP_PROTO_UDP_V, IP_HEADER_LEN + UDP_HEADER_LEN + dlen, bcastip);
+        f[UDP_SRC_PORT_H_P] = 0x07;
+        f[UDP_SRC_PORT_L_P] = 0x6c;
+        f[UDP_DST_PORT_H_P] = 0x07;
+        f[UDP_DST_PORT_L_P] = 0x6c;
+        f[UDP_LEN_H_P] = (UDP_HEADER_LEN + dlen) >> 8;
+        f[UDP_LEN_L_P] = (UDP_HEADER_LEN + dlen) & 0xff;
+        f[UDP_CHECKSUM_H_P] = 0;
+        f[UDP_CHECKSUM_L_P] = 0;
+        memset(f + UDP_DATA_P, 0x55, dlen);
+        return(ETH_HEADER_LEN + IP_HEADER_LEN + UDP_HEADER_LEN + dlen);
+}
+
+// about 1400 bytes of html, the size of a full segment
+static uint16_t fillPage(uint8_t *b)
+{
+        uint16_t plen;
+        uint8_t i;
+        plen = fill_tcp_data_p(b, 0, PSTR("HTTP/1.0 200 OK\r\nContent-Type: text/html\r\nPragma: no-cache\r\n\r\n"));
+        plen = fill_tcp_data_p(b, plen, PSTR("<html><head><title>bench</title></head><body>"));
+        for (i = 0; i < 20; i++) {
+                plen = fill_tcp_data_p(b, plen, PSTR("<p>The quick brown fox jumps over the lazy dog.</p>\n"));
+        }
+        plen = fill_tcp_data_p(b, plen, PSTR("</body></html>"));
+        return(plen);
+}
+
+// the same page written straight into the transmit buffer
+static void streamPage(uint8_t *b)
+{
+        uint8_t i;
+        www_server_reply_begin(b);
+        stream_tcp_data_p(PSTR("HTTP/1.0 200 OK\r\nContent-Type: text/html\r\nPragma: no-cache\r\n\r\n"));
+        stream_tcp_data_p(PSTR("<html><head><title>bench</title></head><body>"));
+        for (i = 0; i < 20; i++) {
+                stream_tcp_data_p(PSTR("<p>The quick brown fox jumps over the lazy dog.</p>\n"));
+        }
+        stream_tcp_data_p(PSTR("</body></html>"));
+        www_server_reply_end(b);
+}
+
+// a page of about 4KB sent with www_server_reply_multi
+static const char bigLine[] = "<p>The quick brown fox jumps over the lazy dog.</p>\n";
+#define BIG_LINES 80
+#define BIG_LEN ((sizeof(bigLine) - 1) * BIG_LINES)
+
+static uint16_t fillBigPage(uint8_t fd, uint8_t *b, uint16_t offset, uint16_t maxlen, uint8_t *last)
+{
+        uint16_t len = 0;
+        uint16_t pos, n;
+        (void)fd;
+        while (len < maxlen && offset < BIG_LEN) {
+                pos = offset % (sizeof(bigLine) - 1);
+                n = sizeof(bigLine) - 1 - pos;
+                if (n > maxlen - len) {
+                        n = maxlen - len;
+                }
+                len = fill_tcp_data_len(b, len, bigLine + pos, n);
+                offset += n;
+        }
+        *last = (offset == BIG_LEN);
+        return(len);
+}
+
+static double nowSec(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+// set once enc28j60EnableInterrupt was called: the INT pin of the
+// model is then wired to the interrupt handler of the driver
+static uint8_t irqWired;
+
+static uint16_t receive(uint8_t filtered)
+{
+        if (irqWired && enc28j60EmuInt()) {
+                enc28j60IrqHandler();
+        }
+        if (filtered) {
+                return(packet_receive_filtered(buf, BUFFER_SIZE));
+        }
+        return(enc28j60PacketReceive(BUFFER_SIZE, buf));
+}
+
+// with ENC28J60_SPI_STATS the driver counts its transfers per opcode
+static void clearOps(void)
+{
+#ifdef ENC28J60_SPI_STATS
+        enc28j60SpiCountClear();
+#endif
+}
+
+static void printOps(long iterations)
+{
+#ifdef ENC28J60_SPI_STATS
+        printf("%-10s rcr %5.1f wcr %5.1f bfs %5.1f bfc %5.1f rbm %5.1f wbm %5.1f bank %5.1f\n", "",
+               (double)enc28j60SpiCount(ENC28J60_READ_CTRL_REG) / iterations,
+               (double)enc28j60SpiCount(ENC28J60_WRITE_CTRL_REG) / iterations,
+               (double)enc28j60SpiCount(ENC28J60_BIT_FIELD_SET) / iterations,
+               (double)enc28j60SpiCount(ENC28J60_BIT_FIELD_CLR) / iterations,
+               (double)enc28j60SpiCount(ENC28J60_READ_BUF_MEM) / iterations,
+               (double)enc28j60SpiCount(ENC28J60_WRITE_BUF_MEM) / iterations,
+               (double)enc28j60SpiCount(ENC28J60_BANK_SWITCH) / iterations);
+#else
+        (void)iterations;
+#endif
+}
+
+static void run(const char *name, const uint8_t *frame, uint16_t len, uint8_t filtered, long iterations)
+{
+        enc28j60EmuStats st;
+        uint16_t plen;
+        double t0, t;
+        long i;
+
+        txCount = 0;
+        txBytes = 0;
+        enc28j60EmuClearStats();
+        clearOps();
+        t0 = nowSec();
+        for (i = 0; i < iterations; i++) {
+                if (len) {
+                        enc28j60EmuInject(frame, len);
+                }
+                plen = receive(filtered);
+                packetloop_icmp_tcp(buf, plen);
+        }
+        t = nowSec() - t0;
+        enc28j60EmuGetStats(&st);
+        printf("%-10s %10.0f pkt/s %8.3f us/pkt %8.1f spi bytes/pkt %6.1f spi cycles/pkt %6.2f tx/pkt\n",
+               name, iterations / t, t * 1e6 / iterations,
+               (double)st.spiBytes / iterations,
+               (double)st.spiTransactions / iterations,
+               (double)txCount / iterations);
+        printOps(iterations);
+}
+
+// one complete http session per iteration: handshake, request, reply
+// and close, with the client port changing every time
+static void runHttp(const char *name, uint8_t filtered, uint8_t stream, long iterations)
+{
+        static uint8_t f[BUFFER_SIZE];
+        static const char get[] = "GET / HTTP/1.0\r\n\r\n";
+        enc28j60EmuStats st;
+        uint16_t plen, dat_p, port, len;
+        uint32_t seq, ack;
+        double t0, t;
+        long i;
+        uint8_t step;
+
+        txCount = 0;
+        txBytes = 0;
+        enc28j60EmuClearStats();
+        clearOps();
+        t0 = nowSec();
+        for (i = 0; i < iterations; i++) {
+                port = 0xc000 + (i & 0x3fff);
+                seq = 1000 + i;
+                ack = 0;
+                txSeqEnd = 0;
+                txFin = 0;
+                for (step = 0; step < 4; step++) {
+                        if (step == 0) {
+                                len = tcpSegmentFrom(f, port, seq, 0, TCP_FLAGS_SYN_V, NULL);
+                        } else if (step == 1) {
+                                seq++;
+                                ack = getLong(lastTx + TCP_SEQ_H_P) + 1;
+                                len = tcpSegmentFrom(f, port, seq, ack, TCP_FLAGS_ACK_V, NULL);
+                        } else if (step == 2) {
+                                len = tcpSegmentFrom(f, port, seq, ack, TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V, get);
+                                seq += strlen(get);
+                        } else if (!txFin) {
+                                // ack what came so far to get the rest of the reply
+                                len = tcpSegmentFrom(f, port, seq, txSeqEnd, TCP_FLAGS_ACK_V, NULL);
+                                step--;
+                        } else {
+                                // ack the reply including its FIN and close
+                                len = tcpSegmentFrom(f, port, seq, txSeqEnd, TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, NULL);
+                        }
+                        enc28j60EmuInject(f, len);
+                        plen = receive(filtered);
+                        dat_p = packetloop_icmp_tcp(buf, plen);
+                        if (dat_p && stream == 2) {
+                                www_server_reply_multi(buf, BUFFER_SIZE, fillBigPage);
+                        } else if (dat_p && stream) {
+                                streamPage(buf);
+                        } else if (dat_p) {
+                                www_server_reply(buf, fillPage(buf));
+                        }
+                }
+        }
+        t = nowSec() - t0;
+        enc28j60EmuGetStats(&st);
+        printf("%-10s %10.0f req/s %8.3f us/req %8.1f spi bytes/req %6.1f spi cycles/req %6.2f tx/req\n",
+               name, iterations / t, t * 1e6 / iterations,
+               (double)st.spiBytes / iterations,
+               (double)st.spiTransactions / iterations,
+               (double)txCount / iterations);
+        printOps(iterations);
+}
+
+// checksum() as it was before it used checksum_add, to compare with
+static uint16_t checksumRef(uint8_t *b, uint16_t len, uint8_t type)
+{
+        uint32_t sum = 0;
+        if (type == 1) {
+                sum += IP_PROTO_UDP_V;
+                sum += len - 8;
+        }
+        if (type == 2) {
+                sum += IP_PROTO_TCP_V;
+                sum += len - 8;
+        }
+        while (len > 1) {
+                sum += 0xFFFF & (((uint32_t)*b << 8) | *(b + 1));
+                b += 2;
+                len -= 2;
+        }
+        if (len) {
+                sum += ((uint32_t)(0xFF & *b)) << 8;
+        }
+        while (sum >> 16) {
+                sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        return((uint16_t)sum ^ 0xFFFF);
+}
+
+// keeps the compiler from dropping the checksum loops
+static volatile uint16_t ckSink;
+
+// the checksum kernel against the old routine over a few packet
+// sizes, and patching the length of an ip header with ip_hdr_set_len
+// against filling in its checksum again
+static void runChecksum(long iterations)
+{
+        static const uint16_t sizes[] = {20, 28, 64, 576, 1460};
+        static uint8_t f[BUFFER_SIZE];
+        double t0, tref, tnew;
+        uint16_t i, n;
+        long k;
+
+        for (i = 0; i < sizeof(f); i++) {
+                f[i] = (uint8_t)(i * 131 + 7);
+        }
+        for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+                // odd lengths and the pseudo header must give the same
+                for (i = 0; i < 3; i++) {
+                        if (checksum(f, sizes[n] + 1, i) != checksumRef(f, sizes[n] + 1, i)) {
+                                printf("cksum/%u: differs from the old routine\n", sizes[n]);
+                        }
+                }
+                t0 = nowSec();
+                for (k = 0; k < iterations; k++) {
+                        f[0] = (uint8_t)k;
+                        ckSink = checksumRef(f, sizes[n], 2);
+                }
+                tref = nowSec() - t0;
+                t0 = nowSec();
+                for (k = 0; k < iterations; k++) {
+                        f[0] = (uint8_t)k;
+                        ckSink = checksum(f, sizes[n], 2);
+                }
+                tnew = nowSec() - t0;
+                printf("cksum/%-4u %8.1f ns old %8.1f ns new %6.2fx\n", sizes[n],
+                       tref * 1e9 / iterations, tnew * 1e9 / iterations, tref / tnew);
+        }
+        makeIp(f, IP_PROTO_TCP_V, 40, myip);
+        t0 = nowSec();
+        for (k = 0; k < iterations; k++) {
+                f[IP_TOTLEN_H_P] = 0;
+                f[IP_TOTLEN_L_P] = (uint8_t)k;
+                fill_ip_hdr_checksum(f);
+        }
+        tref = nowSec() - t0;
+        t0 = nowSec();
+        for (k = 0; k < iterations; k++) {
+                ip_hdr_set_len(f, (uint8_t)k);
+        }
+        tnew = nowSec() - t0;
+        if (ipChecksum(f + IP_P, IP_HEADER_LEN, 0) != 0) {
+                printf("iplen: wrong ip header checksum\n");
+        }
+        printf("iplen      %8.1f ns fill %7.1f ns set_len %6.2fx\n",
+               tref * 1e9 / iterations, tnew * 1e9 / iterations, tref / tnew);
+}
+
+int main(int argc, char **argv)
+{
+        static uint8_t frame[BUFFER_SIZE];
+        long iterations = 200000;
+        uint16_t len;
+
+        if (argc > 1) {
+                iterations = atol(argv[1]);
+        }
+        enc28j60EmuReset();
+        enc28j60EmuSetTxHook(countTx);
+        enc28j60SetTransport(&enc28j60EmuTransport);
+        enc28j60Init(mymac);
+        init_ip_arp_udp_tcp(mymac, myip, MYWWWPORT);
+        len = arpRequest(frame);
+        run("arp", frame, len, 0, iterations);
+        len = echoRequest(frame);
+        run("ping", frame, len, 0, iterations);
+        len = tcpSegment(frame, TCP_FLAGS_SYN_V, NULL);
+        run("tcp-syn", frame, len, 0, iterations);
+        len = foreignUdp(frame);
+        run("foreign", frame, len, 0, iterations);
+        run("foreign/f", frame, len, 1, iterations);
+        runHttp("http", 0, 0, iterations);
+        runHttp("http/f", 1, 0, iterations);
+        runHttp("http/s", 1, 1, iterations);
+        runHttp("http/m", 1, 2, iterations);
+        // a loop() pass without traffic, then the same with the INT pin
+        run("idle", frame, 0, 0, iterations);
+        enc28j60EnableInterrupt(0);
+        irqWired = 1;
+        run("idle/i", frame, 0, 0, iterations);
+        len = echoRequest(frame);
+        run("ping/i", frame, len, 0, iterations);
+        runHttp("http/i", 1, 0, iterations);
+        runChecksum(iterations * 10);
+        return(0);
+}
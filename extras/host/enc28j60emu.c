@@ -0,0 +1,516 @@
+/*********************************************
+ * vim:sw=8:ts=8:si:et
+ * Copyright: GPL V2
+ *
+ * Software model of the ENC28J60, see enc28j60emu.h
+ *
+ * Register and buffer behaviour follows the Microchip ENC28J60 data
+ * sheet (DS39662). Only the features used by this library are modelled.
+ *********************************************/
+#include <string.h>
+#include "enc28j60.h"
+#include "enc28j60emu.h"
+
+#define MEMSIZE 0x2000
+
+static uint8_t mem[MEMSIZE];
+// 4 banks of 32 registers, the common registers 0x1B-0x1F live in bank 0
+static uint8_t regs[4][32];
+static uint16_t phy[32];
+static enc28j60EmuStats stats;
+static void (*txHook)(const uint8_t *frame, uint16_t len);
+// a frame handed over with TXRTS stays on the wire until this many
+// SPI bytes have been clocked, 10MBit/s against 8MHz SPI
+static uint8_t txActive;
+static uint32_t txDoneAt;
+
+static uint8_t *reg(uint8_t address)
+{
+        uint8_t a = address & ADDR_MASK;
+        if (a >= EIE) {
+                return(&regs[0][a]);
+        }
+        return(&regs[regs[0][ECON1] & (ECON1_BSEL1|ECON1_BSEL0)][a]);
+}
+
+// 16 bit register pairs are accessed with the bank given in the define
+static uint16_t getWord(uint8_t address)
+{
+        uint8_t *r = regs[(address & BANK_MASK) >> 5];
+        address &= ADDR_MASK;
+        return(r[address] | ((uint16_t)r[address + 1] << 8));
+}
+
+static void setWord(uint8_t address, uint16_t v)
+{
+        uint8_t *r = regs[(address & BANK_MASK) >> 5];
+        address &= ADDR_MASK;
+        r[address] = v & 0xff;
+        r[address + 1] = (v >> 8) & 0x1f;
+}
+
+static uint8_t *bankReg(uint8_t address)
+{
+        return(&regs[(address & BANK_MASK) >> 5][address & ADDR_MASK]);
+}
+
+void enc28j60EmuReset(void)
+{
+        memset(mem, 0, sizeof(mem));
+        memset(regs, 0, sizeof(regs));
+        memset(phy, 0, sizeof(phy));
+        memset(&stats, 0, sizeof(stats));
+        txActive = 0;
+        regs[0][ECON2] = ECON2_AUTOINC;
+        regs[0][ESTAT] = ESTAT_CLKRDY;
+        setWord(ERXNDL, 0x1fff);
+        setWord(ERDPTL, 0x05fa);
+        setWord(ERXRDPTL, 0x05fa);
+        *bankReg(ERXFCON) = ERXFCON_UCEN|ERXFCON_CRCEN|ERXFCON_BCEN;
+        setWord(MAMXFLL, 0x0600);
+        // rev B7
+        *bankReg(EREVID) = 6;
+        // link is up
+        phy[PHSTAT2] = 0x0400;
+}
+
+static void softReset(void)
+{
+        // the soft reset does not clear the buffer memory
+        uint8_t saved[MEMSIZE];
+        enc28j60EmuStats s = stats;
+        memcpy(saved, mem, sizeof(mem));
+        enc28j60EmuReset();
+        memcpy(mem, saved, sizeof(mem));
+        stats = s;
+}
+
+static void transmit(void)
+{
+        uint16_t start = getWord(ETXSTL);
+        uint16_t end = getWord(ETXNDL);
+        uint16_t len = 0;
+        uint8_t i;
+        // the first byte is the per packet control byte
+        if (end > start && end < MEMSIZE) {
+                len = end - start;
+                // MAMXFL counts the CRC the MAC appends
+                if (!(*bankReg(MACON3) & MACON3_HFRMLEN) && len + 4 > getWord(MAMXFLL)) {
+                        stats.txAborts++;
+                        regs[0][ESTAT] |= ESTAT_TXABRT;
+                        regs[0][EIR] |= EIR_TXERIF;
+                        txActive = 1;
+                        txDoneAt = stats.spiBytes;
+                        return;
+                }
+                stats.txFrames++;
+                if (txHook) {
+                        txHook(&mem[start + 1], len);
+                }
+                // the chip writes a 7 byte transmit status vector behind
+                // the frame, bit 7 of byte 2 is "transmit done"
+                for (i = 0; i < 7; i++) {
+                        mem[(end + 1 + i) & (MEMSIZE - 1)] = 0;
+                }
+                mem[(end + 1) & (MEMSIZE - 1)] = len & 0xff;
+                mem[(end + 2) & (MEMSIZE - 1)] = len >> 8;
+                mem[(end + 3) & (MEMSIZE - 1)] = 0x80;
+        }
+        // preamble, CRC and inter frame gap add 20 bytes, a byte on
+        // the wire takes 0.8 SPI byte times
+        txActive = 1;
+        txDoneAt = stats.spiBytes + (uint32_t)(len + 20) * 4 / 5;
+}
+
+// let the time on the wire pass, called before every SPI transaction
+static void wire(void)
+{
+        if (txActive && (int32_t)(stats.spiBytes - txDoneAt) >= 0) {
+                txActive = 0;
+                regs[0][ECON1] &= ~ECON1_TXRTS;
+                regs[0][EIR] |= EIR_TXIF;
+        }
+}
+
+// next address for the DMA, which wraps inside the receive buffer
+static uint16_t dmaNext(uint16_t p)
+{
+        if (p == getWord(ERXNDL)) {
+                return(getWord(ERXSTL));
+        }
+        return((p + 1) & (MEMSIZE - 1));
+}
+
+// DMA copy, or with ECON1.CSUMEN the IP checksum of EDMAST..EDMAND
+static void dma(void)
+{
+        uint16_t p = getWord(EDMASTL);
+        uint16_t end = getWord(EDMANDL);
+        uint16_t dst = getWord(EDMADSTL);
+        uint32_t sum = 0;
+        uint8_t odd = 0;
+        for (;;) {
+                if (regs[0][ECON1] & ECON1_CSUMEN) {
+                        sum += odd ? mem[p] : ((uint32_t)mem[p] << 8);
+                        odd ^= 1;
+                } else {
+                        mem[dst] = mem[p];
+                        dst = dmaNext(dst);
+                }
+                if (p == end) {
+                        break;
+                }
+                p = dmaNext(p);
+        }
+        if (regs[0][ECON1] & ECON1_CSUMEN) {
+                while (sum >> 16) {
+                        sum = (sum & 0xffff) + (sum >> 16);
+                }
+                sum ^= 0xffff;
+                *bankReg(EDMACSL) = sum & 0xff;
+                *bankReg(EDMACSH) = sum >> 8;
+        }
+        regs[0][ECON1] &= ~ECON1_DMAST;
+        regs[0][EIR] |= EIR_DMAIF;
+}
+
+static void pktDec(void)
+{
+        uint8_t *cnt = bankReg(EPKTCNT);
+        if (*cnt) {
+                (*cnt)--;
+        }
+        if (*cnt == 0) {
+                regs[0][EIR] &= ~EIR_PKTIF;
+        }
+}
+
+// side effects of writes into ECON1/ECON2 and the MII registers
+static void written(uint8_t address)
+{
+        uint8_t a = address & ADDR_MASK;
+        uint8_t bank = regs[0][ECON1] & (ECON1_BSEL1|ECON1_BSEL0);
+        if (a == ECON1) {
+                if (regs[0][ECON1] & ECON1_DMAST) {
+                        dma();
+                }
+                if (!(regs[0][ECON1] & ECON1_TXRTS)) {
+                        // cleared by hand, e.g. after TXRST
+                        txActive = 0;
+                } else if (!txActive) {
+                        transmit();
+                }
+                return;
+        }
+        if (a == ECON2) {
+                if (regs[0][ECON2] & ECON2_PKTDEC) {
+                        pktDec();
+                        regs[0][ECON2] &= ~ECON2_PKTDEC;
+                }
+                return;
+        }
+        if (bank == 0 && a == (ERXSTH & ADDR_MASK)) {
+                // programming ERXST also moves ERXWRPT
+                setWord(ERXWRPTL, getWord(ERXSTL));
+                return;
+        }
+        if (bank == 2 && a == (MICMD & ADDR_MASK)) {
+                if (*bankReg(MICMD) & MICMD_MIIRD) {
+                        uint16_t v = phy[*bankReg(MIREGADR) & 0x1f];
+                        *bankReg(MIRDL) = v & 0xff;
+                        *bankReg(MIRDH) = v >> 8;
+                }
+                return;
+        }
+        if (bank == 2 && a == (MIWRH & ADDR_MASK)) {
+                phy[*bankReg(MIREGADR) & 0x1f] = *bankReg(MIWRL) | ((uint16_t)*bankReg(MIWRH) << 8);
+                return;
+        }
+}
+
+static uint8_t bufRead(void)
+{
+        uint16_t p = getWord(ERDPTL);
+        uint8_t v = mem[p];
+        if (regs[0][ECON2] & ECON2_AUTOINC) {
+                // the read pointer wraps inside the receive buffer
+                if (p == getWord(ERXNDL)) {
+                        p = getWord(ERXSTL);
+                } else {
+                        p = (p + 1) & (MEMSIZE - 1);
+                }
+                setWord(ERDPTL, p);
+        }
+        return(v);
+}
+
+static void bufWrite(uint8_t v)
+{
+        uint16_t p = getWord(EWRPTL);
+        mem[p] = v;
+        if (regs[0][ECON2] & ECON2_AUTOINC) {
+                setWord(EWRPTL, (p + 1) & (MEMSIZE - 1));
+        }
+}
+
+static uint8_t emuReadOp(uint8_t op, uint8_t address)
+{
+        wire();
+        stats.spiTransactions++;
+        if (op == ENC28J60_READ_BUF_MEM) {
+                stats.spiBytes += 2;
+                return(bufRead());
+        }
+        // MAC and MII registers need a dummy byte
+        stats.spiBytes += (address & SPRD_MASK) ? 3 : 2;
+        return(*reg(address));
+}
+
+static void emuWriteOp(uint8_t op, uint8_t address, uint8_t data)
+{
+        uint8_t *r;
+        wire();
+        stats.spiTransactions++;
+        stats.spiBytes += 2;
+        switch (op) {
+        case ENC28J60_SOFT_RESET:
+                stats.spiBytes--;
+                softReset();
+                return;
+        case ENC28J60_WRITE_BUF_MEM:
+                bufWrite(data);
+                return;
+        }
+        r = reg(address);
+        switch (op) {
+        case ENC28J60_WRITE_CTRL_REG:
+                *r = data;
+                break;
+        case ENC28J60_BIT_FIELD_SET:
+                *r |= data;
+                break;
+        case ENC28J60_BIT_FIELD_CLR:
+                *r &= ~data;
+                break;
+        default:
+                return;
+        }
+        written(address);
+}
+
+static void emuReadBuffer(uint16_t len, uint8_t *data)
+{
+        wire();
+        stats.spiTransactions++;
+        stats.spiBytes += 1 + len;
+        while (len--) {
+                *data++ = bufRead();
+        }
+}
+
+static void emuWriteBuffer(uint16_t len, uint8_t *data)
+{
+        wire();
+        stats.spiTransactions++;
+        stats.spiBytes += 1 + len;
+        while (len--) {
+                bufWrite(*data++);
+        }
+}
+
+const enc28j60Transport enc28j60EmuTransport = {
+        emuReadOp, emuWriteOp, emuReadBuffer, emuWriteBuffer
+};
+
+// hash table bucket of a destination address: bits 28:23 of the
+// ethernet CRC, computed here the reflected way
+static uint8_t hashBucket(const uint8_t *mac)
+{
+        uint32_t crc = 0xffffffff;
+        uint32_t r = 0;
+        uint8_t i, j;
+        for (i = 0; i < 6; i++) {
+                crc ^= mac[i];
+                for (j = 0; j < 8; j++) {
+                        crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+                }
+        }
+        for (i = 0; i < 32; i++) {
+                r = (r << 1) | ((crc >> i) & 1);
+        }
+        return((r >> 23) & 0x3f);
+}
+
+// pattern match filter: checksum of the window bytes selected by
+// EPMM0-EPMM7 against EPMCS
+static uint8_t patternMatch(const uint8_t *frame, uint16_t len)
+{
+        uint16_t off = getWord(EPMOL);
+        uint32_t sum = 0;
+        uint8_t odd = 0;
+        uint8_t i;
+        for (i = 0; i < 64; i++) {
+                if (*bankReg(EPMM0 + (i >> 3)) & (1 << (i & 7))) {
+                        if (off + i >= len) {
+                                return(0);
+                        }
+                        sum += odd ? frame[off + i] : ((uint32_t)frame[off + i] << 8);
+                        odd ^= 1;
+                }
+        }
+        while (sum >> 16) {
+                sum = (sum & 0xffff) + (sum >> 16);
+        }
+        return((uint16_t)~sum == getWord(EPMCSL));
+}
+
+// receive filter, see data sheet section 8
+static uint8_t accept(const uint8_t *frame, uint16_t len)
+{
+        uint8_t f = *bankReg(ERXFCON);
+        uint8_t i;
+        uint8_t bcast = 1;
+        uint8_t mine = 1;
+        uint8_t mac[6];
+        // the MAC address registers are byte-backward
+        mac[0] = *bankReg(MAADR5);
+        mac[1] = *bankReg(MAADR4);
+        mac[2] = *bankReg(MAADR3);
+        mac[3] = *bankReg(MAADR2);
+        mac[4] = *bankReg(MAADR1);
+        mac[5] = *bankReg(MAADR0);
+        if ((f & ~ERXFCON_CRCEN) == 0) {
+                // promiscuous
+                return(1);
+        }
+        for (i = 0; i < 6; i++) {
+                if (frame[i] != 0xff) {
+                        bcast = 0;
+                }
+                if (frame[i] != mac[i]) {
+                        mine = 0;
+                }
+        }
+        if ((f & ERXFCON_UCEN) && mine) {
+                return(1);
+        }
+        if ((f & ERXFCON_BCEN) && bcast) {
+                return(1);
+        }
+        if ((f & ERXFCON_MCEN) && (frame[0] & 1) && !bcast) {
+                return(1);
+        }
+        if ((f & ERXFCON_PMEN) && patternMatch(frame, len)) {
+                return(1);
+        }
+        if ((f & ERXFCON_HTEN) && !bcast) {
+                i = hashBucket(frame);
+                if (*bankReg(EHT0 + (i >> 3)) & (1 << (i & 7))) {
+                        return(1);
+                }
+        }
+        return(0);
+}
+
+static void ringPut(uint16_t *p, uint8_t v)
+{
+        mem[*p] = v;
+        if (*p == getWord(ERXNDL)) {
+                *p = getWord(ERXSTL);
+        } else {
+                (*p)++;
+        }
+}
+
+uint8_t enc28j60EmuInject(const uint8_t *frame, uint16_t len)
+{
+        uint16_t st = getWord(ERXSTL);
+        uint16_t nd = getWord(ERXNDL);
+        uint16_t size = nd - st + 1;
+        uint16_t wr = getWord(ERXWRPTL);
+        uint16_t rd = getWord(ERXRDPTL);
+        uint16_t need, freeb, next, count, i;
+        uint8_t *cnt = bankReg(EPKTCNT);
+        uint8_t bcast;
+
+        if (!(regs[0][ECON1] & ECON1_RXEN) || len < 14) {
+                return(0);
+        }
+        if (!accept(frame, len)) {
+                stats.rxFiltered++;
+                return(0);
+        }
+        // 6 byte header, data and 4 byte CRC, the next packet always
+        // starts on an even address
+        count = len + 4;
+        need = 6 + count;
+        need += need & 1;
+        if (rd == wr) {
+                freeb = size;
+        } else {
+                freeb = (uint16_t)(rd - wr + size) % size;
+        }
+        if (need >= freeb || *cnt == 0xff) {
+                stats.rxOverflows++;
+                regs[0][EIR] |= EIR_RXERIF;
+                return(0);
+        }
+        next = wr + need;
+        if (next > nd) {
+                next -= size;
+        }
+        bcast = (frame[0] & frame[1] & frame[2] & frame[3] & frame[4] & frame[5]) == 0xff;
+        ringPut(&wr, next & 0xff);
+        ringPut(&wr, next >> 8);
+        ringPut(&wr, count & 0xff);
+        ringPut(&wr, count >> 8);
+        // receive status vector bits 16-31: bit 23 received ok,
+        // bit 24 multicast, bit 25 broadcast
+        ringPut(&wr, 0x80);
+        ringPut(&wr, bcast ? 0x02 : ((frame[0] & 1) ? 0x01 : 0x00));
+        for (i = 0; i < len; i++) {
+                ringPut(&wr, frame[i]);
+        }
+        // the model does not compute the CRC
+        for (i = 0; i < 4; i++) {
+                ringPut(&wr, 0);
+        }
+        setWord(ERXWRPTL, next);
+        (*cnt)++;
+        regs[0][EIR] |= EIR_PKTIF;
+        stats.rxFrames++;
+        return(1);
+}
+
+uint8_t enc28j60EmuInt(void)
+{
+        // the EIE enable bits match the EIR flag bits
+        if (!(regs[0][EIE] & EIE_INTIE)) {
+                return(0);
+        }
+        return((regs[0][EIE] & regs[0][EIR] & 0x7f) != 0);
+}
+
+void enc28j60EmuSetTxHook(void (*hook)(const uint8_t *frame, uint16_t len))
+{
+        txHook = hook;
+}
+
+void enc28j60EmuGetStats(enc28j60EmuStats *s)
+{
+        *s = stats;
+}
+
+void enc28j60EmuClearStats(void)
+{
+        // the wire time is counted in spiBytes
+        txDoneAt -= stats.spiBytes;
+        memset(&stats, 0, sizeof(stats));
+}
+
+uint8_t *enc28j60EmuMemory(void)
+{
+        return(mem);
+}
+
+/* end of enc28j60emu.c */
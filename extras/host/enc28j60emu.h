@@ -0,0 +1,57 @@
+/*********************************************
+ * vim:sw=8:ts=8:si:et
+ * Copyright: GPL V2
+ *
+ * Software model of the ENC28J60 for native (PC) builds of the stack.
+ *
+ * The model keeps the 8K buffer RAM, the four control register banks
+ * and the PHY registers and implements the SPI opcodes the driver
+ * uses. Received frames are injected into the RX ring between ERXST
+ * and ERXND exactly as the chip stores them (next packet pointer,
+ * receive status vector, data, CRC) and EPKTCNT counts them.
+ * Setting ECON1.TXRTS hands the frame between ETXST+1 and ETXND to
+ * a transmit hook. A frame that is longer than MAMXFL with its CRC is
+ * aborted like on the chip unless MACON3.HFRMLEN is set: ESTAT.TXABRT
+ * and EIR.TXERIF are set and the hook is not called.
+ * TXRTS stays set for the time the frame would take
+ * on a 10MBit/s wire, measured in bytes clocked over an 8MHz SPI
+ * link. ECON1.DMAST runs the DMA copy or checksum.
+ * The INT pin follows EIE and EIR.
+ * Every SPI transaction and byte is counted so that a benchmark can
+ * estimate the time the real SPI link would take.
+ *********************************************/
+//@{
+#ifndef ENC28J60EMU_H
+#define ENC28J60EMU_H
+#include <inttypes.h>
+#include "enc28j60.h"
+
+typedef struct enc28j60EmuStats {
+        uint32_t spiTransactions;   // chip select cycles
+        uint32_t spiBytes;          // bytes clocked over SPI incl. opcodes
+        uint32_t rxFrames;          // frames stored in the RX ring
+        uint32_t rxFiltered;        // frames rejected by ERXFCON
+        uint32_t rxOverflows;       // frames lost because the ring was full
+        uint32_t txFrames;          // frames sent with ECON1.TXRTS
+        uint32_t txAborts;          // frames longer than MAMXFL, not sent
+} enc28j60EmuStats;
+
+// transport to pass to enc28j60SetTransport
+extern const enc28j60Transport enc28j60EmuTransport;
+
+// power on reset of the model, clears memory, registers and statistics
+extern void enc28j60EmuReset(void);
+// deliver a frame (without CRC) from the wire, returns 1 if it was
+// stored in the RX ring, 0 if it was filtered out or did not fit
+extern uint8_t enc28j60EmuInject(const uint8_t *frame, uint16_t len);
+// called for every transmitted frame (without control byte and CRC)
+extern void enc28j60EmuSetTxHook(void (*hook)(const uint8_t *frame, uint16_t len));
+// level of the INT pin, 1 means asserted (the pin is active low)
+extern uint8_t enc28j60EmuInt(void);
+extern void enc28j60EmuGetStats(enc28j60EmuStats *stats);
+extern void enc28j60EmuClearStats(void);
+// direct access to the 8K buffer RAM for inspection
+extern uint8_t *enc28j60EmuMemory(void);
+
+#endif /* ENC28J60EMU_H */
+//@}
@@ -0,0 +1,75 @@
+/*********************************************
+ * vim:sw=8:ts=8:si:et
+ * Copyright: GPL V2
+ *
+ * Arduino core functions for native builds, see include/Arduino.h
+ *********************************************/
+#include <time.h>
+#include "Arduino.h"
+#include <avr/io.h>
+
+// delay() adds to this instead of sleeping
+static unsigned long long skewUs;
+
+static unsigned long long nowUs(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return((unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000 + skewUs);
+}
+
+unsigned long millis(void)
+{
+        return((unsigned long)(nowUs() / 1000));
+}
+
+unsigned long micros(void)
+{
+        return((unsigned long)nowUs());
+}
+
+void delay(unsigned long ms)
+{
+        skewUs += (unsigned long long)ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+        skewUs += us;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+}
+
+int analogRead(uint8_t pin)
+{
+        return(rand() & 0x3ff);
+}
+
+char *itoa(int value, char *s, int radix)
+{
+        char tmp[18];
+        char *p = s;
+        unsigned int v;
+        int i = 0;
+        if (value < 0 && radix == 10) {
+                *p++ = '-';
+                v = -value;
+        } else {
+                v = (unsigned int)value;
+        }
+        do {
+                tmp[i++] = "0123456789abcdefghijklmnopqrstuvwxyz"[v % radix];
+                v /= radix;
+        } while (v);
+        while (i) {
+                *p++ = tmp[--i];
+        }
+        *p = '\0';
+        return(s);
+}
@@ -0,0 +1,49 @@
+/*********************************************
+ * vim:sw=8:ts=8:si:et
+ * Copyright: GPL V2
+ *
+ * Minimal Arduino core replacement for building the stack natively
+ * on a PC (see extras/host/README). Only what the library uses is
+ * provided. Time is taken from the host clock, delay() does not sleep
+ * but moves the clock forward so that init code runs instantly.
+ *********************************************/
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef uint8_t boolean;
+
+#ifndef __cplusplus
+#define true 1
+#define false 0
+#endif
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+#define _BV(bit) (1 << (bit))
+
+extern unsigned long millis(void);
+extern unsigned long micros(void);
+extern void delay(unsigned long ms);
+extern void delayMicroseconds(unsigned int us);
+extern void pinMode(uint8_t pin, uint8_t mode);
+extern void digitalWrite(uint8_t pin, uint8_t val);
+extern int analogRead(uint8_t pin);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ARDUINO_H */
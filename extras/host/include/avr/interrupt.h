@@ -0,0 +1,6 @@
+/* Host build replacement for <avr/interrupt.h>, see extras/host/README */
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+#define cli()
+#define sei()
+#endif
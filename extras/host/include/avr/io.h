@@ -0,0 +1,9 @@
+/* Host build replacement for <avr/io.h>, see extras/host/README */
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+#include <inttypes.h>
+
+// avr-libc has this in <stdlib.h>, glibc does not
+extern char *itoa(int value, char *s, int radix);
+
+#endif
@@ -0,0 +1,17 @@
+/* Host build replacement for <avr/pgmspace.h>, see extras/host/README */
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+#include <inttypes.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define strlen_P strlen
+#define memcpy_P memcpy
+
+typedef char prog_char;
+typedef uint8_t prog_uint8_t;
+
+#endif
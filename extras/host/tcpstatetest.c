@@ -0,0 +1,507 @@
+/*********************************************
+ * vim:sw=8:ts=8:si:et
+ * Copyright: GPL V2
+ *
+ * Test of the tcp state table (tcp_transitions in ip_arp_udp_tcp.c)
+ * on top of the software ENC28J60 (enc28j60emu.c). Segments from a
+ * peer are injected into the model and go through
+ * enc28j60PacketReceive and packetloop_icmp_tcp like in a sketch.
+ * For each step nextTcpState is asked before the segment is handled,
+ * currentTcpState after it, and the flags of the segments the stack
+ * sent are checked. Timers are run out with delay(), which advances
+ * millis() without waiting.
+ *
+ * The web server goes through the passive open, both ways of closing,
+ * simultaneous close, the resets, TIME_WAIT, giving up after the
+ * retransmissions, sending a multi segment reply again (the
+ * TCP_EV_RESEND rows) and sending the frame of www_server_reply again. The client goes through the active open, the
+ * close from either side and the reset of a connection that is still
+ * opening. A syn without ack while the client is in SYN_SENT
+ * (simultaneous open) is answered with a reset and not tested.
+ *
+ * usage: tcpstatetest, the exit code is the number of failed checks
+ *********************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Arduino.h"
+#include "ip_config.h"
+#include "enc28j60.h"
+#include "ip_arp_udp_tcp.h"
+#include "net.h"
+#include "enc28j60emu.h"
+
+#define BUFFER_SIZE 1500
+#define MYWWWPORT 80
+#define NOTHING 0xff
+
+static uint8_t buf[BUFFER_SIZE+1];
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x25};
+static uint8_t myip[4] = {192,168,1,25};
+static uint8_t mymask[4] = {255,255,255,0};
+static uint8_t peermac[6] = {0x00,0x1b,0x21,0x0a,0x0b,0x0c};
+static uint8_t peerip[4] = {192,168,1,10};
+
+static const char *stateNames[] = {
+        "CLOSED", "LISTEN", "SYN_SENT", "SYN_RECEIVED", "ESTABLISHED",
+        "FIN_WAIT_1", "FIN_WAIT_2", "CLOSE_WAIT", "CLOSING", "LAST_ACK",
+        "TIME_WAIT"
+};
+
+// the peer end of the connection under test
+static uint16_t peerPort;
+static uint16_t localPort;
+static uint32_t peerSeq;
+// end of the sequence space the stack has sent to the peer
+static uint32_t txSeqEnd;
+
+// tcp segments sent by the stack since the last check
+static uint8_t txSegments;
+static uint8_t txFlags;
+static uint16_t txDataLen;
+static uint16_t txSrcPort;
+static uint32_t txSeq;
+
+static int failures;
+static const char *scenario;
+
+static uint32_t getLong(const uint8_t *p)
+{
+        return(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static void putLong(uint8_t *p, uint32_t v)
+{
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+}
+
+static void watchTx(const uint8_t *frame, uint16_t len)
+{
+        uint32_t end;
+        (void)len;
+        if (frame[ETH_TYPE_H_P] != ETHTYPE_IP_H_V || frame[IP_PROTO_P] != IP_PROTO_TCP_V) {
+                return;
+        }
+        txSegments++;
+        txFlags = frame[TCP_FLAGS_P];
+        txSrcPort = (frame[TCP_SRC_PORT_H_P] << 8) | frame[TCP_SRC_PORT_L_P];
+        txSeq = getLong(frame + TCP_SEQ_H_P);
+        txDataLen = ((frame[IP_TOTLEN_H_P] << 8) | frame[IP_TOTLEN_L_P])
+                - IP_HEADER_LEN - (frame[TCP_HEADER_LEN_P] >> 4) * 4;
+        end = txSeq + txDataLen;
+        if (txFlags & (TCP_FLAGS_SYN_V|TCP_FLAGS_FIN_V)) {
+                end++;
+        }
+        if ((int32_t)(end - txSeqEnd) > 0 || (txFlags & TCP_FLAGS_SYN_V)) {
+                txSeqEnd = end;
+        }
+}
+
+static uint16_t ipChecksum(const uint8_t *p, uint16_t len, uint32_t sum)
+{
+        while (len > 1) {
+                sum += (p[0] << 8) | p[1];
+                p += 2;
+                len -= 2;
+        }
+        if (len) {
+                sum += p[0] << 8;
+        }
+        while (sum >> 16) {
+                sum = (sum & 0xffff) + (sum >> 16);
+        }
+        return((uint16_t)~sum);
+}
+
+static uint16_t arpRequest(uint8_t *f)
+{
+        static const uint8_t hdr[8] = {0,1,8,0,6,4,0,1};
+        memset(f + ETH_DST_MAC, 0xff, 6);
+        memcpy(f + ETH_SRC_MAC, peermac, 6);
+        f[ETH_TYPE_H_P] = ETHTYPE_ARP_H_V;
+        f[ETH_TYPE_L_P] = ETHTYPE_ARP_L_V;
+        memcpy(f + ETH_ARP_P, hdr, 8);
+        memcpy(f + ETH_ARP_SRC_MAC_P, peermac, 6);
+        memcpy(f + ETH_ARP_SRC_IP_P, peerip, 4);
+        memset(f + ETH_ARP_DST_MAC_P, 0, 6);
+        memcpy(f + ETH_ARP_DST_IP_P, myip, 4);
+        return(42);
+}
+
+// a segment from the peer with its sequence number and an ack of
+// everything the stack has sent, or of ack bytes less than that
+static uint16_t tcpSegment(uint8_t *f, uint8_t flags, uint32_t unacked, const char *data)
+{
+        uint16_t dlen = data ? strlen(data) : 0;
+        uint16_t len = IP_HEADER_LEN + TCP_HEADER_LEN_PLAIN + dlen;
+        uint16_t ck;
+        memcpy(f + ETH_DST_MAC, mymac, 6);
+        memcpy(f + ETH_SRC_MAC, peermac, 6);
+        f[ETH_TYPE_H_P] = ETHTYPE_IP_H_V;
+        f[ETH_TYPE_L_P] = ETHTYPE_IP_L_V;
+        memset(f + IP_P, 0, IP_HEADER_LEN + TCP_HEADER_LEN_PLAIN);
+        f[IP_P] = 0x45;
+        f[IP_TOTLEN_H_P] = len >> 8;
+        f[IP_TOTLEN_L_P] = len & 0xff;
+        f[IP_TTL_P] = 64;
+        f[IP_PROTO_P] = IP_PROTO_TCP_V;
+        memcpy(f + IP_SRC_P, peerip, 4);
+        memcpy(f + IP_DST_P, myip, 4);
+        ck = ipChecksum(f + IP_P, IP_HEADER_LEN, 0);
+        f[IP_CHECKSUM_H_P] = ck >> 8;
+        f[IP_CHECKSUM_L_P] = ck & 0xff;
+        f[TCP_SRC_PORT_H_P] = peerPort >> 8;
+        f[TCP_SRC_PORT_L_P] = peerPort & 0xff;
+        f[TCP_DST_PORT_H_P] = localPort >> 8;
+        f[TCP_DST_PORT_L_P] = localPort & 0xff;
+        putLong(f + TCP_SEQ_H_P, peerSeq);
+        if (flags & TCP_FLAGS_ACK_V) {
+                putLong(f + TCP_SEQACK_H_P, txSeqEnd - unacked);
+        }
+        f[TCP_HEADER_LEN_P] = 0x50;
+        f[TCP_FLAGS_P] = flags;
+        f[TCP_WIN_SIZE] = 0x16;
+        f[TCP_WIN_SIZE + 1] = 0xd0;
+        if (dlen) {
+                memcpy(f + TCP_DATA_P, data, dlen);
+        }
+        ck = ipChecksum(f + IP_SRC_P, 8 + TCP_HEADER_LEN_PLAIN + dlen, IP_PROTO_TCP_V + TCP_HEADER_LEN_PLAIN + dlen);
+        f[TCP_CHECKSUM_H_P] = ck >> 8;
+        f[TCP_CHECKSUM_L_P] = ck & 0xff;
+        peerSeq += dlen;
+        if (flags & (TCP_FLAGS_SYN_V|TCP_FLAGS_FIN_V)) {
+                peerSeq++;
+        }
+        return(ETH_HEADER_LEN + len);
+}
+
+static const char *stateName(uint8_t s)
+{
+        if (s < sizeof(stateNames) / sizeof(stateNames[0])) {
+                return(stateNames[s]);
+        }
+        return("?");
+}
+
+static void checkState(const char *what, uint8_t got, uint8_t want)
+{
+        if (got != want) {
+                printf("FAIL %s: %s is %s, expected %s\n", scenario, what, stateName(got), stateName(want));
+                failures++;
+        }
+}
+
+// the stack sent exactly one segment with these flags since the last
+// check, or nothing for NOTHING
+static void checkTx(const char *what, uint8_t flags)
+{
+        if (flags == NOTHING) {
+                if (txSegments) {
+                        printf("FAIL %s: %s sent flags %02x, expected nothing\n", scenario, what, txFlags);
+                        failures++;
+                }
+        } else if (txSegments != 1 || txFlags != flags) {
+                printf("FAIL %s: %s sent %u segments, last flags %02x, expected one with %02x\n",
+                       scenario, what, txSegments, txFlags, flags);
+                failures++;
+        }
+        txSegments = 0;
+}
+
+// pass a frame through the stack like a sketch does and check the
+// state before and after and what was sent back. Returns the position
+// of the tcp data for the application.
+static uint16_t step(const char *what, uint16_t len, uint8_t predicted, uint8_t state, uint8_t flags)
+{
+        uint16_t plen, dat_p;
+        txSegments = 0;
+        enc28j60EmuInject(buf, len);
+        plen = enc28j60PacketReceive(BUFFER_SIZE, buf);
+        checkState(what, nextTcpState(buf, plen), predicted);
+        dat_p = packetloop_icmp_tcp(buf, plen);
+        checkState(what, currentTcpState(), state);
+        checkTx(what, flags);
+        return(dat_p);
+}
+
+// main loop passes without traffic until the stack sends something
+// or max_ms are over
+static void idleUntilTx(unsigned long max_ms)
+{
+        unsigned long waited = 0;
+        txSegments = 0;
+        while (txSegments == 0 && waited < max_ms) {
+                delay(10);
+                waited += 10;
+                packetloop_icmp_tcp(buf, 0);
+        }
+}
+
+static uint16_t fillHello(uint8_t fd, uint8_t *b, uint16_t offset, uint16_t maxlen, uint8_t *last)
+{
+        (void)fd;
+        (void)offset;
+        (void)maxlen;
+        *last = 1;
+        return(fill_tcp_data_p(b, 0, PSTR("hello")));
+}
+
+// a new connection from the peer to the web server up to ESTABLISHED
+static void serverOpen(uint16_t port)
+{
+        peerPort = port;
+        localPort = MYWWWPORT;
+        peerSeq = 1000;
+        step("syn", tcpSegment(buf, TCP_FLAGS_SYN_V, 0, NULL), TCP_STATE_SYN_RECEIVED, TCP_STATE_SYN_RECEIVED, TCP_FLAGS_SYNACK_V);
+        step("ack of syn", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_ESTABLISHED, TCP_STATE_ESTABLISHED, NOTHING);
+}
+
+// send the request and answer it with www_server_reply_multi
+static void serverRequest(uint8_t fin, uint8_t predicted, uint8_t state)
+{
+        uint8_t flags = TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V;
+        if (fin) {
+                flags |= TCP_FLAGS_FIN_V;
+        }
+        if (step("request", tcpSegment(buf, flags, 0, "GET / HTTP/1.0\r\n\r\n"), predicted, predicted, NOTHING) == 0) {
+                printf("FAIL %s: the request did not reach the application\n", scenario);
+                failures++;
+                return;
+        }
+        www_server_reply_multi(buf, BUFFER_SIZE, fillHello);
+        checkState("reply", currentTcpState(), state);
+        checkTx("reply", TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
+}
+
+// our reply with its FIN is lost, it is sent again from SND.UNA
+static void serverResend(uint8_t state)
+{
+        idleUntilTx(5000);
+        checkState("retransmission", currentTcpState(), state);
+        checkTx("retransmission", TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
+        if (txDataLen != 5) {
+                printf("FAIL %s: retransmission carries %u bytes, expected 5\n", scenario, txDataLen);
+                failures++;
+        }
+}
+
+static void serverTests(void)
+{
+        uint32_t isn;
+
+        scenario = "listen";
+        checkState("after init", currentTcpState(), TCP_STATE_LISTEN);
+        tcpClose(buf, 0);
+        checkState("tcpClose", currentTcpState(), TCP_STATE_CLOSED);
+        peerPort = 0xc001;
+        localPort = MYWWWPORT;
+        peerSeq = 1000;
+        step("syn while closed", tcpSegment(buf, TCP_FLAGS_SYN_V, 0, NULL), TCP_STATE_CLOSED, TCP_STATE_CLOSED,
+             TCP_FLAGS_RST_V|TCP_FLAGS_ACK_V);
+        tcpPassiveOpen(buf, 0);
+        checkState("tcpPassiveOpen", currentTcpState(), TCP_STATE_LISTEN);
+        step("rst while listening", tcpSegment(buf, TCP_FLAGS_RST_V, 0, NULL), TCP_STATE_LISTEN, TCP_STATE_LISTEN, NOTHING);
+
+        scenario = "active close";
+        serverOpen(0xc002);
+        serverRequest(0, TCP_STATE_ESTABLISHED, TCP_STATE_FIN_WAIT_1);
+        step("ack of fin", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_FIN_WAIT_2, TCP_STATE_FIN_WAIT_2, NOTHING);
+        step("fin", tcpSegment(buf, TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, 0, NULL), TCP_STATE_TIME_WAIT, TCP_STATE_TIME_WAIT,
+             TCP_FLAGS_ACK_V);
+        step("fin again", tcpSegment(buf, TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, 0, NULL), TCP_STATE_TIME_WAIT, TCP_STATE_TIME_WAIT,
+             TCP_FLAGS_ACK_V);
+        // TIME_WAIT is over, the connection is gone and refused
+        delay(2100);
+        step("ack after time wait", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_LISTEN, TCP_STATE_LISTEN,
+             TCP_FLAGS_RST_V|TCP_FLAGS_ACK_V);
+
+        scenario = "passive close";
+        serverOpen(0xc003);
+        step("fin", tcpSegment(buf, TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, 0, NULL), TCP_STATE_CLOSE_WAIT, TCP_STATE_LAST_ACK,
+             TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V);
+        step("ack of fin", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_CLOSED, TCP_STATE_CLOSED, NOTHING);
+
+        scenario = "fin with the handshake ack";
+        peerPort = 0xc004;
+        peerSeq = 1000;
+        step("syn", tcpSegment(buf, TCP_FLAGS_SYN_V, 0, NULL), TCP_STATE_SYN_RECEIVED, TCP_STATE_SYN_RECEIVED, TCP_FLAGS_SYNACK_V);
+        step("ack,fin", tcpSegment(buf, TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, 0, NULL), TCP_STATE_CLOSE_WAIT, TCP_STATE_LAST_ACK,
+             TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V);
+        step("ack of fin", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_CLOSED, TCP_STATE_CLOSED, NOTHING);
+
+        scenario = "tcpClose";
+        serverOpen(0xc005);
+        tcpClose(buf, 0);
+        checkState("tcpClose", currentTcpState(), TCP_STATE_FIN_WAIT_1);
+        checkTx("tcpClose", TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V);
+        step("rst", tcpSegment(buf, TCP_FLAGS_RST_V, 0, NULL), TCP_STATE_CLOSED, TCP_STATE_CLOSED, NOTHING);
+
+        scenario = "tcpClose in SYN_RECEIVED";
+        peerPort = 0xc006;
+        peerSeq = 1000;
+        step("syn", tcpSegment(buf, TCP_FLAGS_SYN_V, 0, NULL), TCP_STATE_SYN_RECEIVED, TCP_STATE_SYN_RECEIVED, TCP_FLAGS_SYNACK_V);
+        tcpClose(buf, 0);
+        checkState("tcpClose", currentTcpState(), TCP_STATE_FIN_WAIT_1);
+        checkTx("tcpClose", TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V);
+        step("rst", tcpSegment(buf, TCP_FLAGS_RST_V, 0, NULL), TCP_STATE_CLOSED, TCP_STATE_CLOSED, NOTHING);
+
+        scenario = "simultaneous close";
+        serverOpen(0xc007);
+        tcpClose(buf, 0);
+        checkTx("tcpClose", TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V);
+        // the peer's FIN crosses ours and does not ack it
+        step("fin", tcpSegment(buf, TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, 1, NULL), TCP_STATE_CLOSING, TCP_STATE_CLOSING,
+             TCP_FLAGS_ACK_V);
+        step("ack of fin", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_TIME_WAIT, TCP_STATE_TIME_WAIT, NOTHING);
+
+        scenario = "resend in FIN_WAIT_1";
+        serverOpen(0xc008);
+        serverRequest(0, TCP_STATE_ESTABLISHED, TCP_STATE_FIN_WAIT_1);
+        serverResend(TCP_STATE_FIN_WAIT_1);
+        step("ack of fin", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_FIN_WAIT_2, TCP_STATE_FIN_WAIT_2, NOTHING);
+        step("rst", tcpSegment(buf, TCP_FLAGS_RST_V, 0, NULL), TCP_STATE_CLOSED, TCP_STATE_CLOSED, NOTHING);
+
+        scenario = "resend in LAST_ACK";
+        serverOpen(0xc009);
+        serverRequest(1, TCP_STATE_CLOSE_WAIT, TCP_STATE_LAST_ACK);
+        serverResend(TCP_STATE_LAST_ACK);
+        step("ack of fin", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_CLOSED, TCP_STATE_CLOSED, NOTHING);
+
+        scenario = "resend in CLOSING";
+        serverOpen(0xc00a);
+        serverRequest(0, TCP_STATE_ESTABLISHED, TCP_STATE_FIN_WAIT_1);
+        // the peer has none of the reply but closes too
+        step("fin", tcpSegment(buf, TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, 6, NULL), TCP_STATE_CLOSING, TCP_STATE_CLOSING,
+             TCP_FLAGS_ACK_V);
+        serverResend(TCP_STATE_LAST_ACK);
+        step("ack of fin", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_CLOSED, TCP_STATE_CLOSED, NOTHING);
+
+        scenario = "resend of www_server_reply";
+        serverOpen(0xc00c);
+        if (step("request", tcpSegment(buf, TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V, 0, "GET / HTTP/1.0\r\n\r\n"),
+                 TCP_STATE_ESTABLISHED, TCP_STATE_ESTABLISHED, NOTHING) == 0) {
+                printf("FAIL %s: the request did not reach the application\n", scenario);
+                failures++;
+        }
+        www_server_reply(buf, fill_tcp_data_p(buf, 0, PSTR("hello")));
+        // the request is acked in a segment of its own before the reply
+        txSegments--;
+        checkTx("reply", TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
+        isn = txSeq;
+        // the reply is lost, the same frame is sent again
+        serverResend(TCP_STATE_FIN_WAIT_1);
+        if (txSeq != isn) {
+                printf("FAIL %s: retransmission starts at %lu, expected %lu\n", scenario,
+                       (unsigned long)txSeq, (unsigned long)isn);
+                failures++;
+        }
+        serverResend(TCP_STATE_FIN_WAIT_1);
+        step("ack of fin", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_FIN_WAIT_2, TCP_STATE_FIN_WAIT_2, NOTHING);
+        step("fin", tcpSegment(buf, TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, 0, NULL), TCP_STATE_TIME_WAIT, TCP_STATE_TIME_WAIT,
+             TCP_FLAGS_ACK_V);
+        delay(2100);
+
+        scenario = "timeout";
+        serverOpen(0xc00b);
+        tcpClose(buf, 0);
+        checkTx("tcpClose", TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V);
+        isn = 0;
+        while (currentTcpState() == TCP_STATE_FIN_WAIT_1 && isn < 10) {
+                idleUntilTx(60000);
+                isn++;
+        }
+        checkState("after the retries", currentTcpState(), TCP_STATE_CLOSED);
+        if (txFlags != (TCP_FLAGS_RST_V|TCP_FLAGS_ACK_V) || isn != 6) {
+                printf("FAIL %s: %u segments, last flags %02x, expected 5 FINs and a reset\n", scenario, isn, txFlags);
+                failures++;
+        }
+}
+
+static uint16_t fillGet(uint8_t fd)
+{
+        (void)fd;
+        return(fill_tcp_data_p(buf, 0, PSTR("GET / HTTP/1.0\r\n\r\n")));
+}
+
+static uint8_t clientResult(uint8_t fd, uint8_t statuscode, uint16_t pos, uint16_t len)
+{
+        (void)fd;
+        (void)statuscode;
+        (void)pos;
+        (void)len;
+        return(0);
+}
+
+// open the client connection, the syn goes out at once
+static void clientOpen(void)
+{
+        txSegments = 0;
+        tcpActiveOpen(buf, 0, clientResult, fillGet, MYWWWPORT);
+        checkState("tcpActiveOpen", currentTcpState(), TCP_STATE_SYN_SENT);
+        checkTx("tcpActiveOpen", TCP_FLAGS_SYN_V);
+        peerPort = MYWWWPORT;
+        localPort = txSrcPort;
+        peerSeq = 5000;
+}
+
+static void clientTests(void)
+{
+        uint16_t len;
+
+        client_set_netmask(mymask);
+        client_tcp_set_serverip(peerip);
+        // look the peer up, it asks for our mac and so we learn its mac
+        client_waiting_arp(peerip);
+        len = arpRequest(buf);
+        enc28j60EmuInject(buf, len);
+        packetloop_icmp_tcp(buf, enc28j60PacketReceive(BUFFER_SIZE, buf));
+
+        scenario = "client passive close";
+        clientOpen();
+        step("syn,ack", tcpSegment(buf, TCP_FLAGS_SYNACK_V, 0, NULL), TCP_STATE_ESTABLISHED, TCP_STATE_ESTABLISHED,
+             TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V);
+        step("answer,fin", tcpSegment(buf, TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V, 0, "HTTP/1.0 200 OK\r\n\r\n"),
+             TCP_STATE_CLOSE_WAIT, TCP_STATE_LAST_ACK, TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V);
+        step("ack of fin", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_CLOSED, TCP_STATE_CLOSED, NOTHING);
+
+        scenario = "client active close";
+        clientOpen();
+        step("syn,ack", tcpSegment(buf, TCP_FLAGS_SYNACK_V, 0, NULL), TCP_STATE_ESTABLISHED, TCP_STATE_ESTABLISHED,
+             TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V);
+        tcpClose(buf, 0);
+        checkState("tcpClose", currentTcpState(), TCP_STATE_FIN_WAIT_1);
+        checkTx("tcpClose", TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V);
+        step("ack of fin", tcpSegment(buf, TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_FIN_WAIT_2, TCP_STATE_FIN_WAIT_2, NOTHING);
+        step("fin", tcpSegment(buf, TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, 0, NULL), TCP_STATE_TIME_WAIT, TCP_STATE_TIME_WAIT,
+             TCP_FLAGS_ACK_V);
+
+        scenario = "client tcpClose in SYN_SENT";
+        clientOpen();
+        tcpClose(buf, 0);
+        checkState("tcpClose", currentTcpState(), TCP_STATE_CLOSED);
+        checkTx("tcpClose", NOTHING);
+
+        scenario = "client reset in SYN_SENT";
+        clientOpen();
+        step("rst", tcpSegment(buf, TCP_FLAGS_RST_V|TCP_FLAGS_ACK_V, 0, NULL), TCP_STATE_CLOSED, TCP_STATE_CLOSED, NOTHING);
+}
+
+int main(void)
+{
+        enc28j60EmuReset();
+        enc28j60EmuSetTxHook(watchTx);
+        enc28j60SetTransport(&enc28j60EmuTransport);
+        enc28j60Init(mymac);
+        init_ip_arp_udp_tcp(mymac, myip, MYWWWPORT);
+        serverTests();
+        clientTests();
+        if (failures) {
+                printf("%d checks failed\n", failures);
+        } else {
+                printf("all tcp state checks passed\n");
+        }
+        return(failures);
+}
@@ -11,9 +11,10 @@
  * The TCP implementation uses some size optimisations which are valid
  * only if all data can be sent in one single packet. This is however
  * not a big limitation for a microcontroller as you will anyhow use
- * small web-pages. The web server must send the entire web page in one
- * packet. The client "web browser" as implemented here can also receive
- * large pages.
+ * small web-pages. The web server sends a page in one packet with
+ * www_server_reply, larger pages can be sent in several segments with
+ * www_server_reply_multi. The client "web browser" as implemented here
+ * can also receive large pages.
  *
  * Chip type           : ATMEGA88/168/328 with ENC28J60
  *********************************************/
@@ -24,6 +25,11 @@
 #include <stdlib.h>
 #include "net.h"
 #include "enc28j60.h"
+#if (ARDUINO >= 100)
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
 
 #undef ETHERSHIELD_DEBUG
 
@@ -50,7 +56,6 @@ static uint8_t wwwport_h=0;  // Note: never use same as TCPCLIENT_SRC_PORT_H
 // just lower byte, the upper byte is TCPCLIENT_SRC_PORT_H:
 static uint8_t tcpclient_src_port_l=1; 
 static uint8_t tcp_fd=0; // a file descriptor, will be encoded into the port
-static uint8_t tcp_client_state=0;
 // TCP client Destination port
 static uint8_t tcp_client_port_h=0;
 static uint8_t tcp_client_port_l=0;
@@ -61,6 +66,20 @@ static uint8_t tcp_client_port_l=0;
 static uint8_t (*client_tcp_result_callback)(uint8_t,uint8_t,uint16_t,uint16_t);
 // len_of_data_filled_in=your_client_tcp_datafill_callback(uint8_t fd){...your code}
 static uint16_t (*client_tcp_datafill_callback)(uint8_t);
+// the same for client_tcp_stream_req, see there
+static uint16_t (*client_tcp_stream_callback)(uint8_t,uint8_t,uint16_t,uint16_t,uint32_t,uint8_t);
+// sequence number of the first byte from the server
+static uint32_t tcp_client_rcv_start;
+// set by client_tcp_window, the new window is sent when we are idle
+static uint8_t tcp_client_wnd_update=0;
+#endif
+// window of the tcp client until the application says otherwise
+#ifndef TCP_CLIENT_WINDOW
+#define TCP_CLIENT_WINDOW 0x400
+#endif
+// returned by a stream callback to close the connection (as in ip_arp_udp_tcp.h)
+#ifndef TCP_CLIENT_CLOSE
+#define TCP_CLIENT_CLOSE 0xffff
 #endif
 #define TCPCLIENT_SRC_PORT_H 11
 #if defined (WWW_client)
@@ -92,9 +111,27 @@ static void (*icmp_callback)(uint8_t *ip);
 #define WGW_HAVE_GW_MAC 2
 #define WGW_REFRESHING 4
 #define WGW_ACCEPT_ARP_REPLY 8
-static int16_t delaycnt=1;
 static uint8_t gwip[4];
 static uint8_t gwmacaddr[6];
+static uint8_t netmask[4]; // 0.0.0.0 sends everything to the gateway
+// millis() when the gateway mac arrived and (low bits) when we last asked for it
+static uint32_t gw_arp_stamp;
+static uint16_t gw_arp_time;
+#if defined (NTP_client) || defined (UDP_client) || defined (TCP_client) || defined (PING_client)
+// the arp cache, see client_set_netmask
+#ifndef ARP_CACHE_SIZE
+#define ARP_CACHE_SIZE 4
+#endif
+#ifndef ARP_CACHE_TTL
+#define ARP_CACHE_TTL 300
+#endif
+// time between two requests for the same address and the number of
+// requests before we give up on it
+#define ARP_RETRY_MS 1000
+#define ARP_MAX_TRIES 4
+static uint8_t *arp_next_hop(uint8_t *ip);
+static void arp_fill_dst_mac(uint8_t *buf,uint8_t *ip);
+#endif
 static uint8_t tcpsrvip[4];
 static volatile uint8_t waitgwmac=WGW_INITIAL_ARP;
 
@@ -114,6 +151,76 @@ const char iphdr[] PROGMEM ={0x45,0,0,0x82,0,0,0x40,0,0x20}; // 0x82 is the tota
 const char ntpreqhdr[] PROGMEM ={0xe3,0,4,0xfa,0,1,0,1,0,0};
 #endif
 
+// Add the bytes at buf as 16bit big endian words to sum, an odd last
+// byte is padded with zero. This is where the time of all the
+// checksums goes. On the AVR it is a loop of add-with-carry over the
+// two bytes of a word into a 32bit sum, with gcc on other cpus (the
+// host build) it adds 32bit words and otherwise the loop is unrolled
+// over 8 bytes. The 32bit sum can not overflow for a packet.
+static uint32_t checksum_add(const uint8_t *buf, uint16_t len, uint32_t sum)
+{
+#if defined(__AVR__)
+        uint16_t n=len>>1;
+        uint8_t t;
+        if (n){
+                __asm__ __volatile__(
+                        "1:\n\t"
+                        "ld %3,%a1+\n\t"
+                        "ld __tmp_reg__,%a1+\n\t"
+                        "add %A0,__tmp_reg__\n\t"
+                        "adc %B0,%3\n\t"
+                        "adc %C0,__zero_reg__\n\t"
+                        "adc %D0,__zero_reg__\n\t"
+                        "sbiw %2,1\n\t"
+                        "brne 1b\n\t"
+                        : "+r" (sum), "+e" (buf), "+w" (n), "=&r" (t)
+                );
+        }
+#elif defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+        // 32bit words in the byte order of the cpu into a 64bit sum. The
+        // ones complement sum does not depend on the byte order (RFC 1071),
+        // folded to 16bit it only has its two bytes swapped.
+        uint64_t wsum=0;
+        uint32_t w;
+        while(len>3){
+                memcpy(&w,buf,4);
+                wsum+=w;
+                buf+=4;
+                len-=4;
+        }
+        while (wsum>>16){
+                wsum=(wsum & 0xFFFF)+(wsum>>16);
+        }
+        w=(uint32_t)wsum;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        w=((w & 0xff)<<8)|(w>>8);
+#endif
+        sum+=w;
+        if (len>1){
+                sum+=((uint16_t)buf[0]<<8)|buf[1];
+                buf+=2;
+        }
+#else
+        while(len>7){
+                sum+=((uint16_t)buf[0]<<8)|buf[1];
+                sum+=((uint16_t)buf[2]<<8)|buf[3];
+                sum+=((uint16_t)buf[4]<<8)|buf[5];
+                sum+=((uint16_t)buf[6]<<8)|buf[7];
+                buf+=8;
+                len-=8;
+        }
+        while(len>1){
+                sum+=((uint16_t)buf[0]<<8)|buf[1];
+                buf+=2;
+                len-=2;
+        }
+#endif
+        if (len&1){
+                sum+=(uint16_t)*buf<<8;
+        }
+        return(sum);
+}
+
 // The Ip checksum is calculated over the ip header only starting
 // with the header length field and a total length of 20 bytes
 // unitl ip.dst
@@ -160,15 +267,7 @@ uint16_t checksum(uint8_t *buf, uint16_t len,uint8_t type){
                 sum+=len-8; // = real tcp len
         }
         // build the sum of 16bit words
-        while(len >1){
-                sum += 0xFFFF & (((uint32_t)*buf<<8)|*(buf+1));
-                buf+=2;
-                len-=2;
-        }
-        // if there is a byte left then add it (padded with zero)
-        if (len){
-                sum += ((uint32_t)(0xFF & *buf))<<8;
-        }
+        sum=checksum_add(buf,len,sum);
         // now calculate the sum over the bytes in the sum
         // until the result is only 16bit long
         while (sum>>16){
@@ -178,6 +277,393 @@ uint16_t checksum(uint8_t *buf, uint16_t len,uint8_t type){
         return( (uint16_t) sum ^ 0xFFFF);
 }
 
+// fold the carries of a ones complement sum back into 16 bits
+static uint16_t checksum_fold(uint32_t sum)
+{
+        while (sum>>16){
+                sum = (sum & 0xFFFF)+(sum >> 16);
+        }
+        return((uint16_t)sum);
+}
+
+// Incremental update of a checksum as in RFC 1624: ck is the checksum
+// as it is stored in the packet and the 16bit word oldval in the
+// summed data was replaced by newval. Returns the new checksum,
+// HC' = ~(~HC + ~m + m'). Swapping the source and destination address
+// or port of a packet does not change the sum and needs no update.
+uint16_t checksum_update(uint16_t ck,uint16_t oldval,uint16_t newval)
+{
+        uint32_t sum;
+        sum=(uint16_t)~ck;
+        sum+=(uint16_t)~oldval;
+        sum+=newval;
+        while (sum>>16){
+                sum = (sum & 0xFFFF)+(sum >> 16);
+        }
+        return( (uint16_t) sum ^ 0xFFFF);
+}
+
+// the same for the checksum field at buf[ckpos]
+void checksum_update_at(uint8_t *buf,uint16_t ckpos,uint16_t oldval,uint16_t newval)
+{
+        uint16_t ck;
+        ck=checksum_update(((uint16_t)buf[ckpos]<<8)|buf[ckpos+1],oldval,newval);
+        buf[ckpos]=ck>>8;
+        buf[ckpos+1]=ck& 0xff;
+}
+
+// The web server keeps a record for each tcp connection so that it
+// can tell new data from retransmissions, acknowledge exactly what
+// it got and close connections properly even if several browsers
+// talk to it at the same time.
+#ifndef TCP_SERVER_CONNECTIONS
+#define TCP_SERVER_CONNECTIONS 4
+#endif
+// how long a closed connection is kept to answer a retransmitted FIN (ms)
+#define TCP_TIME_WAIT_MS 2000
+// Unacknowledged syn, data and fin segments are sent again after the
+// retransmission timeout (RFC 6298). It starts at TCP_RTO_INITIAL ms,
+// follows the measured round trip time and doubles with every retry.
+// After TCP_MAX_RETRIES retries the connection is given up.
+#ifndef TCP_MAX_RETRIES
+#define TCP_MAX_RETRIES 5
+#endif
+#define TCP_RTO_INITIAL 1000
+#define TCP_RTO_MIN 200
+#define TCP_RTO_MAX 30000
+// larger round trip samples are cut to this, it keeps srtt<<3 in 16 bits
+#define TCP_RTT_MAX 8000
+
+typedef struct tcpConnection {
+        uint8_t state;          // TCP_STATE_xxx, see net.h
+        uint8_t ip[4];          // remote ip
+        uint8_t port[2];        // remote port, high byte first
+        uint8_t lport[2];       // local port, high byte first
+        uint8_t mac[6];         // mac the segments to the peer go to
+        uint32_t snd_una;       // oldest sequence number not yet acked by the peer
+        uint32_t snd_nxt;       // sequence number of the next byte we send
+        uint32_t rcv_nxt;       // sequence number of the next byte we expect
+        uint32_t lastActivity;  // millis() when we last heard from the peer
+        uint32_t page_seq;      // sequence number of the first byte of the reply
+        uint16_t snd_wnd;       // window the peer advertised last
+        uint16_t rcv_wnd;       // window we advertise
+        uint16_t mss;           // largest segment we send to the peer
+        uint16_t rtx_start;     // low bits of millis() when the retransmission timer started
+        uint16_t rtt_start;     // low bits of millis() when rtt_seq was sent
+        uint32_t rtt_seq;       // an ack for this gives a round trip time sample
+        uint16_t srtt;          // smoothed round trip time in ms <<3
+        uint16_t rttvar;        // round trip time variation in ms <<2
+        uint16_t rto;           // retransmission timeout in ms
+        uint8_t retries;        // retransmissions since the last new ack
+        uint8_t timing;         // 1 while rtt_seq is being timed
+        uint8_t txheld;         // enc28j60TxHold handle of the reply frame, 0 if none
+        // generator of a reply sent with www_server_reply_multi, 0 if none
+        uint16_t (*datafill)(uint8_t fd,uint8_t *buf,uint16_t offset,uint16_t maxlen,uint8_t *last);
+} tcpConnection;
+
+static tcpConnection tcp_conn[TCP_SERVER_CONNECTIONS];
+#if defined (TCP_client)
+// the one connection of the tcp client
+static tcpConnection tcp_client_conn;
+#endif
+// connection of the request packetloop_icmp_tcp has just handed to the
+// web server application. The reply sent for it advances its SND.NXT.
+static tcpConnection *tcp_conn_cur=0;
+// connection of the last tcp segment we got or the client connection
+// after it was opened, see currentTcpState
+static tcpConnection *tcp_conn_last=0;
+// TCP_STATE_LISTEN while the web server accepts connections
+static uint8_t tcp_listen_state=TCP_STATE_LISTEN;
+
+// sequence number comparison modulo 2^32
+#define SEQ_LT(a,b) ((int32_t)((a)-(b))<0)
+#define SEQ_LEQ(a,b) ((int32_t)((a)-(b))<=0)
+
+// The RFC 793 state machine of the client and the server connections.
+// Every change of state goes through this table: an event in a state
+// leads to the next state. Events that are not listed for a state do
+// not change it.
+#define TCP_EV_PASSIVE_OPEN 0   // the application listens
+#define TCP_EV_ACTIVE_OPEN 1    // the application connects
+#define TCP_EV_CLOSE 2          // the application closes, we send a FIN
+#define TCP_EV_SYN 3            // received a syn
+#define TCP_EV_SYN_ACK 4        // received a syn,ack for our syn
+#define TCP_EV_ACK 5            // received an ack for all we sent (syn or fin)
+#define TCP_EV_FIN 6            // received a fin
+#define TCP_EV_RST 7            // received a reset
+#define TCP_EV_TIMEOUT 8        // TIME_WAIT is over or the peer is gone
+#define TCP_EV_RESEND 9         // we go back to send our fin again with data before it
+#define TCP_STATE_ANY 0xff
+static const uint8_t tcp_transitions[] PROGMEM = {
+        // state                event                   next state
+        TCP_STATE_CLOSED,       TCP_EV_PASSIVE_OPEN,    TCP_STATE_LISTEN,
+        TCP_STATE_CLOSED,       TCP_EV_ACTIVE_OPEN,     TCP_STATE_SYN_SENT,
+        TCP_STATE_LISTEN,       TCP_EV_ACTIVE_OPEN,     TCP_STATE_SYN_SENT,
+        TCP_STATE_LISTEN,       TCP_EV_SYN,             TCP_STATE_SYN_RECEIVED,
+        TCP_STATE_LISTEN,       TCP_EV_CLOSE,           TCP_STATE_CLOSED,
+        TCP_STATE_LISTEN,       TCP_EV_RST,             TCP_STATE_LISTEN,
+        TCP_STATE_SYN_SENT,     TCP_EV_SYN,             TCP_STATE_SYN_RECEIVED,
+        TCP_STATE_SYN_SENT,     TCP_EV_SYN_ACK,         TCP_STATE_ESTABLISHED,
+        TCP_STATE_SYN_SENT,     TCP_EV_CLOSE,           TCP_STATE_CLOSED,
+        TCP_STATE_SYN_RECEIVED, TCP_EV_ACK,             TCP_STATE_ESTABLISHED,
+        TCP_STATE_SYN_RECEIVED, TCP_EV_CLOSE,           TCP_STATE_FIN_WAIT_1,
+        TCP_STATE_SYN_RECEIVED, TCP_EV_FIN,             TCP_STATE_CLOSE_WAIT,
+        TCP_STATE_ESTABLISHED,  TCP_EV_CLOSE,           TCP_STATE_FIN_WAIT_1,
+        TCP_STATE_ESTABLISHED,  TCP_EV_FIN,             TCP_STATE_CLOSE_WAIT,
+        TCP_STATE_FIN_WAIT_1,   TCP_EV_ACK,             TCP_STATE_FIN_WAIT_2,
+        TCP_STATE_FIN_WAIT_1,   TCP_EV_FIN,             TCP_STATE_CLOSING,
+        TCP_STATE_FIN_WAIT_1,   TCP_EV_RESEND,          TCP_STATE_ESTABLISHED,
+        TCP_STATE_FIN_WAIT_2,   TCP_EV_FIN,             TCP_STATE_TIME_WAIT,
+        TCP_STATE_CLOSE_WAIT,   TCP_EV_CLOSE,           TCP_STATE_LAST_ACK,
+        TCP_STATE_CLOSING,      TCP_EV_ACK,             TCP_STATE_TIME_WAIT,
+        TCP_STATE_CLOSING,      TCP_EV_RESEND,          TCP_STATE_CLOSE_WAIT,
+        TCP_STATE_LAST_ACK,     TCP_EV_ACK,             TCP_STATE_CLOSED,
+        TCP_STATE_LAST_ACK,     TCP_EV_RESEND,          TCP_STATE_CLOSE_WAIT,
+        TCP_STATE_ANY,          TCP_EV_RST,             TCP_STATE_CLOSED,
+        TCP_STATE_ANY,          TCP_EV_TIMEOUT,         TCP_STATE_CLOSED,
+};
+
+// the state that event ev leads to from state
+static uint8_t tcp_state_next(uint8_t state,uint8_t ev)
+{
+        uint8_t i=0;
+        uint8_t s;
+        while(i<sizeof(tcp_transitions)){
+                s=pgm_read_byte(&tcp_transitions[i]);
+                if ((s==state || s==TCP_STATE_ANY) && pgm_read_byte(&tcp_transitions[i+1])==ev){
+                        return(pgm_read_byte(&tcp_transitions[i+2]));
+                }
+                i+=3;
+        }
+        return(state);
+}
+
+// the reply frame of connection c will not be sent again
+static void tcp_conn_release(tcpConnection *c)
+{
+        if (c->txheld){
+                enc28j60TxRelease(c->txheld);
+                c->txheld=0;
+        }
+}
+
+static void tcp_conn_event(tcpConnection *c,uint8_t ev)
+{
+        c->state=tcp_state_next(c->state,ev);
+        if (c->state==TCP_STATE_CLOSED || c->state==TCP_STATE_TIME_WAIT){
+                tcp_conn_release(c);
+        }
+}
+
+static uint32_t get_seq(uint8_t *p)
+{
+        return(((uint32_t)p[0]<<24)|((uint32_t)p[1]<<16)|((uint32_t)p[2]<<8)|p[3]);
+}
+
+static void put_seq(uint8_t *p,uint32_t seq)
+{
+        p[0]=(seq>>24)&0xff;
+        p[1]=(seq>>16)&0xff;
+        p[2]=(seq>>8)&0xff;
+        p[3]=seq&0xff;
+}
+
+// window advertised in the tcp segment in buf
+static uint16_t get_window(uint8_t *buf)
+{
+        return(((uint16_t)buf[TCP_WIN_SIZE]<<8)|buf[TCP_WIN_SIZE+1]);
+}
+
+// the mss option of a syn or 536 (RFC 1122) if it has none
+static uint16_t tcp_get_mss(uint8_t *buf)
+{
+        uint16_t i=TCP_OPTIONS_P;
+        uint16_t end=TCP_SRC_PORT_H_P+(buf[TCP_HEADER_LEN_P]>>4)*4;
+        while(i<end){
+                if (buf[i]==0){
+                        break;
+                }
+                if (buf[i]==1){
+                        // nop
+                        i++;
+                        continue;
+                }
+                if (i+1>=end || buf[i+1]<2){
+                        break;
+                }
+                if (buf[i]==2 && buf[i+1]==4 && i+3<end){
+                        return(((uint16_t)buf[i+2]<<8)|buf[i+3]);
+                }
+                i+=buf[i+1];
+        }
+        return(536);
+}
+
+// The eth and ip header and the ports of the segments to a peer stay
+// the same for the whole connection. tcp_conn_head makes them once into
+// tcp_tmpl together with the sums over the fixed words of the ip
+// header and of the tcp pseudo header, the following segments to the
+// same peer start with a copy of it.
+static uint8_t tcp_tmpl[TCP_SEQ_H_P];
+static tcpConnection *tcp_tmpl_conn=0;
+static uint16_t tcp_tmpl_ipsum;
+static uint16_t tcp_tmpl_tcpsum;
+
+// the addresses or ports of c change, make its template again
+static void tcp_tmpl_drop(tcpConnection *c)
+{
+        if (tcp_tmpl_conn==c){
+                tcp_tmpl_conn=0;
+        }
+}
+
+// a new connection: no round trip time known yet
+static void tcp_conn_init(tcpConnection *c,uint32_t isn)
+{
+        tcp_tmpl_drop(c);
+        tcp_conn_release(c);
+        c->snd_una=isn;
+        c->snd_nxt=isn;
+        c->rto=TCP_RTO_INITIAL;
+        c->srtt=0;
+        c->rttvar=0;
+        c->retries=0;
+        c->timing=0;
+}
+
+// n more sequence numbers have been sent on connection c
+static void tcp_conn_advance(tcpConnection *c,uint16_t n)
+{
+        if (n==0){
+                return;
+        }
+        if (c->snd_una==c->snd_nxt){
+                // nothing was outstanding, start the retransmission timer
+                c->rtx_start=millis();
+        }
+        c->snd_nxt+=n;
+        // Karn: time only segments that were not sent again
+        if (!c->timing && c->retries==0){
+                c->rtt_seq=c->snd_nxt;
+                c->rtt_start=millis();
+                c->timing=1;
+        }
+}
+
+// Jacobson/Karels estimator in the scaled integer form of BSD
+static void tcp_rtt_sample(tcpConnection *c,uint16_t rtt)
+{
+        int16_t delta;
+        if (rtt>TCP_RTT_MAX){
+                rtt=TCP_RTT_MAX;
+        }
+        if (c->srtt==0){
+                // first sample: srtt=rtt, rttvar=rtt/2, the 1 keeps srtt
+                // non zero (no sample yet) even for a 0ms round trip
+                c->srtt=(rtt<<3)|1;
+                c->rttvar=rtt<<1;
+        }else{
+                delta=rtt-(c->srtt>>3);
+                c->srtt+=delta;
+                if (delta<0){
+                        delta=-delta;
+                }
+                delta-=c->rttvar>>2;
+                c->rttvar+=delta;
+        }
+        c->rto=(c->srtt>>3)+c->rttvar;
+        if (c->rto<TCP_RTO_MIN){
+                c->rto=TCP_RTO_MIN;
+        }
+}
+
+// the peer acknowledged everything before ack
+static void tcp_conn_acked(tcpConnection *c,uint32_t ack)
+{
+        if (!SEQ_LT(c->snd_una,ack) || !SEQ_LEQ(ack,c->snd_nxt)){
+                return;
+        }
+        c->snd_una=ack;
+        if (c->timing && SEQ_LEQ(c->rtt_seq,ack)){
+                if (c->retries==0){
+                        tcp_rtt_sample(c,(uint16_t)millis()-c->rtt_start);
+                }
+                c->timing=0;
+        }
+        c->retries=0;
+        // restart the timer for what is still outstanding
+        c->rtx_start=millis();
+        if (c->snd_nxt-c->snd_una<=1){
+                // the data of the reply has arrived, a lost FIN is
+                // sent again on its own
+                tcp_conn_release(c);
+        }
+}
+
+// account for dlen bytes of data just sent on the current connection
+static void tcp_conn_sent(uint8_t *buf,uint16_t dlen)
+{
+        if (tcp_conn_cur==0){
+                return;
+        }
+        if (buf[TCP_FLAGS_P] & TCP_FLAGS_FIN_V){
+                // a FIN takes one sequence number
+                tcp_conn_advance(tcp_conn_cur,dlen+1);
+                tcp_conn_event(tcp_conn_cur,TCP_EV_CLOSE);
+                if (dlen && tcp_conn_cur->datafill==0){
+                        // the whole reply of www_server_reply is in this
+                        // frame and can not be made again, keep it
+                        tcp_conn_release(tcp_conn_cur);
+                        tcp_conn_cur->txheld=enc28j60TxHold();
+                }
+                tcp_conn_cur=0;
+                return;
+        }
+        tcp_conn_advance(tcp_conn_cur,dlen);
+}
+
+#ifdef ENC28J60_DMA_CHECKSUM
+// Below this checksum length setting up the DMA over SPI costs more
+// than adding up the bytes in software.
+#define DMA_CHECKSUM_MIN 64
+#endif
+
+// Send a udp or tcp packet of len bytes and fill in its checksum.
+// cklen and type are the values checksum() would get for a sum that
+// starts at buf[IP_SRC_P], ckpos is the position of the checksum field.
+// The checksum field must be zero.
+//
+// With ENC28J60_DMA_CHECKSUM the packet is first copied into the
+// transmit buffer of the chip and its DMA engine adds up the bytes
+// there. Only the pseudo header part (protocol and length) is added
+// here and the result is patched into the copy in chip memory.
+static void send_with_checksum(uint8_t *buf,uint16_t len,uint16_t cklen,uint8_t type,uint8_t ckpos)
+{
+        uint16_t ck;
+#ifdef ENC28J60_DMA_CHECKSUM
+        uint32_t sum;
+        if (cklen>=DMA_CHECKSUM_MIN){
+                enc28j60PacketPrepare(len,buf);
+                sum=0xFFFF & ~enc28j60TxChecksum(IP_SRC_P,cklen);
+                sum+=(type==1)?IP_PROTO_UDP_V:IP_PROTO_TCP_V;
+                sum+=cklen-8;
+                while (sum>>16){
+                        sum = (sum & 0xFFFF)+(sum >> 16);
+                }
+                ck=(uint16_t)sum ^ 0xFFFF;
+                buf[ckpos]=ck>>8;
+                buf[ckpos+1]=ck& 0xff;
+                enc28j60TxWrite(ckpos,2,&buf[ckpos]);
+                enc28j60PacketTransmit();
+                return;
+        }
+#endif
+        ck=checksum(&buf[IP_SRC_P], cklen,type);
+        buf[ckpos]=ck>>8;
+        buf[ckpos+1]=ck& 0xff;
+        enc28j60PacketSend(len,buf);
+}
+
 // This initializes the web server
 // you must call this function once before you use any of the other functions:
 void init_ip_arp_udp_tcp(uint8_t *mymac,uint8_t *myip,uint16_t port){
@@ -193,6 +679,16 @@ void init_ip_arp_udp_tcp(uint8_t *mymac,uint8_t *myip,uint16_t port){
                 macaddr[i]=mymac[i];
                 i++;
         }
+        i=0;
+        while(i<TCP_SERVER_CONNECTIONS){
+                tcp_conn_release(&tcp_conn[i]);
+                tcp_conn[i].state=TCP_STATE_CLOSED;
+                i++;
+        }
+        tcp_tmpl_conn=0;
+        tcp_conn_cur=0;
+        tcp_conn_last=0;
+        tcp_listen_state=TCP_STATE_LISTEN;
 }
 
 uint8_t check_ip_message_is_from(uint8_t *buf,uint8_t *ip)
@@ -249,17 +745,301 @@ uint8_t eth_type_is_ip_and_my_ip(uint8_t *buf,uint16_t len){
         return(1);
 }
 
-// make a return eth header from a received eth packet
-void make_eth(uint8_t *buf)
+// Let the pattern match filter of the chip admit only broadcasts with
+// udp to port (with a 20 byte ip header), e.g. the dhcp answers to
+// port 68 while starting up. All other broadcasts, arp requests
+// included, are dropped by the chip. port=0 admits the arp broadcasts
+// again, which is the setting after enc28j60Init. Unicast to our mac
+// is not affected.
+void packet_filter_udp_port(uint16_t port)
+{
+        uint8_t mask[8];
+        uint8_t pattern[UDP_DST_PORT_L_P+1];
+        memset(mask,0,8);
+        memset(pattern,0xff,6);
+        // destination mac and ethernet type
+        mask[0]=0x3f;
+        mask[1]=0x30;
+        pattern[ETH_TYPE_H_P]=ETHTYPE_ARP_H_V;
+        pattern[ETH_TYPE_L_P]=ETHTYPE_ARP_L_V;
+        if (port){
+                pattern[ETH_TYPE_H_P]=ETHTYPE_IP_H_V;
+                pattern[ETH_TYPE_L_P]=ETHTYPE_IP_L_V;
+                pattern[IP_PROTO_P]=IP_PROTO_UDP_V;
+                pattern[UDP_DST_PORT_H_P]=port>>8;
+                pattern[UDP_DST_PORT_L_P]=port&0xff;
+                mask[IP_PROTO_P>>3]|=1<<(IP_PROTO_P&7);
+                mask[UDP_DST_PORT_H_P>>3]|=1<<(UDP_DST_PORT_H_P&7);
+                mask[UDP_DST_PORT_L_P>>3]|=1<<(UDP_DST_PORT_L_P&7);
+        }
+        enc28j60DisableBroadcast();
+        enc28j60SetPattern(0,mask,pattern);
+}
+
+#ifdef MULTICAST_GROUPS
+// ipv4 multicast groups joined with multicast_join and how often
+static uint8_t mcast_ip[MULTICAST_GROUPS][4];
+static uint8_t mcast_ref[MULTICAST_GROUPS];
+
+static uint8_t multicast_find(uint8_t *groupip)
 {
         uint8_t i=0;
-        //
-        //copy the destination mac from the source and fill my mac into src
-        while(i<6){
-                buf[ETH_DST_MAC +i]=buf[ETH_SRC_MAC +i];
-                buf[ETH_SRC_MAC +i]=macaddr[i];
+        while(i<MULTICAST_GROUPS){
+                if (mcast_ref[i] && memcmp(mcast_ip[i],groupip,4)==0){
+                        break;
+                }
+                i++;
+        }
+        return(i);
+}
+
+// set the buckets of the joined groups in the hash table filter of
+// the chip. A group maps to the mac address 01:00:5e plus the low
+// 23 bits of the ip address.
+static void multicast_filter(void)
+{
+        uint8_t eht[8];
+        uint8_t mac[6];
+        uint8_t i=0;
+        uint8_t h;
+        memset(eht,0,8);
+        mac[0]=0x01;
+        mac[1]=0x00;
+        mac[2]=0x5e;
+        while(i<MULTICAST_GROUPS){
+                if (mcast_ref[i]){
+                        mac[3]=mcast_ip[i][1]&0x7f;
+                        mac[4]=mcast_ip[i][2];
+                        mac[5]=mcast_ip[i][3];
+                        h=enc28j60Hash(mac);
+                        eht[h>>3]|=1<<(h&7);
+                }
+                i++;
+        }
+        enc28j60SetHashTable(eht);
+}
+
+// Receive udp packets to the multicast group groupip (224.0.0.0 to
+// 239.255.255.255). The chip passes only the frames of joined groups,
+// mDNS, SSDP and the like from other groups are dropped before they
+// reach the SPI bus. Groups are counted, every multicast_join needs a
+// multicast_leave. No IGMP report is sent.
+// Returns 0 if groupip is no multicast address or if already
+// MULTICAST_GROUPS different groups are joined.
+uint8_t multicast_join(uint8_t *groupip)
+{
+        uint8_t i;
+        if ((groupip[0]&0xf0)!=0xe0){
+                return(0);
+        }
+        i=multicast_find(groupip);
+        if (i<MULTICAST_GROUPS){
+                if (mcast_ref[i]<0xff){
+                        mcast_ref[i]++;
+                }
+                return(1);
+        }
+        i=0;
+        while(i<MULTICAST_GROUPS){
+                if (mcast_ref[i]==0){
+                        memcpy(mcast_ip[i],groupip,4);
+                        mcast_ref[i]=1;
+                        multicast_filter();
+                        return(1);
+                }
+                i++;
+        }
+        return(0);
+}
+
+// undo one multicast_join, returns 0 if the group was not joined
+uint8_t multicast_leave(uint8_t *groupip)
+{
+        uint8_t i=multicast_find(groupip);
+        if (i>=MULTICAST_GROUPS){
+                return(0);
+        }
+        mcast_ref[i]--;
+        if (mcast_ref[i]==0){
+                multicast_filter();
+        }
+        return(1);
+}
+
+// is it an udp packet to one of the joined multicast groups?
+// Other groups can share a bucket of the hash filter, so the
+// address is checked here.
+uint8_t eth_type_is_ip_and_my_group(uint8_t *buf,uint16_t len)
+{
+        if (len<UDP_DATA_P){
+                return(0);
+        }
+        if(buf[ETH_TYPE_H_P]!=ETHTYPE_IP_H_V || 
+           buf[ETH_TYPE_L_P]!=ETHTYPE_IP_L_V){
+                return(0);
+        }
+        if (buf[IP_HEADER_LEN_VER_P]!=0x45 || buf[IP_PROTO_P]!=IP_PROTO_UDP_V){
+                return(0);
+        }
+        if ((buf[IP_DST_P]&0xf0)!=0xe0){
+                return(0);
+        }
+        return(multicast_find(&buf[IP_DST_P])<MULTICAST_GROUPS);
+}
+#endif // MULTICAST_GROUPS
+
+#ifdef UDP_SOCKETS
+// Table of the udp ports the application receives on. packetloop_icmp_tcp
+// hands every udp datagram to our ip (or to a joined multicast group)
+// to the socket bound to its destination port.
+typedef struct udpSocket {
+        uint16_t port;          // local port, 0 if the socket is free
+        uint8_t rip[4];         // accept only this remote ip, 0.0.0.0 for any
+        uint16_t rport;         // accept only this remote port, 0 for any
+        void (*callback)(uint8_t fd,uint8_t *buf,uint16_t datapos,uint16_t len);
+        uint16_t received;      // datagrams handed to the callback
+        uint16_t dropped;       // datagrams to port from others or truncated
+} udpSocket;
+
+static udpSocket udp_sock[UDP_SOCKETS];
+
+// Receive the udp datagrams to the local port with callback. rip (if
+// not 0) and rport (if not 0) accept only datagrams from that host
+// and port, e.g. the answers of one server. The callback gets the
+// socket number, the packet, the position of the data in it (UDP_DATA_P)
+// and the length of the data. It may use buf to answer, e.g. with
+// make_udp_reply_from_request. The ip and port of the sender are at
+// buf[IP_SRC_P] and buf[UDP_SRC_PORT_H_P].
+// Returns the socket number or UDP_SOCKETS if port is 0, already bound
+// or all sockets are in use.
+uint8_t udp_bind(uint16_t port,uint8_t *rip,uint16_t rport,void (*callback)(uint8_t fd,uint8_t *buf,uint16_t datapos,uint16_t len))
+{
+        uint8_t i=0;
+        uint8_t fd=UDP_SOCKETS;
+        if (port==0 || callback==0){
+                return(UDP_SOCKETS);
+        }
+        while(i<UDP_SOCKETS){
+                if (udp_sock[i].port==port){
+                        return(UDP_SOCKETS);
+                }
+                if (udp_sock[i].port==0 && fd==UDP_SOCKETS){
+                        fd=i;
+                }
+                i++;
+        }
+        if (fd<UDP_SOCKETS){
+                udp_sock[fd].port=port;
+                if (rip){
+                        memcpy(udp_sock[fd].rip,rip,4);
+                }else{
+                        memset(udp_sock[fd].rip,0,4);
+                }
+                udp_sock[fd].rport=rport;
+                udp_sock[fd].callback=callback;
+                udp_sock[fd].received=0;
+                udp_sock[fd].dropped=0;
+        }
+        return(fd);
+}
+
+void udp_unbind(uint8_t fd)
+{
+        if (fd<UDP_SOCKETS){
+                udp_sock[fd].port=0;
+        }
+}
+
+// number of datagrams socket fd got, and of the ones it did not take
+uint16_t udp_received(uint8_t fd)
+{
+        if (fd>=UDP_SOCKETS){
+                return(0);
+        }
+        return(udp_sock[fd].received);
+}
+
+uint16_t udp_dropped(uint8_t fd)
+{
+        if (fd>=UDP_SOCKETS){
+                return(0);
+        }
+        return(udp_sock[fd].dropped);
+}
+
+// hand the udp datagram in buf to its socket. Returns 0 if no socket is
+// bound to its port.
+static uint8_t udp_socket_input(uint8_t *buf,uint16_t plen)
+{
+        udpSocket *u;
+        uint16_t port;
+        uint16_t len;
+        uint8_t i=0;
+        if (plen<UDP_DATA_P){
+                return(0);
+        }
+        port=((uint16_t)buf[UDP_DST_PORT_H_P]<<8)|buf[UDP_DST_PORT_L_P];
+        while(i<UDP_SOCKETS){
+                u=&udp_sock[i];
+                if (u->port==port){
+                        break;
+                }
                 i++;
         }
+        if (i==UDP_SOCKETS){
+                return(0);
+        }
+        len=((uint16_t)buf[UDP_LEN_H_P]<<8)|buf[UDP_LEN_L_P];
+        if (len<UDP_HEADER_LEN || len>plen-UDP_SRC_PORT_H_P){
+                // did not fit into buf
+                u->dropped++;
+                return(1);
+        }
+        if ((u->rport && u->rport!=(((uint16_t)buf[UDP_SRC_PORT_H_P]<<8)|buf[UDP_SRC_PORT_L_P]))
+            || ((u->rip[0]|u->rip[1]|u->rip[2]|u->rip[3]) && memcmp(u->rip,&buf[IP_SRC_P],4)!=0)){
+                u->dropped++;
+                return(1);
+        }
+        u->received++;
+        (*u->callback)(i,buf,UDP_DATA_P,len-UDP_HEADER_LEN);
+        return(1);
+}
+#endif // UDP_SOCKETS
+
+// The single place where received udp datagrams to our ip go: to a
+// socket bound with udp_bind, to the application for ntp and dns
+// answers (packetloop_icmp_tcp returns UDP_DATA_P for them) or nowhere.
+static uint16_t udp_dispatch(uint8_t *buf,uint16_t plen)
+{
+#ifdef UDP_SOCKETS
+        if (udp_socket_input(buf,plen)){
+                return(0);
+        }
+#endif
+        if (buf[UDP_SRC_PORT_H_P]!=0){
+                return(0);
+        }
+#ifdef NTP_client
+        // ntp answer, processed with client_ntp_process_answer
+        if (buf[UDP_SRC_PORT_L_P]==0x7b){
+                return(UDP_DATA_P);
+        }
+#endif
+#ifdef DNS_client
+        // dns answer, processed with udp_client_check_for_dns_answer
+        if (buf[UDP_SRC_PORT_L_P]==53){
+                return(UDP_DATA_P);
+        }
+#endif
+        return(0);
+}
+
+// make a return eth header from a received eth packet
+void make_eth(uint8_t *buf)
+{
+        //copy the destination mac from the source and fill my mac into src
+        memcpy(&buf[ETH_DST_MAC],&buf[ETH_SRC_MAC],6);
+        memcpy(&buf[ETH_SRC_MAC],macaddr,6);
 }
 
 // make a new eth header for IP packet
@@ -294,6 +1074,15 @@ void fill_ip_hdr_checksum(uint8_t *buf)
         buf[IP_CHECKSUM_P+1]=ck & 0xff;
 }
 
+// set the total length of an ip header that already has a valid
+// checksum, e.g. one made by make_ip, and correct the checksum
+void ip_hdr_set_len(uint8_t *buf,uint16_t len)
+{
+        checksum_update_at(buf,IP_CHECKSUM_P,((uint16_t)buf[IP_TOTLEN_H_P]<<8)|buf[IP_TOTLEN_L_P],len);
+        buf[IP_TOTLEN_H_P]=len>>8;
+        buf[IP_TOTLEN_L_P]=len& 0xff;
+}
+
 // is it an arp reply (no len check here, you must first call eth_type_is_arp_and_my_ip)
 uint8_t eth_type_is_arp_reply(uint8_t *buf){
         return (buf[ETH_ARP_OPCODE_L_P]==ETH_ARP_OPCODE_REPLY_L_V);
@@ -351,12 +1140,8 @@ void make_ip_tcp_new(uint8_t *buf, uint16_t len,uint8_t *dst_ip)
 
 void make_ip(uint8_t *buf)
 {
-        uint8_t i=0;
-        while(i<4){
-                buf[IP_DST_P+i]=buf[IP_SRC_P+i];
-                buf[IP_SRC_P+i]=ipaddr[i];
-                i++;
-        }
+        memcpy(&buf[IP_DST_P],&buf[IP_SRC_P],4);
+        memcpy(&buf[IP_SRC_P],ipaddr,4);
         fill_ip_hdr_checksum(buf);
 }
 
@@ -444,10 +1229,7 @@ void make_echo_reply_from_request(uint8_t *buf,uint16_t len)
         buf[ICMP_TYPE_P]=ICMP_TYPE_ECHOREPLY_V;
         // we changed only the icmp.type field from request(=8) to reply(=0).
         // we can therefore easily correct the checksum:
-        if (buf[ICMP_CHECKSUM_P] > (0xff-0x08)){
-                buf[ICMP_CHECKSUM_P+1]++;
-        }
-        buf[ICMP_CHECKSUM_P]+=0x08;
+        checksum_update_at(buf,ICMP_CHECKSUM_P,ICMP_TYPE_ECHOREQUEST_V<<8,ICMP_TYPE_ECHOREPLY_V<<8);
         //
         enc28j60PacketSend(len,buf);
 }
@@ -456,7 +1238,6 @@ void make_echo_reply_from_request(uint8_t *buf,uint16_t len)
 void make_udp_reply_from_request(uint8_t *buf,char *data,uint16_t datalen,uint16_t port)
 {
         uint8_t i=0;
-        uint16_t ck;
         make_eth(buf);
         if (datalen>220){
                 datalen=220;
@@ -484,14 +1265,12 @@ void make_udp_reply_from_request(uint8_t *buf,char *data,uint16_t datalen,uint16
                 buf[UDP_DATA_P+i]=data[i];
                 i++;
         }
-        ck=checksum(&buf[IP_SRC_P], 16 + datalen,1);
-        buf[UDP_CHECKSUM_H_P]=ck>>8;
-        buf[UDP_CHECKSUM_L_P]=ck & 0xff;
-        enc28j60PacketSend(UDP_HEADER_LEN+IP_HEADER_LEN+ETH_HEADER_LEN+datalen,buf);
+        send_with_checksum(buf,UDP_HEADER_LEN+IP_HEADER_LEN+ETH_HEADER_LEN+datalen,16 + datalen,1,UDP_CHECKSUM_H_P);
 }
 
 // this is for the server not the client:
-void make_tcp_synack_from_syn(uint8_t *buf)
+// answer a syn with a syn,ack using isn as our initial sequence number
+static void send_tcp_synack(uint8_t *buf,uint32_t isn)
 {
         uint16_t ck;
         make_eth(buf);
@@ -503,16 +1282,7 @@ void make_tcp_synack_from_syn(uint8_t *buf)
         buf[TCP_FLAGS_P]=TCP_FLAGS_SYNACK_V;
         make_tcphead(buf,1,0);
         // put an inital seq number
-        buf[TCP_SEQ_H_P+0]= 0;
-        buf[TCP_SEQ_H_P+1]= 0;
-        // we step only the second byte, this allows us to send packts 
-        // with 255 bytes, 512  or 765 (step by 3) without generating
-        // overlapping numbers.
-        buf[TCP_SEQ_H_P+2]= seqnum; 
-        buf[TCP_SEQ_H_P+3]= 0;
-        // step the inititial seq num by something we will not use
-        // during this tcp session:
-        seqnum+=3;
+        put_seq(&buf[TCP_SEQ_H_P],isn);
         // add an mss options field with MSS to 1280:
         // 1280 in hex is 0x500
         buf[TCP_OPTIONS_P]=2;
@@ -535,10 +1305,133 @@ void make_tcp_synack_from_syn(uint8_t *buf)
         enc28j60PacketSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+4+ETH_HEADER_LEN,buf);
 }
 
-// do some basic length calculations and store the result in static variables
-uint16_t get_tcp_data_len(uint8_t *buf)
+// RFC 793 style initial sequence number from a clock ticking
+// every 4us, seqnum keeps two syns in the same ms apart
+static uint32_t tcp_new_isn(void)
 {
-        int16_t i;
+        uint32_t isn=millis()*250+((uint32_t)seqnum<<8);
+        seqnum+=3;
+        return(isn);
+}
+
+void make_tcp_synack_from_syn(uint8_t *buf)
+{
+        send_tcp_synack(buf,tcp_new_isn());
+}
+
+// make the template of the segments on connection c
+static void tcp_tmpl_make(tcpConnection *c)
+{
+        uint8_t *t=tcp_tmpl;
+        memcpy(&t[ETH_DST_MAC],c->mac,6);
+        memcpy(&t[ETH_SRC_MAC],macaddr,6);
+        t[ETH_TYPE_H_P]=ETHTYPE_IP_H_V;
+        t[ETH_TYPE_L_P]=ETHTYPE_IP_L_V;
+        // length, identification and checksum are filled in per segment
+        memset(&t[IP_P],0,IP_HEADER_LEN);
+        t[IP_P]=IP_V4_V|IP_HEADER_LENGTH_V;
+        t[IP_FLAGS_P]=0x40; // don't fragment
+        t[IP_TTL_P]=64;
+        t[IP_PROTO_P]=IP_PROTO_TCP_V;
+        memcpy(&t[IP_SRC_P],ipaddr,4);
+        memcpy(&t[IP_DST_P],c->ip,4);
+        t[TCP_SRC_PORT_H_P]=c->lport[0];
+        t[TCP_SRC_PORT_L_P]=c->lport[1];
+        t[TCP_DST_PORT_H_P]=c->port[0];
+        t[TCP_DST_PORT_L_P]=c->port[1];
+        tcp_tmpl_ipsum=checksum_fold(checksum_add(&t[IP_P],IP_HEADER_LEN,0));
+        // ip.src, ip.dst and the ports
+        tcp_tmpl_tcpsum=checksum_fold(checksum_add(&t[IP_SRC_P],TCP_SEQ_H_P-IP_SRC_P,IP_PROTO_TCP_V));
+        tcp_tmpl_conn=c;
+}
+
+// build the eth/ip/tcp header of a segment without data on connection c
+static void tcp_conn_head(uint8_t *buf,tcpConnection *c)
+{
+        uint16_t ck;
+        if (tcp_tmpl_conn!=c){
+                tcp_tmpl_make(c);
+        }
+        memcpy(buf,tcp_tmpl,TCP_SEQ_H_P);
+        buf[IP_TOTLEN_L_P]=IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN;
+        buf[IP_ID_H_P]=ip_identifier>>8;
+        buf[IP_ID_L_P]=ip_identifier & 0xff;
+        ck=~checksum_fold((uint32_t)tcp_tmpl_ipsum+IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+ip_identifier);
+        ip_identifier++;
+        buf[IP_CHECKSUM_P]=ck>>8;
+        buf[IP_CHECKSUM_P+1]=ck & 0xff;
+        put_seq(&buf[TCP_SEQ_H_P],c->snd_nxt);
+        put_seq(&buf[TCP_SEQACK_H_P],c->rcv_nxt);
+        buf[TCP_HEADER_LEN_P]=0x50;
+        buf[TCP_FLAGS_P]=TCP_FLAGS_ACK_V;
+        buf[TCP_WIN_SIZE]=c->rcv_wnd>>8;
+        buf[TCP_WIN_SIZE+1]=c->rcv_wnd & 0xff;
+        buf[TCP_CHECKSUM_H_P]=0;
+        buf[TCP_CHECKSUM_L_P]=0;
+        buf[TCP_URGENT_PTR_H_P]=0;
+        buf[TCP_URGENT_PTR_L_P]=0;
+}
+
+// checksum of a segment made with tcp_conn_head, tcplen is the length
+// of tcp header and data. Only the words after the ports are added up.
+static uint16_t tcp_conn_checksum(uint8_t *buf,uint16_t tcplen)
+{
+        uint32_t sum=tcp_tmpl_tcpsum+tcplen;
+        sum=checksum_add(&buf[TCP_SEQ_H_P],tcplen-(TCP_SEQ_H_P-TCP_SRC_PORT_H_P),sum);
+        return(~checksum_fold(sum));
+}
+
+// send a segment without data carrying the sequence numbers of
+// connection c
+static void tcp_conn_reply(uint8_t *buf,tcpConnection *c,uint8_t flags)
+{
+        uint16_t j;
+        tcp_conn_head(buf,c);
+        buf[TCP_FLAGS_P]=TCP_FLAGS_ACK_V|flags;
+        j=tcp_conn_checksum(buf,TCP_HEADER_LEN_PLAIN);
+        buf[TCP_CHECKSUM_H_P]=j>>8;
+        buf[TCP_CHECKSUM_L_P]=j& 0xff;
+        enc28j60PacketSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+ETH_HEADER_LEN,buf);
+        if (flags & TCP_FLAGS_FIN_V){
+                tcp_conn_advance(c,1);
+                tcp_conn_event(c,TCP_EV_CLOSE);
+        }
+}
+
+// send the syn (SYN_SENT) or syn,ack (SYN_RECEIVED) of connection c
+// with our initial sequence number snd_una and an mss option
+static void tcp_conn_syn(uint8_t *buf,tcpConnection *c)
+{
+        uint16_t j;
+        uint16_t mss=0x500; // 1280
+        uint32_t nxt=c->snd_nxt;
+        c->snd_nxt=c->snd_una;
+        tcp_conn_head(buf,c);
+        c->snd_nxt=nxt;
+        if (c->state==TCP_STATE_SYN_SENT){
+                buf[TCP_FLAGS_P]=TCP_FLAGS_SYN_V;
+                mss=CLIENTMSS;
+        }else{
+                buf[TCP_FLAGS_P]=TCP_FLAGS_SYNACK_V;
+                buf[TCP_WIN_SIZE]=0x5; // 1400=0x578
+                buf[TCP_WIN_SIZE+1]=0x78;
+        }
+        buf[TCP_OPTIONS_P]=2;
+        buf[TCP_OPTIONS_P+1]=4;
+        buf[TCP_OPTIONS_P+2]=mss>>8;
+        buf[TCP_OPTIONS_P+3]=mss & 0xff;
+        buf[TCP_HEADER_LEN_P]=0x60; // 24 bytes
+        ip_hdr_set_len(buf,IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+4);
+        j=tcp_conn_checksum(buf,TCP_HEADER_LEN_PLAIN+4);
+        buf[TCP_CHECKSUM_H_P]=j>>8;
+        buf[TCP_CHECKSUM_L_P]=j& 0xff;
+        enc28j60PacketSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+4+ETH_HEADER_LEN,buf);
+}
+
+// do some basic length calculations and store the result in static variables
+uint16_t get_tcp_data_len(uint8_t *buf)
+{
+        int16_t i;
         i=(((int16_t)buf[IP_TOTLEN_H_P])<<8)|(buf[IP_TOTLEN_L_P]&0xff);
         i-=IP_HEADER_LEN;
         i-=(buf[TCP_HEADER_LEN_P]>>4)*4; // generate len in bytes;
@@ -665,17 +1558,13 @@ void make_tcp_ack_with_data_noflags(uint8_t *buf,uint16_t dlen)
         // total length field in the IP header must be set:
         // 20 bytes IP + 20 bytes tcp (when no options) + len of data
         j=IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen;
-        buf[IP_TOTLEN_H_P]=j>>8;
-        buf[IP_TOTLEN_L_P]=j& 0xff;
-        fill_ip_hdr_checksum(buf);
+        ip_hdr_set_len(buf,j);
         // zero the checksum
         buf[TCP_CHECKSUM_H_P]=0;
         buf[TCP_CHECKSUM_L_P]=0;
         // calculate the checksum, len=8 (start from ip.src) + TCP_HEADER_LEN_PLAIN + data len
-        j=checksum(&buf[IP_SRC_P], 8+TCP_HEADER_LEN_PLAIN+dlen,2);
-        buf[TCP_CHECKSUM_H_P]=j>>8;
-        buf[TCP_CHECKSUM_L_P]=j& 0xff;
-        enc28j60PacketSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen+ETH_HEADER_LEN,buf);
+        send_with_checksum(buf,IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen+ETH_HEADER_LEN,8+TCP_HEADER_LEN_PLAIN+dlen,2,TCP_CHECKSUM_H_P);
+        tcp_conn_sent(buf,dlen);
 }
 
 
@@ -697,17 +1586,13 @@ void make_tcp_ack_with_data(uint8_t *buf,uint16_t dlen)
         // total length field in the IP header must be set:
         // 20 bytes IP + 20 bytes tcp (when no options) + len of data
         j=IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen;
-        buf[IP_TOTLEN_H_P]=j>>8;
-        buf[IP_TOTLEN_L_P]=j& 0xff;
-        fill_ip_hdr_checksum(buf);
+        ip_hdr_set_len(buf,j);
         // zero the checksum
         buf[TCP_CHECKSUM_H_P]=0;
         buf[TCP_CHECKSUM_L_P]=0;
         // calculate the checksum, len=8 (start from ip.src) + TCP_HEADER_LEN_PLAIN + data len
-        j=checksum(&buf[IP_SRC_P], 8+TCP_HEADER_LEN_PLAIN+dlen,2);
-        buf[TCP_CHECKSUM_H_P]=j>>8;
-        buf[TCP_CHECKSUM_L_P]=j& 0xff;
-        enc28j60PacketSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen+ETH_HEADER_LEN,buf);
+        send_with_checksum(buf,IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen+ETH_HEADER_LEN,8+TCP_HEADER_LEN_PLAIN+dlen,2,TCP_CHECKSUM_H_P);
+        tcp_conn_sent(buf,dlen);
 }
 
 
@@ -732,6 +1617,113 @@ void www_server_reply(uint8_t *buf,uint16_t dlen)
         make_tcp_ack_with_data_noflags(buf,dlen); // send data
 }
 
+// Streaming version of www_server_reply. Instead of building the whole
+// page in buf with fill_tcp_data_p and copying it to the chip afterwards
+// the data is written straight into the transmit buffer of the enc28j60.
+// buf only has to hold the eth/ip/tcp header, a page can be up to
+// TCP_STREAM_MAX_DATA bytes no matter how small BUFFER_SIZE is:
+//
+// www_server_reply_begin(buf);
+// stream_tcp_data_p(PSTR("HTTP/1.0 200 OK\r\n..."));
+// stream_tcp_data(str);
+// www_server_reply_end(buf);
+//
+// No other packet may be sent between begin and end.
+// The chip aborts frames longer than MAX_FRAMELEN, which includes the CRC.
+#define TX_STREAM_MAX_FRAME (MAX_FRAMELEN-4)
+#define TCP_STREAM_MAX_DATA (TX_STREAM_MAX_FRAME-ETH_HEADER_LEN-IP_HEADER_LEN-TCP_HEADER_LEN_PLAIN)
+// bytes of PROGMEM data copied per spi transfer
+#define TCP_STREAM_CHUNK 32
+static uint16_t tx_stream_len;
+static uint32_t tx_stream_sum;
+
+// add bytes at tcp data position tx_stream_len to the running checksum
+static void stream_sum(const uint8_t *s,uint16_t len)
+{
+        // the tcp data starts at an even offset from IP_SRC_P, an odd
+        // byte left over from the last call is the low byte of a word
+        if (tx_stream_len & 1){
+                tx_stream_sum+=*s;
+                tx_stream_len++;
+                s++;
+                len--;
+        }
+        tx_stream_sum=checksum_add(s,len,tx_stream_sum);
+        tx_stream_len+=len;
+}
+
+void www_server_reply_begin(uint8_t *buf)
+{
+        make_tcp_ack_from_any(buf,info_data_len,0); // send ack for http get
+        buf[TCP_FLAGS_P]=TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V;
+        // the header is written again by www_server_reply_end
+        // once length and checksums are known, this only reserves the space
+        enc28j60TxBegin();
+        enc28j60WriteBuffer(TCP_DATA_P,buf);
+        tx_stream_len=0;
+        tx_stream_sum=0;
+}
+
+// append len bytes to the page. Returns the amount of data in the
+// page so far, anything beyond TCP_STREAM_MAX_DATA is dropped.
+uint16_t stream_tcp_data_len(const uint8_t *s,uint16_t len)
+{
+        if (len>TCP_STREAM_MAX_DATA-tx_stream_len){
+                len=TCP_STREAM_MAX_DATA-tx_stream_len;
+        }
+        if (len==0){
+                return(tx_stream_len);
+        }
+        enc28j60WriteBuffer(len,(uint8_t *)s);
+        stream_sum(s,len);
+        return(tx_stream_len);
+}
+
+uint16_t stream_tcp_data(const char *s)
+{
+        return(stream_tcp_data_len((const uint8_t *)s,strlen(s)));
+}
+
+uint16_t stream_tcp_data_p(const prog_char *progmem_s)
+{
+        uint8_t chunk[TCP_STREAM_CHUNK];
+        uint8_t i;
+        char c;
+        do{
+                i=0;
+                while (i<TCP_STREAM_CHUNK && (c = pgm_read_byte(progmem_s))) {
+                        chunk[i]=c;
+                        progmem_s++;
+                        i++;
+                }
+                stream_tcp_data_len(chunk,i);
+        }while(i==TCP_STREAM_CHUNK);
+        return(tx_stream_len);
+}
+
+// patch length and checksums into the header and send the page
+void www_server_reply_end(uint8_t *buf)
+{
+        uint16_t j;
+        j=IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+tx_stream_len;
+        ip_hdr_set_len(buf,j);
+        buf[TCP_CHECKSUM_H_P]=0;
+        buf[TCP_CHECKSUM_L_P]=0;
+        // pseudo header and tcp header, the data was added while streaming
+        tx_stream_sum+=IP_PROTO_TCP_V+TCP_HEADER_LEN_PLAIN+tx_stream_len;
+        tx_stream_sum=checksum_add(&buf[IP_SRC_P],TCP_DATA_P-IP_SRC_P,tx_stream_sum);
+        while (tx_stream_sum>>16){
+                tx_stream_sum=(tx_stream_sum & 0xFFFF)+(tx_stream_sum>>16);
+        }
+        j=(uint16_t)tx_stream_sum ^ 0xFFFF;
+        buf[TCP_CHECKSUM_H_P]=j>>8;
+        buf[TCP_CHECKSUM_L_P]=j& 0xff;
+        enc28j60TxWrite(0,TCP_DATA_P,buf);
+        enc28j60TxEnd(TCP_DATA_P+tx_stream_len);
+        enc28j60PacketTransmit();
+        tcp_conn_sent(buf,tx_stream_len);
+}
+
 #if defined (NTP_client) ||  defined (WOL_client) || defined (UDP_client) || defined (TCP_client) || defined (PING_client)
 // fill buffer with a prog-mem string
 void fill_buf_p(uint8_t *buf,uint16_t len, const prog_char *progmem_s)
@@ -748,14 +1740,14 @@ void fill_buf_p(uint8_t *buf,uint16_t len, const prog_char *progmem_s)
 #ifdef PING_client
 // icmp echo, matchpat is a pattern that has to be sent back by the 
 // host answering the ping.
-// The ping is sent to destip  and mac gwmacaddr
+// The ping is sent to destip, via the gateway if it is not on our subnet
 void client_icmp_request(uint8_t *buf,uint8_t *destip)
 {
         uint8_t i=0;
         uint16_t ck;
         //
+        arp_fill_dst_mac(buf,destip);
         while(i<6){
-                buf[ETH_DST_MAC +i]=gwmacaddr[i]; // gw mac in local lan or host mac
                 buf[ETH_SRC_MAC +i]=macaddr[i];
                 i++;
         }
@@ -806,8 +1798,8 @@ void client_ntp_request(uint8_t *buf,uint8_t *ntpip,uint8_t srcport)
         uint8_t i=0;
         uint16_t ck;
         //
+        arp_fill_dst_mac(buf,ntpip);
         while(i<6){
-                buf[ETH_DST_MAC +i]=gwmacaddr[i]; // gw mac in local lan or host mac
                 buf[ETH_SRC_MAC +i]=macaddr[i];
                 i++;
         }
@@ -867,19 +1859,20 @@ uint8_t client_ntp_process_answer(uint8_t *buf,uint32_t *time,uint8_t dstport_l)
 
 #ifdef UDP_client
 // -------------------- send a spontanious UDP packet to a server 
-// There are two ways of using this:
+// There are three ways of using this, see send_udp_stream_begin for 3):
 // 1) you call send_udp_prepare, you fill the data yourself into buf starting at buf[UDP_DATA_P], 
 // you send the packet by calling send_udp_transmit
 //
 // 2) You just allocate a large enough buffer for you data and you call send_udp and nothing else
 // needs to be done.
 //
-// send_udp sends via gwip, you must call client_set_gwip at startup
+// send_udp sends via gwip, you must call client_set_gwip at startup.
+// Hosts on the subnet set with client_set_netmask get it directly.
 void send_udp_prepare(uint8_t *buf,uint16_t sport, uint8_t *dip, uint16_t dport)
 {
         uint8_t i=0;
+        arp_fill_dst_mac(buf,dip);
         while(i<6){
-                buf[ETH_DST_MAC +i]=gwmacaddr[i]; // gw mac in local lan or host mac
                 buf[ETH_SRC_MAC +i]=macaddr[i];
                 i++;
         }
@@ -912,7 +1905,6 @@ void send_udp_prepare(uint8_t *buf,uint16_t sport, uint8_t *dip, uint16_t dport)
 
 void send_udp_transmit(uint8_t *buf,uint16_t datalen)
 {
-        uint16_t ck;
         buf[IP_TOTLEN_H_P]=(IP_HEADER_LEN+UDP_HEADER_LEN+datalen) >> 8;
         buf[IP_TOTLEN_L_P]=(IP_HEADER_LEN+UDP_HEADER_LEN+datalen) & 0xff;
         fill_ip_hdr_checksum(buf);
@@ -921,10 +1913,7 @@ void send_udp_transmit(uint8_t *buf,uint16_t datalen)
         buf[UDP_LEN_L_P]=(UDP_HEADER_LEN+datalen) & 0xff;
 
         //
-        ck=checksum(&buf[IP_SRC_P], 16 + datalen,1);
-        buf[UDP_CHECKSUM_H_P]=ck>>8;
-        buf[UDP_CHECKSUM_L_P]=ck& 0xff;
-        enc28j60PacketSend(UDP_HEADER_LEN+IP_HEADER_LEN+ETH_HEADER_LEN+datalen,buf);
+        send_with_checksum(buf,UDP_HEADER_LEN+IP_HEADER_LEN+ETH_HEADER_LEN+datalen,16 + datalen,1,UDP_CHECKSUM_H_P);
 }
 
 void send_udp(uint8_t *buf,char *data,uint16_t datalen,uint16_t sport, uint8_t *dip, uint16_t dport)
@@ -944,6 +1933,85 @@ void send_udp(uint8_t *buf,char *data,uint16_t datalen,uint16_t sport, uint8_t *
         //
         send_udp_transmit(buf,datalen);
 }
+
+// 3) The data goes straight into the transmit buffer of the chip as it
+// comes, like with www_server_reply_begin, and buf is not touched at all.
+// hdr needs room for the headers only (UDP_DATA_P bytes) and may be
+// changed until send_udp_stream_end:
+//
+// send_udp_stream_begin(hdr,sport,dip,dport);
+// send_udp_stream(data,len);
+// send_udp_stream_zero(len);
+// send_udp_stream_end(hdr);
+//
+// No other packet may be sent between begin and end.
+#define UDP_STREAM_MAX_DATA (TX_STREAM_MAX_FRAME-UDP_DATA_P)
+void send_udp_stream_begin(uint8_t *hdr,uint16_t sport, uint8_t *dip, uint16_t dport)
+{
+        send_udp_prepare(hdr,sport,dip,dport);
+        // this only reserves the space, the header is written again
+        // by send_udp_stream_end once length and checksums are known
+        enc28j60TxBegin();
+        enc28j60WriteBuffer(UDP_DATA_P,hdr);
+        tx_stream_len=0;
+        tx_stream_sum=0;
+}
+
+// append len bytes of data, anything beyond UDP_STREAM_MAX_DATA is dropped
+void send_udp_stream(const uint8_t *s,uint16_t len)
+{
+        if (len>UDP_STREAM_MAX_DATA-tx_stream_len){
+                len=UDP_STREAM_MAX_DATA-tx_stream_len;
+        }
+        if (len==0){
+                return;
+        }
+        enc28j60WriteBuffer(len,(uint8_t *)s);
+        stream_sum(s,len);
+}
+
+// append len zero bytes, they do not change the checksum
+void send_udp_stream_zero(uint16_t len)
+{
+        uint8_t zero[TCP_STREAM_CHUNK];
+        uint8_t n;
+        if (len>UDP_STREAM_MAX_DATA-tx_stream_len){
+                len=UDP_STREAM_MAX_DATA-tx_stream_len;
+        }
+        memset(zero,0,TCP_STREAM_CHUNK);
+        tx_stream_len+=len;
+        while(len){
+                n=TCP_STREAM_CHUNK;
+                if (len<TCP_STREAM_CHUNK){
+                        n=len;
+                }
+                enc28j60WriteBuffer(n,zero);
+                len-=n;
+        }
+}
+
+// patch length and checksums into the header and send the packet
+void send_udp_stream_end(uint8_t *hdr)
+{
+        uint16_t j;
+        j=UDP_HEADER_LEN+tx_stream_len;
+        hdr[IP_TOTLEN_H_P]=(IP_HEADER_LEN+j)>>8;
+        hdr[IP_TOTLEN_L_P]=(IP_HEADER_LEN+j)&0xff;
+        fill_ip_hdr_checksum(hdr);
+        hdr[UDP_LEN_H_P]=j>>8;
+        hdr[UDP_LEN_L_P]=j&0xff;
+        hdr[UDP_CHECKSUM_H_P]=0;
+        hdr[UDP_CHECKSUM_L_P]=0;
+        // pseudo header and udp header, the data was added while streaming
+        tx_stream_sum+=IP_PROTO_UDP_V+j;
+        tx_stream_sum=checksum_add(&hdr[IP_SRC_P],UDP_DATA_P-IP_SRC_P,tx_stream_sum);
+        j=checksum_fold(tx_stream_sum) ^ 0xFFFF;
+        hdr[UDP_CHECKSUM_H_P]=j>>8;
+        hdr[UDP_CHECKSUM_L_P]=j&0xff;
+        enc28j60TxWrite(0,UDP_DATA_P,hdr);
+        enc28j60TxEnd(UDP_DATA_P+tx_stream_len);
+        enc28j60PacketTransmit();
+}
 #endif // UDP_client
 
 #ifdef WOL_client
@@ -1093,11 +2161,192 @@ void client_set_gwip(uint8_t *gwipaddr)
 {
         uint8_t i=0;
         waitgwmac=WGW_INITIAL_ARP; // causes an arp request in the packet loop
+        gw_arp_time=millis()-ARP_RETRY_MS;
         while(i<4){
                 gwip[i]=gwipaddr[i];
                 i++;
         }
 }
+
+// Hosts on our own subnet are reached directly, their mac addresses are
+// kept in a small cache. Entries are ordered by use, the least recently
+// used one is replaced by a new host. After ARP_CACHE_TTL seconds an
+// entry is asked for again, it is still used until the answer comes.
+// Nothing waits for an answer: a lookup of an unknown host returns no
+// mac and the request goes out from packetloop_icmp_tcp.
+#define ARP_FREE 0
+#define ARP_PENDING 1   // asked, no answer yet
+#define ARP_RESOLVED 2
+#define ARP_REFRESH 3   // old mac still in use, asked again
+
+typedef struct arpEntry {
+        uint8_t ip[4];
+        uint8_t mac[6];
+        uint8_t state;          // ARP_xxx
+        uint8_t tries;          // requests sent without an answer
+        uint32_t stamp;         // millis() of the answer or of the last request
+} arpEntry;
+
+static arpEntry arp_cache[ARP_CACHE_SIZE];
+
+// set the netmask of our subnet, without it everything goes to the gateway
+void client_set_netmask(uint8_t *mask)
+{
+        uint8_t i=0;
+        while(i<4){
+                netmask[i]=mask[i];
+                i++;
+        }
+}
+
+// 1 if ip is on our subnet and not the gateway
+static uint8_t arp_on_link(uint8_t *ip)
+{
+        uint8_t i=0;
+        uint8_t gw=1;
+        if (netmask[0]==0){
+                return(0);
+        }
+        while(i<4){
+                if ((ip[i]^ipaddr[i]) & netmask[i]){
+                        return(0);
+                }
+                if (ip[i]!=gwip[i]){
+                        gw=0;
+                }
+                i++;
+        }
+        return(!gw);
+}
+
+// position of ip in the cache or ARP_CACHE_SIZE
+static uint8_t arp_cache_find(uint8_t *ip)
+{
+        uint8_t i=0;
+        while(i<ARP_CACHE_SIZE){
+                if (arp_cache[i].state!=ARP_FREE && memcmp(arp_cache[i].ip,ip,4)==0){
+                        return(i);
+                }
+                i++;
+        }
+        return(i);
+}
+
+// move entry i to the front, the entry at the end is the one to replace
+static arpEntry *arp_cache_touch(uint8_t i)
+{
+        arpEntry e=arp_cache[i];
+        while(i>0){
+                arp_cache[i]=arp_cache[i-1];
+                i--;
+        }
+        arp_cache[0]=e;
+        return(&arp_cache[0]);
+}
+
+// mac of the next hop towards ip or 0 if we do not know it yet.
+// Looking up an unknown host on our subnet starts an arp request.
+static uint8_t *arp_next_hop(uint8_t *ip)
+{
+        arpEntry *e;
+        uint8_t i;
+        if (!arp_on_link(ip)){
+                if (waitgwmac & WGW_HAVE_GW_MAC){
+                        return(gwmacaddr);
+                }
+                return(0);
+        }
+        i=arp_cache_find(ip);
+        if (i==ARP_CACHE_SIZE){
+                e=arp_cache_touch(ARP_CACHE_SIZE-1);
+                memcpy(e->ip,ip,4);
+                e->state=ARP_PENDING;
+                e->tries=0;
+                e->stamp=millis()-ARP_RETRY_MS;
+                return(0);
+        }
+        e=arp_cache_touch(i);
+        if (e->state==ARP_PENDING){
+                return(0);
+        }
+        return(e->mac);
+}
+
+// fill in the destination mac of a packet to ip. While the mac is not
+// known yet it goes to the gateway as it always did.
+static void arp_fill_dst_mac(uint8_t *buf,uint8_t *ip)
+{
+        uint8_t *mac=arp_next_hop(ip);
+        uint8_t i=0;
+        if (mac==0){
+                mac=gwmacaddr;
+        }
+        while(i<6){
+                buf[ETH_DST_MAC +i]=mac[i];
+                i++;
+        }
+}
+
+// 1 while the mac of the next hop towards ip is not known. Call it until
+// it returns 0 before you send to a host on your own subnet.
+uint8_t client_waiting_arp(uint8_t *ip)
+{
+        return(arp_next_hop(ip)==0);
+}
+
+// take the mac of a host we have an entry for from its arp packet
+// (request or reply). No len check, call eth_type_is_arp_and_my_ip first.
+static void arp_cache_store(uint8_t *buf)
+{
+        arpEntry *e;
+        uint8_t i=arp_cache_find(&buf[ETH_ARP_SRC_IP_P]);
+        if (i==ARP_CACHE_SIZE){
+                return;
+        }
+        e=&arp_cache[i];
+        memcpy(e->mac,&buf[ETH_ARP_SRC_MAC_P],6);
+        e->state=ARP_RESOLVED;
+        e->tries=0;
+        e->stamp=millis();
+}
+
+// Send the arp requests that are due, one per call. Returns 1 if buf
+// was used.
+static uint8_t arp_cache_poll(uint8_t *buf)
+{
+        arpEntry *e;
+        uint8_t i=0;
+        if (waitgwmac & WGW_HAVE_GW_MAC && millis()-gw_arp_stamp>=ARP_CACHE_TTL*1000UL){
+                // the gateway mac is old, ask again but keep using it
+                waitgwmac|=WGW_REFRESHING;
+        }
+        if ((waitgwmac & (WGW_INITIAL_ARP|WGW_REFRESHING)) && (uint16_t)((uint16_t)millis()-gw_arp_time)>=ARP_RETRY_MS
+            && enc28j60linkup()){
+                gw_arp_time=millis();
+                client_arp_whohas(buf,gwip);
+                return(1);
+        }
+        while(i<ARP_CACHE_SIZE){
+                e=&arp_cache[i];
+                if (e->state==ARP_RESOLVED && millis()-e->stamp>=ARP_CACHE_TTL*1000UL){
+                        e->state=ARP_REFRESH;
+                        e->stamp=millis()-ARP_RETRY_MS;
+                }
+                if ((e->state==ARP_PENDING || e->state==ARP_REFRESH) && millis()-e->stamp>=ARP_RETRY_MS){
+                        if (e->tries>=ARP_MAX_TRIES){
+                                // nobody answers
+                                e->state=ARP_FREE;
+                        }else{
+                                e->tries++;
+                                e->stamp=millis();
+                                client_arp_whohas(buf,e->ip);
+                                return(1);
+                        }
+                }
+                i++;
+        }
+        return(0);
+}
 #endif
 
 void client_tcp_set_serverip(uint8_t *ipaddr)
@@ -1113,68 +2362,30 @@ void client_tcp_set_serverip(uint8_t *ipaddr)
 // Make a tcp syn packet
 void client_syn(uint8_t *buf,uint8_t srcport,uint8_t dstport_h,uint8_t dstport_l)
 {
-        uint16_t ck;
+        tcpConnection *c=&tcp_client_conn;
+        uint8_t *mac=arp_next_hop(tcpsrvip);
         uint8_t i=0;
-        // -- make the main part of the eth/IP/tcp header:
-        while(i<6){
-                buf[ETH_DST_MAC +i]=gwmacaddr[i]; // gw mac in local lan or host mac
-                buf[ETH_SRC_MAC +i]=macaddr[i];
-                i++;
-        }
-        buf[ETH_TYPE_H_P] = ETHTYPE_IP_H_V;
-        buf[ETH_TYPE_L_P] = ETHTYPE_IP_L_V;
-        fill_buf_p(&buf[IP_P],9,iphdr);
-        buf[IP_TOTLEN_L_P]=44; // good for syn
-        buf[IP_PROTO_P]=IP_PROTO_TCP_V;
-        i=0;
-        while(i<4){
-                buf[IP_DST_P+i]=tcpsrvip[i];
-                buf[IP_SRC_P+i]=ipaddr[i];
-                i++;
+        if (mac==0){
+                mac=gwmacaddr;
         }
-        fill_ip_hdr_checksum(buf);
-        buf[TCP_DST_PORT_H_P]=dstport_h;
-        buf[TCP_DST_PORT_L_P]=dstport_l;
-        buf[TCP_SRC_PORT_H_P]=TCPCLIENT_SRC_PORT_H;
-        buf[TCP_SRC_PORT_L_P]=srcport; // lower 8 bit of src port
-        i=0;
-        // zero out sequence number and acknowledgement number
-        while(i<8){
-                buf[TCP_SEQ_H_P+i]=0;
+        while(i<6){
+                c->mac[i]=mac[i]; // gw mac or the host in our lan
+                if (i<4){
+                        c->ip[i]=tcpsrvip[i];
+                }
                 i++;
         }
-        // -- header ready 
-        // put inital seq number
-        // we step only the second byte, this allows us to send packts 
-        // with 255 bytes 512 (if we step the initial seqnum by 2)
-        // or 765 (step by 3)
-        buf[TCP_SEQ_H_P+2]= seqnum; 
-        // step the inititial seq num by something we will not use
-        // during this tcp session:
-        seqnum+=3;
-        buf[TCP_HEADER_LEN_P]=0x60; // 0x60=24 len: (0x60>>4) * 4
-        buf[TCP_FLAGS_P]=TCP_FLAGS_SYN_V;
-        // use a low window size otherwise we have to have
-        // timers and can not just react on every packet.
-        buf[TCP_WIN_SIZE]=0x4; // 1024=0x400, 768 = 0x300, initial window
-        buf[TCP_WIN_SIZE+1]=0x0;
-        // zero the checksum
-        buf[TCP_CHECKSUM_H_P]=0;
-        buf[TCP_CHECKSUM_L_P]=0;
-        // urgent pointer
-        buf[TCP_CHECKSUM_L_P+1]=0;
-        buf[TCP_CHECKSUM_L_P+2]=0;
-        // MSS=768, must be more than 50% of the window size we use
-        // 768 in hex is 0x300
-        buf[TCP_OPTIONS_P]=2;
-        buf[TCP_OPTIONS_P+1]=4;
-        buf[TCP_OPTIONS_P+2]=(CLIENTMSS>>8);
-        buf[TCP_OPTIONS_P+3]=CLIENTMSS & 0xff;
-        ck=checksum(&buf[IP_SRC_P], 8 +TCP_HEADER_LEN_PLAIN+4,2);
-        buf[TCP_CHECKSUM_H_P]=ck>>8;
-        buf[TCP_CHECKSUM_L_P]=ck& 0xff;
-        // 4 is the tcp mss option:
-        enc28j60PacketSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+ETH_HEADER_LEN+4,buf);
+        c->port[0]=dstport_h;
+        c->port[1]=dstport_l;
+        c->lport[0]=TCPCLIENT_SRC_PORT_H;
+        c->lport[1]=srcport; // lower 8 bit of src port
+        c->rcv_nxt=0;
+        c->snd_wnd=0;
+        c->rcv_wnd=TCP_CLIENT_WINDOW;
+        tcp_client_wnd_update=0;
+        tcp_conn_init(c,tcp_new_isn());
+        tcp_conn_syn(buf,c);
+        tcp_conn_advance(c,1);
 #ifdef ETHERSHIELD_DEBUG
         ethershieldDebug( "Sent TCP Syn\n");
 #endif
@@ -1187,22 +2398,15 @@ uint16_t build_tcp_data(uint8_t *buf, uint16_t srcPort )
         uint16_t ck;
         uint8_t i=0;
         // -- make the main part of the eth/IP/tcp header:
-        while(i<6){
-                buf[ETH_DST_MAC +i]=gwmacaddr[i]; // gw mac in local lan or host mac
-                buf[ETH_SRC_MAC +i]=macaddr[i];
-                i++;
-        }
+        arp_fill_dst_mac(buf,tcpsrvip);
+        memcpy(&buf[ETH_SRC_MAC],macaddr,6);
         buf[ETH_TYPE_H_P] = ETHTYPE_IP_H_V;
         buf[ETH_TYPE_L_P] = ETHTYPE_IP_L_V;
         fill_buf_p(&buf[IP_P],9,iphdr);
         buf[IP_TOTLEN_L_P]=40; 
         buf[IP_PROTO_P]=IP_PROTO_TCP_V;
-        i=0;
-        while(i<4){
-                buf[IP_DST_P+i]=tcpsrvip[i];
-                buf[IP_SRC_P+i]=ipaddr[i];
-                i++;
-        }
+        memcpy(&buf[IP_DST_P],tcpsrvip,4);
+        memcpy(&buf[IP_SRC_P],ipaddr,4);
         fill_ip_hdr_checksum(buf);
         buf[TCP_DST_PORT_H_P]=tcp_client_port_h;
         buf[TCP_DST_PORT_L_P]=tcp_client_port_l;
@@ -1269,10 +2473,7 @@ void send_tcp_data(uint8_t *buf,uint16_t dlen)
         buf[TCP_CHECKSUM_H_P]=0;
         buf[TCP_CHECKSUM_L_P]=0;
         // calculate the checksum, len=8 (start from ip.src) + TCP_HEADER_LEN_PLAIN + data len
-        j=checksum(&buf[IP_SRC_P], 8+TCP_HEADER_LEN_PLAIN+dlen,2);
-        buf[TCP_CHECKSUM_H_P]=j>>8;
-        buf[TCP_CHECKSUM_L_P]=j& 0xff;
-        enc28j60PacketSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen+ETH_HEADER_LEN,buf);
+        send_with_checksum(buf,IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen+ETH_HEADER_LEN,8+TCP_HEADER_LEN_PLAIN+dlen,2,TCP_CHECKSUM_H_P);
 }
 
 
@@ -1286,9 +2487,9 @@ void send_tcp_data(uint8_t *buf,uint16_t dlen)
 // are invalid. That is: do to use data_start_pos_in_buf and len_of_data
 // if statuscode!=0.
 //
-// This callback gives you access to the TCP data of the first
-// packet returned from the server. You should aim to minimize the server
-// output such that this will be the only packet.
+// This callback is called for every packet of data returned from the
+// server, in order. If you need to know where a packet is in the whole
+// answer or want to slow the server down then use client_tcp_stream_req.
 //
 // close_tcp_session=1 means close the session now. close_tcp_session=0
 // read all data and leave it to the other side to close it. 
@@ -1311,8 +2512,10 @@ void send_tcp_data(uint8_t *buf,uint16_t dlen)
 // executed then you can start a new one. The fd makes it still possible to
 // distinguish in the callback code the different types you started.
 //
-// Note that you might never get called back if the other side does
-// not answer. A timer would be needed to recongnize such a condition.
+// If the other side does not answer the syn or the request is sent
+// again a few times (TCP_MAX_RETRIES in ip_config.h). When there is
+// still no answer the callback is called with statuscode=4 (timeout).
+// statuscode=3 means the server reset the connection.
 //
 // We use callback functions because that saves memory and a uC is very
 // limited in memory
@@ -1320,25 +2523,65 @@ void send_tcp_data(uint8_t *buf,uint16_t dlen)
 uint8_t client_tcp_req(uint8_t (*result_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf, uint16_t len_of_data),uint16_t (*datafill_callback)(uint8_t fd),uint16_t port)
 {
         client_tcp_result_callback=result_callback;
+        client_tcp_stream_callback=0;
         client_tcp_datafill_callback=datafill_callback;
         tcp_client_port_h=(port>>8) & 0xff;
         tcp_client_port_l=(port & 0xff);
-        tcp_client_state=1;
+        // the syn goes out from packetloop_icmp_tcp once we have the
+        // mac of the gateway. Until then SND.NXT is SND.UNA.
+        tcp_client_conn.state=TCP_STATE_CLOSED;
+        tcp_conn_event(&tcp_client_conn,TCP_EV_ACTIVE_OPEN);
+        tcp_client_conn.snd_nxt=tcp_client_conn.snd_una;
+        tcp_conn_last=&tcp_client_conn;
         tcp_fd++;
         if (tcp_fd>7){
                 tcp_fd=0;
         }
         return(tcp_fd);
 }
-#endif //  TCP_client
 
-#if defined (WWW_client) 
-uint16_t www_client_internal_datafill_callback(uint8_t fd){
-        char strbuf[5];
-        uint16_t len=0;
-        if (fd==www_fd){
-                if (browsertype==0){
-                        // GET
+// Like client_tcp_req but for answers that do not fit into one packet.
+// Declare the result callback like this:
+//
+// uint16_t your_client_tcp_stream_callback(uint8_t fd, uint8_t statuscode,uint16_t data_start_pos_in_buf, uint16_t len_of_data,uint32_t offset,uint8_t more){...your code;return(window);}
+//
+// It is called for every segment from the server in the order of the
+// data. offset is the position of the first byte of this segment in
+// the whole answer. more=0 means the server has closed the connection
+// and this is the end of the answer (len_of_data may be zero then).
+// Segments that arrive out of order are dropped, the server sends
+// them again.
+//
+// Return how many more bytes you can take (the tcp window, 0 stops the
+// server until you call client_tcp_window) or TCP_CLIENT_CLOSE to
+// close the connection now.
+//
+// statuscode=3 and 4 are the same as for client_tcp_req.
+uint8_t client_tcp_stream_req(uint16_t (*stream_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf,uint16_t len_of_data,uint32_t offset,uint8_t more),uint16_t (*datafill_callback)(uint8_t fd),uint16_t port)
+{
+        uint8_t fd;
+        fd=client_tcp_req(0,datafill_callback,port);
+        client_tcp_stream_callback=stream_callback;
+        return(fd);
+}
+
+// open the window again after the stream callback has returned a small
+// one. The update is sent the next time packetloop_icmp_tcp has nothing
+// to do.
+void client_tcp_window(uint16_t wnd)
+{
+        tcp_client_conn.rcv_wnd=wnd;
+        tcp_client_wnd_update=1;
+}
+#endif //  TCP_client
+
+#if defined (WWW_client) 
+uint16_t www_client_internal_datafill_callback(uint8_t fd){
+        char strbuf[5];
+        uint16_t len=0;
+        if (fd==www_fd){
+                if (browsertype==0){
+                        // GET
                         len=fill_tcp_data_p(bufptr,0,PSTR("GET "));
 #ifdef FLASH_VARS
                         len=fill_tcp_data_p(bufptr,len,client_urlbuf);
@@ -1401,22 +2644,33 @@ uint16_t www_client_internal_datafill_callback(uint8_t fd){
         return(0);
 }
 
-uint8_t www_client_internal_result_callback(uint8_t fd, uint8_t statuscode, uint16_t datapos, uint16_t len_of_data){
+// The browser callback gets the first segment of the answer only, the
+// one with the http status line, as it always did. The rest of the page
+// is acked but not passed on, use client_tcp_stream_req to see all of it.
+uint16_t www_client_internal_result_callback(uint8_t fd, uint8_t statuscode, uint16_t datapos, uint16_t len_of_data,uint32_t offset,uint8_t more){
+        (void)more; // the browser callback is not told where the page ends
+        if (client_browser_callback==0){
+                return(TCP_CLIENT_CLOSE);
+        }
         if (fd!=www_fd){
                 (*client_browser_callback)(4,0,0);
+                return(TCP_CLIENT_CLOSE);
+        }
+        if (statuscode==4){
+                // the server did not answer
+                (*client_browser_callback)(3,0,0);
                 return(0);
         }
-        if (statuscode==0 && len_of_data>12){
-                // we might have a http status code
-                if (client_browser_callback){
-                        if (strncmp("200",(char *)&(bufptr[datapos+9]),3)==0){
-                                (*client_browser_callback)(0,((uint16_t)TCP_SRC_PORT_H_P+(bufptr[TCP_HEADER_LEN_P]>>4)*4),len_of_data);
-                        }else{
-                                (*client_browser_callback)(1,((uint16_t)TCP_SRC_PORT_H_P+(bufptr[TCP_HEADER_LEN_P]>>4)*4),len_of_data);
-                        }
-                }
+        if (statuscode!=0 || len_of_data==0 || offset!=0){
+                return(TCP_CLIENT_WINDOW);
         }
-        return(0);
+        // the http status code is in the first segment
+        if (len_of_data>12 && strncmp("200",(char *)&(bufptr[datapos+9]),3)==0){
+                (*client_browser_callback)(0,datapos,len_of_data);
+        }else{
+                (*client_browser_callback)(1,datapos,len_of_data);
+        }
+        return(TCP_CLIENT_WINDOW);
 }
 
 
@@ -1433,6 +2687,8 @@ uint8_t www_client_internal_result_callback(uint8_t fd, uint8_t statuscode, uint
 // to know to which site you want to go.
 // additionalheaderline must be set to NULL if not used.
 // statuscode is zero if the answer from the web server is 200 OK (e.g HTTP/1.1 200 OK)
+// The callback is called once per request with the first packet of the
+// answer. Later packets of a long page are not passed on.
 //
 //
 #ifdef FLASH_VARS
@@ -1446,7 +2702,7 @@ void client_browse_url(char *urlbuf, char *urlbuf_varpart, char *hoststr, void (
         client_hoststr=hoststr;
         browsertype=0;
         client_browser_callback=callback;
-        www_fd=client_tcp_req(&www_client_internal_result_callback,&www_client_internal_datafill_callback,80);
+        www_fd=client_tcp_stream_req(&www_client_internal_result_callback,&www_client_internal_datafill_callback,80);
 }
 
 // client web browser using http POST operation:
@@ -1468,7 +2724,7 @@ void client_http_post(char *urlbuf, char *hoststr, char *additionalheaderline, p
         client_postval=postval;
         browsertype=1;
         client_browser_callback=callback;
-        www_fd=client_tcp_req(&www_client_internal_result_callback,&www_client_internal_datafill_callback,80);
+        www_fd=client_tcp_stream_req(&www_client_internal_result_callback,&www_client_internal_datafill_callback,80);
 }
 #endif // WWW_client
 
@@ -1493,42 +2749,711 @@ uint8_t packetloop_icmp_checkreply(uint8_t *buf,uint8_t *ip_monitoredhost)
 }
 #endif // PING_client
 
-// return 0 to just continue in the packet loop and return the position 
-// of the tcp/udp data if there is tcp/udp data part
-uint16_t packetloop_icmp_tcp(uint8_t *buf,uint16_t plen)
+// eth+ip+tcp header without options, enough to decide if we want a packet
+#define RX_FILTER_HDR_LEN (ETH_HEADER_LEN+IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN)
+
+// decide from the headers only if packetloop_icmp_tcp or the
+// application can do anything with this packet
+static uint8_t packet_is_wanted(uint8_t *buf,uint16_t len)
+{
+        if(eth_type_is_arp_and_my_ip(buf,len)){
+                return(1);
+        }
+        if(eth_type_is_ip_and_my_ip(buf,len)){
+                if (buf[IP_PROTO_P]!=IP_PROTO_TCP_V){
+                        return(1);
+                }
+                if (len<RX_FILTER_HDR_LEN){
+                        return(0);
+                }
+                if (buf[TCP_DST_PORT_H_P]==wwwport_h && buf[TCP_DST_PORT_L_P]==wwwport_l){
+                        return(1);
+                }
+#if defined (TCP_client)
+                if (buf[TCP_DST_PORT_H_P]==TCPCLIENT_SRC_PORT_H){
+                        return(1);
+                }
+#endif
+                return(0);
+        }
+#ifdef MULTICAST_GROUPS
+        if (eth_type_is_ip_and_my_group(buf,len)){
+                return(1);
+        }
+#endif
+#ifdef UDP_client
+        // dhcp answers may be broadcast and arrive before we have an ip
+        if (len>=UDP_DATA_P && buf[ETH_TYPE_H_P]==ETHTYPE_IP_H_V && buf[ETH_TYPE_L_P]==ETHTYPE_IP_L_V
+            && buf[IP_PROTO_P]==IP_PROTO_UDP_V && buf[UDP_DST_PORT_H_P]==0 && buf[UDP_DST_PORT_L_P]==68){
+                return(1);
+        }
+#endif
+        return(0);
+}
+
+// Use this instead of enc28j60PacketReceive to avoid copying packets
+// over SPI which would be thrown away anyhow:
+// dat_p=packetloop_icmp_tcp(buf,packet_receive_filtered(buf,BUFFER_SIZE));
+//
+// Only the ethernet, ip and tcp headers are read first. Packets that
+// are not arp or ip for us, tcp packets for ports we do not serve and
+// other traffic are dropped in chip memory. Returns the length of the
+// packet copied into buf or zero if there was none for us.
+uint16_t packet_receive_filtered(uint8_t *buf,uint16_t maxlen)
+{
+        uint16_t len;
+        uint16_t hlen;
+        len=enc28j60PacketBegin();
+        if (len==0){
+                return(0);
+        }
+        if (len>maxlen-1){
+                len=maxlen-1;
+        }
+        hlen=len;
+        if (hlen>RX_FILTER_HDR_LEN){
+                hlen=RX_FILTER_HDR_LEN;
+        }
+        enc28j60PacketRead(0,hlen,buf);
+        if (!packet_is_wanted(buf,len)){
+                enc28j60PacketRelease();
+                return(0);
+        }
+        if (len>hlen){
+                enc28j60PacketRead(hlen,len-hlen,&buf[hlen]);
+        }
+        enc28j60PacketRelease();
+        return(len);
+}
+
+// connection the tcp segment in buf belongs to or 0 if we have none.
+// Connections that were in TIME_WAIT long enough are freed on the way.
+static tcpConnection *tcp_conn_find(uint8_t *buf)
+{
+        tcpConnection *c;
+        tcpConnection *found=0;
+        uint8_t i=0;
+        while(i<TCP_SERVER_CONNECTIONS){
+                c=&tcp_conn[i];
+                if (c->state==TCP_STATE_TIME_WAIT && millis()-c->lastActivity>TCP_TIME_WAIT_MS){
+                        tcp_conn_event(c,TCP_EV_TIMEOUT);
+                }
+                if (c->state!=TCP_STATE_CLOSED
+                    && c->port[0]==buf[TCP_SRC_PORT_H_P] && c->port[1]==buf[TCP_SRC_PORT_L_P]
+                    && check_ip_message_is_from(buf,c->ip)){
+                        found=c;
+                }
+                i++;
+        }
+        return(found);
+}
+
+// a free slot for a new connection. If there is none then a connection
+// in TIME_WAIT is reused, otherwise the one idle for the longest time.
+// On a tie the lowest slot wins.
+static tcpConnection *tcp_conn_alloc(void)
+{
+        tcpConnection *c;
+        tcpConnection *victim=&tcp_conn[0];
+        uint8_t i=0;
+        while(i<TCP_SERVER_CONNECTIONS){
+                c=&tcp_conn[i];
+                if (c->state==TCP_STATE_CLOSED){
+                        return(c);
+                }
+                if (c->state==TCP_STATE_TIME_WAIT && victim->state!=TCP_STATE_TIME_WAIT){
+                        victim=c;
+                }else if ((c->state==TCP_STATE_TIME_WAIT)==(victim->state==TCP_STATE_TIME_WAIT)
+                    && SEQ_LT(c->lastActivity,victim->lastActivity)){
+                        victim=c;
+                }
+                i++;
+        }
+        return(victim);
+}
+
+// largest amount of data the application's buffer takes in one segment
+static uint16_t www_multi_maxlen;
+
+// Send as much of the multi segment reply on connection c as the
+// window of the peer allows. Returns 1 if something was sent.
+static uint8_t www_server_send_more(uint8_t *buf,tcpConnection *c)
+{
+        uint32_t inflight;
+        uint16_t maxlen;
+        uint16_t dlen;
+        uint8_t last;
+        uint8_t sent=0;
+        // the generator is kept until the connection is gone so that
+        // lost segments can be made again, the FIN ends the sending
+        while(c->datafill && (c->state==TCP_STATE_ESTABLISHED || c->state==TCP_STATE_CLOSE_WAIT)){
+                inflight=c->snd_nxt-c->snd_una;
+                if (inflight>=c->snd_wnd){
+                        break;
+                }
+                maxlen=c->mss;
+                if (c->snd_wnd-inflight<maxlen){
+                        maxlen=c->snd_wnd-inflight;
+                }
+                if (www_multi_maxlen<maxlen){
+                        maxlen=www_multi_maxlen;
+                }
+                tcp_conn_head(buf,c);
+                last=0;
+                dlen=(*c->datafill)(c-tcp_conn,buf,c->snd_nxt-c->page_seq,maxlen,&last);
+                if (dlen>maxlen){
+                        dlen=maxlen;
+                }
+                buf[TCP_FLAGS_P]=TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V;
+                if (last || dlen==0){
+                        // the reply is complete, close our side with it
+                        buf[TCP_FLAGS_P]|=TCP_FLAGS_FIN_V;
+                }
+                tcp_conn_cur=c;
+                make_tcp_ack_with_data_noflags(buf,dlen);
+                sent=1;
+        }
+        tcp_conn_cur=0;
+        return(sent);
+}
+
+// Answer the request packetloop_icmp_tcp has just returned with a reply
+// of any length. Instead of filling buf once the application provides
+// a generator which is called for every segment:
+//
+// uint16_t your_datafill(uint8_t fd,uint8_t *buf,uint16_t offset,uint16_t maxlen,uint8_t *last){
+//      ...fill up to maxlen bytes of the reply starting at byte offset
+//      into buf with fill_tcp_data_p(buf,0,...) etc, set *last=1 if
+//      that is the end of the reply, return the number of bytes filled in
+// }
+// www_server_reply_multi(buf,BUFFER_SIZE,&your_datafill);
+//
+// As many segments as the window of the browser allows are sent at once,
+// the rest follows from packetloop_icmp_tcp as the acks come in. A
+// segment can be requested again with an offset used before if it has
+// to be repeated, so the generator must always produce the same bytes
+// for the same offset. fd identifies the connection (0 to
+// TCP_SERVER_CONNECTIONS-1), bufsize is the size of buf which must also
+// be the buffer you pass to packetloop_icmp_tcp.
+void www_server_reply_multi(uint8_t *buf,uint16_t bufsize,uint16_t (*datafill)(uint8_t fd,uint8_t *buf,uint16_t offset,uint16_t maxlen,uint8_t *last))
+{
+        tcpConnection *c=tcp_conn_cur;
+        if (c==0 || bufsize<=TCP_DATA_P){
+                return;
+        }
+        www_multi_maxlen=bufsize-TCP_DATA_P;
+        c->datafill=datafill;
+        c->page_seq=c->snd_nxt;
+        if (!www_server_send_more(buf,c)){
+                // no window, at least acknowledge the request
+                tcp_conn_reply(buf,c,0);
+        }
+}
+
+// go back to the oldest unacknowledged byte to send everything again
+static void tcp_conn_rewind(tcpConnection *c)
+{
+        c->snd_nxt=c->snd_una;
+        tcp_conn_release(c);
+        tcp_conn_event(c,TCP_EV_RESEND);
+}
+
+#if defined (TCP_client)
+// send the request of the tcp client, the datafill callback of the
+// application fills it in
+static void tcp_client_send_request(uint8_t *buf)
+{
+        tcpConnection *c=&tcp_client_conn;
+        uint16_t len=0;
+        tcp_conn_head(buf,c);
+#if defined (WWW_client)
+        bufptr=buf;
+#endif
+        if (client_tcp_datafill_callback){
+                len=(*client_tcp_datafill_callback)((c->lport[1]>>5)&0x7);
+        }
+        buf[TCP_FLAGS_P]=TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V;
+        tcp_conn_cur=c;
+        make_tcp_ack_with_data_noflags(buf,len);
+        tcp_conn_cur=0;
+}
+
+// send the request again, it is made again by the datafill callback
+static void tcp_client_resend(uint8_t *buf)
+{
+        tcpConnection *c=&tcp_client_conn;
+        if (c->snd_una!=c->page_seq){
+                // part of it has arrived, we can not make the rest
+                return;
+        }
+        tcp_conn_rewind(c);
+        if (c->state==TCP_STATE_ESTABLISHED){
+                tcp_client_send_request(buf);
+        }
+}
+
+// hand received data or a status to the application. Returns 1 if
+// the application wants to close the connection.
+static uint8_t tcp_client_deliver(uint8_t statuscode,uint16_t pos,uint16_t len,uint8_t more)
+{
+        tcpConnection *c=&tcp_client_conn;
+        uint8_t fd=(c->lport[1]>>5)&0x7;
+        uint16_t wnd;
+        if (client_tcp_stream_callback){
+                wnd=(*client_tcp_stream_callback)(fd,statuscode,pos,len,c->rcv_nxt-tcp_client_rcv_start,more);
+                if (wnd==TCP_CLIENT_CLOSE){
+                        return(1);
+                }
+                c->rcv_wnd=wnd;
+                return(0);
+        }
+        if (client_tcp_result_callback && (len || statuscode)){
+                return((*client_tcp_result_callback)(fd,statuscode,pos,len));
+        }
+        return(0);
+}
+#endif
+
+// the peer did not answer for too long, reset the connection
+static void tcp_conn_abort(uint8_t *buf,tcpConnection *c)
+{
+        if (c->state!=TCP_STATE_SYN_SENT){
+                tcp_conn_reply(buf,c,TCP_FLAGS_RST_V);
+        }
+        tcp_conn_event(c,TCP_EV_TIMEOUT);
+#if defined (TCP_client)
+        if (c==&tcp_client_conn){
+                // statuscode 4: timeout
+                tcp_client_deliver(4,0,0,0);
+        }
+#endif
+}
+
+// send again what connection c has sent but not got acknowledged
+static void tcp_conn_retransmit(uint8_t *buf,tcpConnection *c)
 {
+        if (c->state==TCP_STATE_SYN_SENT || c->state==TCP_STATE_SYN_RECEIVED){
+                tcp_conn_syn(buf,c);
+                return;
+        }
+        if (c->snd_nxt-c->snd_una==1 && (c->state==TCP_STATE_FIN_WAIT_1
+            || c->state==TCP_STATE_CLOSING || c->state==TCP_STATE_LAST_ACK)){
+                // just our FIN is missing
+                c->snd_nxt=c->snd_una;
+                tcp_conn_reply(buf,c,TCP_FLAGS_FIN_V);
+                return;
+        }
+#if defined (TCP_client)
+        if (c==&tcp_client_conn){
+                tcp_client_resend(buf);
+                return;
+        }
+#endif
+        if (c->txheld){
+                // the reply of www_server_reply is still in its transmit slot
+                enc28j60TxResend(c->txheld);
+                return;
+        }
+        if (c->datafill){
+                tcp_conn_rewind(c);
+                www_server_send_more(buf,c);
+                return;
+        }
+        if (c->state==TCP_STATE_FIN_WAIT_1 || c->state==TCP_STATE_CLOSING
+            || c->state==TCP_STATE_LAST_ACK){
+                // No transmit slot was free to keep the reply (e.g. with
+                // ENC28J60_TX_SLOTS 1), its data is gone. Send the FIN
+                // again from SND.NXT so the peer at least learns how
+                // much it is missing before we give up.
+                c->snd_nxt--;
+                tcp_conn_reply(buf,c,TCP_FLAGS_FIN_V);
+        }
+}
+
+// check the retransmission timer of connection c
+static void tcp_conn_timer(uint8_t *buf,tcpConnection *c)
+{
+        if (c->state==TCP_STATE_CLOSED || c->state==TCP_STATE_TIME_WAIT || c->snd_una==c->snd_nxt){
+                return;
+        }
+        if ((uint16_t)((uint16_t)millis()-c->rtx_start) < c->rto){
+                return;
+        }
+        if (c->retries>=TCP_MAX_RETRIES){
+                tcp_conn_abort(buf,c);
+                return;
+        }
+        c->retries++;
+        c->timing=0;
+        // exponential backoff
+        if (c->rto<TCP_RTO_MAX/2){
+                c->rto<<=1;
+        }else{
+                c->rto=TCP_RTO_MAX;
+        }
+        c->rtx_start=millis();
+        tcp_conn_retransmit(buf,c);
+}
+
+// handle a segment for the web server port. Returns the position of
+// the request data if the application has to answer it.
+static uint16_t www_server_segment(uint8_t *buf,uint16_t plen)
+{
+        tcpConnection *c;
+        uint32_t seq;
+        uint32_t ack;
         uint16_t len;
+        uint8_t i;
+        uint8_t flags=buf[TCP_FLAGS_P];
+
+        c=tcp_conn_find(buf);
+        tcp_conn_last=c;
+        if (flags & TCP_FLAGS_RST_V){
+                if (c){
+                        tcp_conn_event(c,TCP_EV_RST);
+                }
+                return(0);
+        }
+        seq=get_seq(&buf[TCP_SEQ_H_P]);
+        if (flags & TCP_FLAGS_SYN_V){
+                if (c && c->state==TCP_STATE_SYN_RECEIVED && seq+1==c->rcv_nxt){
+                        // our syn,ack got lost, repeat it with the same sequence number
+                        tcp_conn_syn(buf,c);
+                        c->lastActivity=millis();
+                        return(0);
+                }
+                if (tcp_listen_state!=TCP_STATE_LISTEN){
+                        // nobody listens, refuse it
+                        make_tcp_ack_from_any(buf,1,TCP_FLAGS_RST_V);
+                        return(0);
+                }
+                if (c==0){
+                        c=tcp_conn_alloc();
+                }
+                tcp_conn_last=c;
+                i=0;
+                while(i<6){
+                        c->mac[i]=buf[ETH_SRC_MAC+i];
+                        if (i<4){
+                                c->ip[i]=buf[IP_SRC_P+i];
+                        }
+                        i++;
+                }
+                c->port[0]=buf[TCP_SRC_PORT_H_P];
+                c->port[1]=buf[TCP_SRC_PORT_L_P];
+                c->lport[0]=wwwport_h;
+                c->lport[1]=wwwport_l;
+                c->mss=tcp_get_mss(buf);
+                c->snd_wnd=get_window(buf);
+                c->rcv_wnd=0x400; // 1024
+                c->datafill=0;
+                c->state=TCP_STATE_LISTEN;
+                tcp_conn_event(c,TCP_EV_SYN);
+                tcp_conn_init(c,tcp_new_isn());
+                c->rcv_nxt=seq+1;
+                c->lastActivity=millis();
+                tcp_conn_syn(buf,c);
+                tcp_conn_advance(c,1);
+                return(0);
+        }
+        if ((flags & TCP_FLAGS_ACK_V)==0){
+                return(0);
+        }
+        len=get_tcp_data_len(buf);
+        if (c==0){
+                // we do not know (any more) about this connection
+                if (flags & TCP_FLAGS_FIN_V){
+                        len++;
+                }
+                make_tcp_ack_from_any(buf,len,TCP_FLAGS_RST_V);
+                return(0);
+        }
+        c->lastActivity=millis();
+        ack=get_seq(&buf[TCP_SEQACK_H_P]);
+        tcp_conn_acked(c,ack);
+        if (ack==c->snd_una){
+                c->snd_wnd=get_window(buf);
+        }
+        if (c->snd_una==c->snd_nxt){
+                // everything we sent including our syn or FIN has arrived
+                tcp_conn_event(c,TCP_EV_ACK);
+                if (c->state==TCP_STATE_CLOSED){
+                        return(0);
+                }
+        }else if (c->state==TCP_STATE_SYN_RECEIVED){
+                return(0);
+        }
+        if (seq!=c->rcv_nxt){
+                if (len && (c->state==TCP_STATE_ESTABLISHED || c->state==TCP_STATE_FIN_WAIT_1)
+                    && seq+len==c->rcv_nxt && ack==c->snd_una){
+                        // The request is repeated and nothing of our answer
+                        // has arrived (if there was one). Let the application
+                        // answer again.
+                        if (c->datafill){
+                                // a multi segment reply is still running,
+                                // go back and send it again from SND.UNA
+                                tcp_conn_rewind(c);
+                                if (!www_server_send_more(buf,c)){
+                                        tcp_conn_reply(buf,c,0);
+                                }
+                                return(0);
+                        }
+                        tcp_conn_rewind(c);
+                        c->rcv_nxt=seq;
+                }else{
+                        // duplicate or out of order, tell what we expect
+                        tcp_conn_reply(buf,c,0);
+                        return(0);
+                }
+        }
+        if (len==0){
+                if ((flags & TCP_FLAGS_FIN_V)==0){
+                        // just an ack with no data, it may have opened
+                        // the window for more of a multi segment reply
+                        www_server_send_more(buf,c);
+                        return(0);
+                }
+                c->rcv_nxt++;
+                tcp_conn_event(c,TCP_EV_FIN);
+                if (c->state==TCP_STATE_CLOSE_WAIT){
+                        if (c->datafill){
+                                // the peer is done sending but still reads the reply
+                                if (!www_server_send_more(buf,c)){
+                                        tcp_conn_reply(buf,c,0);
+                                }
+                                return(0);
+                        }
+                        // nothing more to say, close our side too
+                        tcp_conn_reply(buf,c,TCP_FLAGS_FIN_V);
+                        return(0);
+                }
+                tcp_conn_reply(buf,c,0);
+                return(0);
+        }
+        if (c->state!=TCP_STATE_ESTABLISHED){
+                // we have closed our side and can not answer any more
+                c->rcv_nxt+=len;
+                tcp_conn_reply(buf,c,0);
+                return(0);
+        }
+        // i is now the position of the start of the tcp user data
+        i=TCP_DATA_START; // TCP_DATA_START is a formula
+        // check for data corruption
+        if (i>plen-8){
+                return(0);
+        }
+        c->rcv_nxt+=len;
+        info_data_len=len;
+        if (flags & TCP_FLAGS_FIN_V){
+                c->rcv_nxt++;
+                info_data_len++;
+                tcp_conn_event(c,TCP_EV_FIN);
+        }
+        // the answer continues where we are in our sequence space,
+        // make_tcp_ack_from_any takes the number from here
+        put_seq(&buf[TCP_SEQACK_H_P],c->snd_nxt);
+        c->datafill=0;
+        tcp_conn_cur=c;
+        return(i);
+}
+
 #if defined (TCP_client)
-        uint8_t send_fin=0;
+// send the syn of an active open once we know the mac of the next hop
+static void tcp_client_connect(uint8_t *buf)
+{
+        if (tcp_client_conn.state==TCP_STATE_SYN_SENT && tcp_client_conn.snd_una==tcp_client_conn.snd_nxt
+            && arp_next_hop(tcpsrvip)){
+                tcpclient_src_port_l++; // allocate a new port
+                // we encode our 3 bit fd into the src port this
+                // way we get it back in every message that comes
+                // from the server:
+                client_syn(buf,((tcp_fd<<5) | (0x1f & tcpclient_src_port_l)),tcp_client_port_h,tcp_client_port_l);
+        }
+}
+
+// handle a segment for the tcp client. Data is handed to the result
+// callback segment by segment in sequence order, anything out of order
+// is dropped and the server is told again what we expect.
+static uint16_t tcp_client_segment(uint8_t *buf,uint16_t plen)
+{
+        tcpConnection *c=&tcp_client_conn;
+        uint32_t seq;
+        uint16_t len;
         uint16_t tcpstart;
-        uint16_t save_len;
+        uint8_t flags=buf[TCP_FLAGS_P];
+        uint8_t fin;
+        uint8_t close=0;
+        uint8_t i;
+#if defined (WWW_client)
+        // workaround to pass pointer to www_client_internal..
+        bufptr=buf; 
+#endif // WWW_client
+        if (check_ip_message_is_from(buf,tcpsrvip)==0){
+                return(0);
+        }
+        if (buf[TCP_DST_PORT_L_P]!=c->lport[1] || buf[TCP_SRC_PORT_H_P]!=c->port[0]
+            || buf[TCP_SRC_PORT_L_P]!=c->port[1]){
+                // left over from an earlier connection
+                return(0);
+        }
+        tcp_conn_last=c;
+        // if we get a reset:
+        if (flags & TCP_FLAGS_RST_V){
+#ifdef ETHERSHIELD_DEBUG
+                ethershieldDebug( "RST: Calling tcp client callback\n");
 #endif
+                tcp_client_deliver(3,0,0,0);
+                tcp_conn_event(c,TCP_EV_RST);
+                return(0);
+        }
+        if (flags & TCP_FLAGS_ACK_V){
+                tcp_conn_acked(c,get_seq(&buf[TCP_SEQACK_H_P]));
+                c->snd_wnd=get_window(buf);
+                if (c->snd_una==c->snd_nxt){
+                        // our FIN has arrived
+                        tcp_conn_event(c,TCP_EV_ACK);
+                }
+        }
+        len=get_tcp_data_len(buf);
+        seq=get_seq(&buf[TCP_SEQ_H_P]);
+        if (c->state==TCP_STATE_SYN_SENT){
+                if ((flags & TCP_FLAGS_SYN_V) && (flags & TCP_FLAGS_ACK_V) && c->snd_una==c->snd_nxt){
+#ifdef ETHERSHIELD_DEBUG
+                        ethershieldDebug( "Got SYNACK\n");
+#endif
+                        c->rcv_nxt=seq+1;
+                        tcp_client_rcv_start=c->rcv_nxt;
+                        tcp_conn_event(c,TCP_EV_SYN_ACK);
+                        i=0;
+                        while(i<6){
+                                c->mac[i]=buf[ETH_SRC_MAC+i];
+                                i++;
+                        }
+                        tcp_tmpl_drop(c);
+                        // the request starts here, a lost one is made again from it.
+                        // It also acknowledges the syn,ack.
+                        c->page_seq=c->snd_nxt;
+                        tcp_client_send_request(buf);
+                        return(0);
+                }
+                // reset only if we have sent a syn and don't get syn-ack back.
+                // If we connect to a non listen port then we get a RST
+                // which will be handeled above. In other words there is
+                // normally no danger for an endless loop.
+                // retry with a new syn from a new port
+                c->snd_nxt=c->snd_una;
+                // do not inform application layer as we retry.
+                len++;
+                if (flags & TCP_FLAGS_ACK_V){
+                        // if packet was an ack then do not step the ack number
+                        len=0;
+                }
+                // refuse and reset the connection
+                make_tcp_ack_from_any(buf,len,TCP_FLAGS_RST_V);
+                return(0);
+        }
+        if (c->state<TCP_STATE_ESTABLISHED){
+                // CLOSED, LISTEN, SYN_SENT or SYN_RECEIVED: no data yet
+                return(0);
+        }
+        fin=flags & TCP_FLAGS_FIN_V;
+        if (len==0 && !fin){
+                // just an ack
+                return(0);
+        }
+        if (seq!=c->rcv_nxt || c->state==TCP_STATE_CLOSE_WAIT || c->state==TCP_STATE_LAST_ACK
+            || c->state==TCP_STATE_CLOSING || c->state==TCP_STATE_TIME_WAIT){
+                // out of order, a repetition or after the server's FIN:
+                // drop it and tell what we expect (dup-ack)
+                tcp_conn_reply(buf,c,0);
+                return(0);
+        }
+        if (len){
+                tcpstart=TCP_DATA_START; // TCP_DATA_START is a formula
+                // out of buffer bounds check, needed in case of fragmented IP packets
+                if (tcpstart>=plen){
+                        // we can not deliver it, let the server repeat it
+                        return(0);
+                }
+                if (tcpstart+len>plen){
+                        len=plen-tcpstart;
+                        fin=0;
+                }
+                if (c->state==TCP_STATE_ESTABLISHED){
+#ifdef ETHERSHIELD_DEBUG
+                        ethershieldDebug( "Calling Result callback\n");
+#endif
+                        close=tcp_client_deliver(0,tcpstart,len,!fin);
+                }
+                c->rcv_nxt+=len;
+        }else if (c->state==TCP_STATE_ESTABLISHED){
+                // the server is done, tell the application it has it all
+                close=tcp_client_deliver(0,0,0,0);
+        }
+        if (fin){
+                c->rcv_nxt++;
+                tcp_conn_event(c,TCP_EV_FIN);
+        }
+        if (c->state!=TCP_STATE_ESTABLISHED && c->state!=TCP_STATE_CLOSE_WAIT){
+                // we have closed our side already
+                tcp_conn_reply(buf,c,0);
+                return(0);
+        }
+        if (close || fin){
+#ifdef ETHERSHIELD_DEBUG
+                ethershieldDebug( "Send FIN\n");
+#endif
+                // ack and close our side too
+                tcp_conn_reply(buf,c,TCP_FLAGS_FIN_V);
+                return(0);
+        }
+        tcp_conn_reply(buf,c,0);
+        return(0);
+}
+#endif // TCP_client
 
+// return 0 to just continue in the packet loop and return the position 
+// of the tcp/udp data if there is tcp/udp data part
+uint16_t packetloop_icmp_tcp(uint8_t *buf,uint16_t plen)
+{
+        uint8_t i;
+
+        // a reply from the application belongs to the request returned last
+        tcp_conn_cur=0;
         //plen will be unequal to zero if there is a valid 
         // packet (without crc error):
-#if defined (NTP_client) ||  defined (UDP_client) || defined (TCP_client) || defined (PING_client)
         if(plen==0){
-                if ((waitgwmac & WGW_INITIAL_ARP||waitgwmac & WGW_REFRESHING) && delaycnt==0 && enc28j60linkup()){
-                        client_arp_whohas(buf,gwip);
+                // nothing received, time to look after the retransmission timers
+                i=0;
+                while(i<TCP_SERVER_CONNECTIONS){
+                        tcp_conn_timer(buf,&tcp_conn[i]);
+                        i++;
                 }
-                delaycnt++;
 #if defined (TCP_client)
-                if (tcp_client_state==1  && (waitgwmac & WGW_HAVE_GW_MAC)){ // send a syn
-                        tcp_client_state= 2;
-                        tcpclient_src_port_l++; // allocate a new port
-                        // we encode our 3 bit fd into the src port this
-                        // way we get it back in every message that comes
-                        // from the server:
-                        client_syn(buf,((tcp_fd<<5) | (0x1f & tcpclient_src_port_l)),tcp_client_port_h,tcp_client_port_l);
+                tcp_conn_timer(buf,&tcp_client_conn);
+                if (tcp_client_wnd_update){
+                        tcp_client_wnd_update=0;
+                        if (tcp_client_conn.state==TCP_STATE_ESTABLISHED){
+                                tcp_conn_reply(buf,&tcp_client_conn,0);
+                        }
                 }
 #endif
+#if defined (NTP_client) ||  defined (UDP_client) || defined (TCP_client) || defined (PING_client)
+                arp_cache_poll(buf);
+#if defined (TCP_client)
+                tcp_client_connect(buf);
+#endif
+#endif // NTP_client||UDP_client||TCP_client||PING_client
                 return(0);
         }
-#endif // NTP_client||UDP_client||TCP_client||PING_client
         // arp is broadcast if unknown but a host may also
         // verify the mac address by sending it to 
         // a unicast address.
         if(eth_type_is_arp_and_my_ip(buf,plen)){
+#if defined (NTP_client) || defined (UDP_client) || defined (TCP_client) || defined (PING_client)
+                // whoever talks to us may have a new mac
+                arp_cache_store(buf);
+#endif // NTP_client||UDP_client||TCP_client||PING_client
                 if (buf[ETH_ARP_OPCODE_L_P]==ETH_ARP_OPCODE_REQ_L_V){
                         // is it an arp request 
                         make_arp_answer_from_request(buf);
@@ -1538,30 +3463,31 @@ uint16_t packetloop_icmp_tcp(uint8_t *buf,uint16_t plen)
                         // is it an arp reply 
                         if (client_store_gw_mac(buf)){
                                 waitgwmac=WGW_HAVE_GW_MAC;
+                                gw_arp_stamp=millis();
                         }
                 }
 #endif // NTP_client||UDP_client||TCP_client||PING_client
                 return(0);
 
         }
+#ifdef MULTICAST_GROUPS
+        // udp to a joined group is for a socket or the application
+        if (eth_type_is_ip_and_my_group(buf,plen)){
+#ifdef UDP_SOCKETS
+                if (udp_socket_input(buf,plen)){
+                        return(0);
+                }
+#endif
+                return(UDP_DATA_P);
+        }
+#endif
         // check if ip packets are for us:
         if(eth_type_is_ip_and_my_ip(buf,plen)==0){
                 return(0);
         }
-#ifdef NTP_client
-        // TODO - does this work?
-        // If NTP response, drop out to have it processed elsewhere
-        if(buf[IP_PROTO_P] == IP_PROTO_UDP_V && buf[UDP_SRC_PORT_H_P]==0 && buf[UDP_SRC_PORT_L_P]==0x7b ) {
-                return( UDP_DATA_P );
-        }
-#endif // NTP_client
-#ifdef DNS_client
-        // TODO - does this work?
-        // If DNS response, drop out to have it processed elsewhere
-        if(buf[IP_PROTO_P] == IP_PROTO_UDP_V && buf[UDP_SRC_PORT_H_P]==0 && buf[UDP_SRC_PORT_L_P]== 53 ) {
-                return( UDP_DATA_P );
+        if(buf[IP_PROTO_P]==IP_PROTO_UDP_V){
+                return(udp_dispatch(buf,plen));
         }
-#endif
 
         if(buf[IP_PROTO_P]==IP_PROTO_ICMP_V && buf[ICMP_TYPE_P]==ICMP_TYPE_ECHOREQUEST_V){
                 if (icmp_callback){
@@ -1576,208 +3502,121 @@ uint16_t packetloop_icmp_tcp(uint8_t *buf,uint16_t plen)
                 return(0);
         }
 #if  defined (TCP_client) 
-        // a message for the tcp client, client_state is zero if client was never used
+        // a message for the tcp client
         if ( buf[TCP_DST_PORT_H_P]==TCPCLIENT_SRC_PORT_H){
-#if defined (WWW_client)
-                // workaround to pass pointer to www_client_internal..
-                bufptr=buf; 
-#endif // WWW_client
-                if (check_ip_message_is_from(buf,tcpsrvip)==0){
-                        return(0);
-                }
-                // if we get a reset:
-                if (buf[TCP_FLAGS_P] & TCP_FLAGS_RST_V){
-                        if (client_tcp_result_callback){
-#ifdef ETHERSHIELD_DEBUG
-                                ethershieldDebug( "RST: Calling tcp client callback\n");
-#endif
-                                // parameters in client_tcp_result_callback: fd, status, buf_start, len
-                                (*client_tcp_result_callback)((buf[TCP_DST_PORT_L_P]>>5)&0x7,3,0,0);
-                        }
-                        tcp_client_state=5;
-                        return(0);
-                }
-
-
-                // Determine what to do with packed depending on state
- 
-                len=get_tcp_data_len(buf);
-                if (tcp_client_state== 2){
-                        if ((buf[TCP_FLAGS_P] & TCP_FLAGS_SYN_V) && (buf[TCP_FLAGS_P] &TCP_FLAGS_ACK_V)){
-#ifdef ETHERSHIELD_DEBUG
-                                ethershieldDebug( "Got SYNACK\n");
-#endif
-                                // synack, answer with ack
-                                make_tcp_ack_from_any(buf,0,0);
-                                buf[TCP_FLAGS_P]=TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V;
-
-                                // Make a tcp message with data. When calling this function we must
-                                // still have a valid tcp-ack in the buffer. In other words
-                                // you have just called make_tcp_ack_from_any(buf,0).
-                                if (client_tcp_datafill_callback){
-#ifdef ETHERSHIELD_DEBUG
-                                        ethershieldDebug( "Datafil Callback\n");
-#endif
-                                        // in this case it is src port because the above 
-                                        // make_tcp_ack_from_any swaps the dst and src port:
-                                        len=(*client_tcp_datafill_callback)((buf[TCP_SRC_PORT_L_P]>>5)&0x7);
-                                }else{
-                                        // this is just to prevent a crash
-                                        len=0;
-                                }
-                                tcp_client_state=3;
-                                make_tcp_ack_with_data_noflags(buf,len);
-#ifdef ETHERSHIELD_DEBUG
-                                ethershieldDebug( "Send ACK\n");
-#endif
-                                return(0);
-                        }else{
-                                // reset only if we have sent a syn and don't get syn-ack back.
-                                // If we connect to a non listen port then we get a RST
-                                // which will be handeled above. In other words there is
-                                // normally no danger for an endless loop.
-                                tcp_client_state=1; // retry
-                                // do not inform application layer as we retry.
-                                len++;
-                                if (buf[TCP_FLAGS_P] & TCP_FLAGS_ACK_V){
-                                        // if packet was an ack then do not step the ack number
-                                        len=0;
-                                }
-                                // refuse and reset the connection
-                                make_tcp_ack_from_any(buf,len,TCP_FLAGS_RST_V);
-                                return(0);
-                        }
-                } 
-                // in tcp_client_state==3 we will normally first get an empty
-                // ack-packet and then a ack-packet with data.
-                if (tcp_client_state==4 ) {     //&& len>0){ 
-                        // our first real data packet
-#ifdef ETHERSHIELD_DEBUG
-//                        ethershieldDebug( "First Data Packet\n");
-#endif
-                        // Removed this as there is no code to handle state 4. Only 1st packet will be available.
-                        //tcp_client_state=4;
-                        // return the data we received
-                        if (client_tcp_result_callback){
-                                tcpstart=TCP_DATA_START; // TCP_DATA_START is a formula
-                                // out of buffer bounds check, needed in case of fragmented IP packets
-                                if (tcpstart>plen-8){
-                                        tcpstart=plen-8; // dummy but save
-                                }
-                                save_len=len;
-                                if (tcpstart+len>plen){
-                                        save_len=plen-tcpstart;
-                                }
-#ifdef ETHERSHIELD_DEBUG
-                                ethershieldDebug( "Calling Result callback\n");
-#endif
-                                send_fin=(*client_tcp_result_callback)((buf[TCP_DST_PORT_L_P]>>5)&0x7,0,tcpstart,save_len);
-
-                        }
-                        if (send_fin){
-#ifdef ETHERSHIELD_DEBUG
-                                ethershieldDebug( "Send FIN\n");
-#endif
-                                make_tcp_ack_from_any(buf,len,TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
-                                tcp_client_state=5;
-                                return(0);
-                        }
-                        make_tcp_ack_from_any(buf,len,0);
-                        return(0);
-                } 
-                if (tcp_client_state==3) {      // && len>0){ 
-                        // our first real data packet
-#ifdef ETHERSHIELD_DEBUG
-//                        ethershieldDebug( "First Data Packet\n");
-#endif
-                        // Removed this as there is no code to handle state 4. Only 1st packet will be available.
-                        tcp_client_state=4;
-                        // return the data we received
-                        if (client_tcp_result_callback){
-                                tcpstart=TCP_DATA_START; // TCP_DATA_START is a formula
-                                // out of buffer bounds check, needed in case of fragmented IP packets
-                                if (tcpstart>plen-8){
-                                        tcpstart=plen-8; // dummy but save
-                                }
-                                save_len=len;
-                                if (tcpstart+len>plen){
-                                        save_len=plen-tcpstart;
-                                }
-#ifdef ETHERSHIELD_DEBUG
-                                ethershieldDebug( "Calling Result callback\n");
-#endif
-                                send_fin=(*client_tcp_result_callback)((buf[TCP_DST_PORT_L_P]>>5)&0x7,0,tcpstart,save_len);
-
-                        }
-                        if (send_fin){
-#ifdef ETHERSHIELD_DEBUG
-                                ethershieldDebug( "Send FIN\n");
-#endif
-                                make_tcp_ack_from_any(buf,len,TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
-                                tcp_client_state=5;
-                                return(0);
-                        }
-                        make_tcp_ack_from_any(buf,len,0);
-                        return(0);
-                }
-                if(tcp_client_state==5){
-                        // no more ack
-#ifdef ETHERSHIELD_DEBUG
-                        ethershieldDebug( "No more ACK\n");
-#endif
-                        return(0);
-                }
-                if (buf[TCP_FLAGS_P] & TCP_FLAGS_FIN_V){
-#ifdef ETHERSHIELD_DEBUG
-                        ethershieldDebug( "Terminated\n");
-#endif
-                        make_tcp_ack_from_any(buf,len+1,TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
-                        tcp_client_state=5; // connection terminated
-                        return(0);
-                }
-                // ack all data (the web page may be long):
-                // if we just get a fragment then len will be zero
-                // and we ack only once we have the full packet
-                if (len>0){
-                        make_tcp_ack_from_any(buf,len,0);
-#ifdef ETHERSHIELD_DEBUG
-                        ethershieldDebug( "Send ACK\n");
-#endif
-                }
-                return(0);
+                return(tcp_client_segment(buf,plen));
         }
 #endif // WWW_client||TCP_client
         //
         // tcp port web server start
         if (buf[TCP_DST_PORT_H_P]==wwwport_h && buf[TCP_DST_PORT_L_P]==wwwport_l){
-                if (buf[TCP_FLAGS_P] & TCP_FLAGS_SYN_V){
-                        make_tcp_synack_from_syn(buf);
-                        // make_tcp_synack_from_syn does already send the syn,ack
-                        return(0);
+                return(www_server_segment(buf,plen));
+        }
+        return(0);
+}
+
+// The state the connection that the tcp segment in buf belongs to
+// moves to when packetloop_icmp_tcp handles it. Nothing is changed,
+// this is to look ahead or to test the state machine.
+uint8_t nextTcpState(uint8_t *buf,uint16_t plen)
+{
+        tcpConnection *c=0;
+        uint8_t state=TCP_STATE_CLOSED;
+        uint8_t flags;
+        if(!eth_type_is_ip_and_my_ip(buf,plen) || buf[IP_PROTO_P]!=IP_PROTO_TCP_V){
+                return(state);
+        }
+#if defined (TCP_client)
+        if (buf[TCP_DST_PORT_H_P]==TCPCLIENT_SRC_PORT_H && buf[TCP_DST_PORT_L_P]==tcp_client_conn.lport[1]){
+                c=&tcp_client_conn;
+                state=c->state;
+        }
+#endif
+        if (buf[TCP_DST_PORT_H_P]==wwwport_h && buf[TCP_DST_PORT_L_P]==wwwport_l){
+                c=tcp_conn_find(buf);
+                state=tcp_listen_state;
+                if (c){
+                        state=c->state;
                 }
-                if (buf[TCP_FLAGS_P] & TCP_FLAGS_ACK_V){
-                        info_data_len=get_tcp_data_len(buf);
-                        // we can possibly have no data, just ack:
-                        // Here we misuse plen for something else to save a variable.
-                        // plen is now the position of start of the tcp user data.
-                        if (info_data_len==0){
-                                if (buf[TCP_FLAGS_P] & TCP_FLAGS_FIN_V){
-                                        // finack, answer with ack
-                                        make_tcp_ack_from_any(buf,0,0);
-                                }
-                                // just an ack with no data, wait for next packet
-                                return(0);
-                        }
-                        // Here we misuse len for something else to save a variable
-                        len=TCP_DATA_START; // TCP_DATA_START is a formula
-                        // check for data corruption
-                        if (len>plen-8){
-                                return(0);
-                        }
-                        return(len);
+        }
+        flags=buf[TCP_FLAGS_P];
+        if (flags & TCP_FLAGS_RST_V){
+                return(tcp_state_next(state,TCP_EV_RST));
+        }
+        if (flags & TCP_FLAGS_SYN_V){
+                if (flags & TCP_FLAGS_ACK_V){
+                        return(tcp_state_next(state,TCP_EV_SYN_ACK));
                 }
+                return(tcp_state_next(state,TCP_EV_SYN));
         }
-        return(0);
+        if (c && (flags & TCP_FLAGS_ACK_V) && get_seq(&buf[TCP_SEQACK_H_P])==c->snd_nxt){
+                state=tcp_state_next(state,TCP_EV_ACK);
+        }
+        if (flags & TCP_FLAGS_FIN_V){
+                state=tcp_state_next(state,TCP_EV_FIN);
+        }
+        return(state);
+}
+
+// State of the connection of the last tcp segment that arrived or of
+// the client connection if it was opened after that. Before any
+// connection it is the state of the web server port (LISTEN or CLOSED).
+uint8_t currentTcpState(void)
+{
+        if (tcp_conn_last){
+                return(tcp_conn_last->state);
+        }
+        return(tcp_listen_state);
+}
+
+#if defined (TCP_client)
+// Open a connection to the server set with client_tcp_set_serverip.
+// This is client_tcp_req but the syn is sent right away with buf if
+// we know the mac of the gateway already.
+uint8_t tcpActiveOpen(uint8_t *buf,uint16_t plen,
+        uint8_t (*result_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf, uint16_t len_of_data),
+        uint16_t (*datafill_callback)(uint8_t fd),
+        uint16_t port)
+{
+        uint8_t fd;
+        (void)plen; // buf is only needed to send the syn
+        fd=client_tcp_req(result_callback,datafill_callback,port);
+        tcp_client_connect(buf);
+        return(fd);
+}
+#endif // TCP_client
+
+// let the web server accept connections again after tcpClose
+void tcpPassiveOpen(uint8_t *buf,uint16_t plen)
+{
+        // nothing is sent, buf and plen are there to match the other calls
+        (void)buf;
+        (void)plen;
+        tcp_listen_state=tcp_state_next(tcp_listen_state,TCP_EV_PASSIVE_OPEN);
+}
+
+// Close the connection currentTcpState is about: a FIN is sent with
+// buf if the connection is established, a connection that is still
+// opening is dropped. If that connection is closed or closing already
+// then the web server stops listening, new connections are refused
+// with a reset.
+void tcpClose(uint8_t *buf,uint16_t plen)
+{
+        tcpConnection *c=tcp_conn_last;
+        uint8_t next=TCP_STATE_CLOSED;
+        (void)plen; // buf is only used to send the FIN
+        if (c){
+                next=tcp_state_next(c->state,TCP_EV_CLOSE);
+        }
+        if (c==0 || next==c->state){
+                tcp_listen_state=tcp_state_next(tcp_listen_state,TCP_EV_CLOSE);
+                return;
+        }
+        if (next==TCP_STATE_FIN_WAIT_1 || next==TCP_STATE_LAST_ACK){
+                tcp_conn_reply(buf,c,TCP_FLAGS_FIN_V);
+                return;
+        }
+        tcp_conn_event(c,TCP_EV_CLOSE);
 }
 
 /* end of ip_arp_udp.c */
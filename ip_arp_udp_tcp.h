@@ -40,11 +40,35 @@ extern void make_tcp_ack_with_data_noflags(uint8_t *buf,uint16_t dlen);
 extern void fill_buf_p(uint8_t *buf,uint16_t len, const prog_char *progmem_s);
 extern void fill_ip_hdr_checksum(uint8_t *buf);
 extern uint16_t checksum(uint8_t *buf, uint16_t len,uint8_t type);
+// RFC 1624 incremental update after a 16bit word changed from oldval to newval:
+extern uint16_t checksum_update(uint16_t ck,uint16_t oldval,uint16_t newval);
+extern void checksum_update_at(uint8_t *buf,uint16_t ckpos,uint16_t oldval,uint16_t newval);
+extern void ip_hdr_set_len(uint8_t *buf,uint16_t len);
 
 // for a UDP server:
 extern uint8_t eth_type_is_ip_and_my_ip(uint8_t *buf,uint16_t len);
 extern void make_udp_reply_from_request(uint8_t *buf,char *data,uint16_t datalen,uint16_t port);
 
+// admit only broadcasts with udp to port in the chip, 0 for arp:
+extern void packet_filter_udp_port(uint16_t port);
+#ifdef MULTICAST_GROUPS
+// receive udp packets to an ipv4 multicast group, packetloop_icmp_tcp
+// returns UDP_DATA_P for them:
+extern uint8_t multicast_join(uint8_t *groupip);
+extern uint8_t multicast_leave(uint8_t *groupip);
+extern uint8_t eth_type_is_ip_and_my_group(uint8_t *buf,uint16_t len);
+#endif
+#ifdef UDP_SOCKETS
+// receive udp datagrams to a local port through a callback, packetloop_icmp_tcp
+// calls it with the position and length of the data:
+extern uint8_t udp_bind(uint16_t port,uint8_t *rip,uint16_t rport,void (*callback)(uint8_t fd,uint8_t *buf,uint16_t datapos,uint16_t len));
+extern void udp_unbind(uint8_t fd);
+extern uint16_t udp_received(uint8_t fd);
+extern uint16_t udp_dropped(uint8_t fd);
+#endif
+
+// receive a packet but drop it in chip memory if it is not for us:
+extern uint16_t packet_receive_filtered(uint8_t *buf,uint16_t maxlen);
 // return 0 to just continue in the packet loop and return the position 
 // of the tcp data if there is tcp data part
 extern uint16_t packetloop_icmp_tcp(uint8_t *buf,uint16_t plen);
@@ -54,6 +78,15 @@ extern uint16_t fill_tcp_data(uint8_t *buf,uint16_t pos, const char *s);
 extern uint16_t fill_tcp_data_len(uint8_t *buf,uint16_t pos, const char *s, uint16_t len);
 // send data from the web server to the client:
 extern void www_server_reply(uint8_t *buf,uint16_t dlen);
+// compose the reply directly in the enc28j60 transmit buffer:
+extern void www_server_reply_begin(uint8_t *buf);
+extern uint16_t stream_tcp_data_p(const prog_char *progmem_s);
+extern uint16_t stream_tcp_data(const char *s);
+extern uint16_t stream_tcp_data_len(const uint8_t *s,uint16_t len);
+extern void www_server_reply_end(uint8_t *buf);
+// send a reply of any length in several segments, datafill is called
+// for each segment:
+extern void www_server_reply_multi(uint8_t *buf,uint16_t bufsize,uint16_t (*datafill)(uint8_t fd,uint8_t *buf,uint16_t offset,uint16_t maxlen,uint8_t *last));
 
 // -- client functions --
 #if defined (WWW_client) || defined (NTP_client)  || defined (UDP_client) || defined (TCP_client) || defined (PING_client)
@@ -65,6 +98,12 @@ extern void client_gw_arp_refresh(void);
 // do an arp request once (call this function only if enc28j60PacketReceive returned zero:
 extern void client_arp_whohas(uint8_t *buf,uint8_t *gwipaddr);
 extern uint8_t client_waiting_gw(void); // 1 no GW mac yet, 0 have a gw mac
+// Hosts on our own subnet are sent to directly, without it everything
+// goes via the gateway. Their mac addresses are looked up in the
+// background (see ARP_CACHE_SIZE in ip_config.h):
+extern void client_set_netmask(uint8_t *mask);
+// 1 while the mac of the next hop towards ip is not known yet:
+extern uint8_t client_waiting_arp(uint8_t *ip);
 
 extern uint16_t build_tcp_data(uint8_t *buf, uint16_t srcPort );
 extern void send_tcp_data(uint8_t *buf,uint16_t dlen );
@@ -89,9 +128,9 @@ extern void client_tcp_set_serverip(uint8_t *ipaddr);
 // are invalid. That is: do to use data_start_pos_in_buf and len_of_data
 // if statuscode!=0.
 //
-// This callback gives you access to the TCP data of the first
-// packet returned from the server. You should aim to minimize the server
-// output such that this will be the only packet.
+// This callback is called for every packet of data returned from the
+// server, in order. If you need to know where a packet is in the whole
+// answer or want to slow the server down then use client_tcp_stream_req.
 //
 // close_tcp_session=1 means close the session now. close_tcp_session=0
 // read all data and leave it to the other side to close it. 
@@ -115,13 +154,27 @@ extern void client_tcp_set_serverip(uint8_t *ipaddr);
 // executed then you can start a new one. The fd makes it still possible to
 // distinguish in the callback code the different types you started.
 //
-// Note that you might never get called back if the other side does
-// not answer. A timer would be needed to recongnize such a condition.
+// If the other side does not answer the syn or the request is sent
+// again a few times (TCP_MAX_RETRIES in ip_config.h). When there is
+// still no answer the callback is called with statuscode=4 (timeout).
+// statuscode=3 means the server reset the connection.
 //
 // We use callback functions because that is the best implementation
 // given the fact that we have very little RAM memory.
 //
 extern uint8_t client_tcp_req(uint8_t (*result_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf, uint16_t len_of_data),uint16_t (*datafill_callback)(uint8_t fd),uint16_t port);
+//
+// For long answers use client_tcp_stream_req. Its callback is:
+//
+// uint16_t your_client_tcp_stream_callback(uint8_t fd, uint8_t statuscode,uint16_t data_start_pos_in_buf, uint16_t len_of_data,uint32_t offset,uint8_t more){...your code;return(window);}
+//
+// offset is the position of this packet in the answer and more=0 marks
+// the end of it. Return how many more bytes you can take or
+// TCP_CLIENT_CLOSE to close the connection. After returning a small
+// window call client_tcp_window once you have room again.
+#define TCP_CLIENT_CLOSE 0xffff
+extern uint8_t client_tcp_stream_req(uint16_t (*stream_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf,uint16_t len_of_data,uint32_t offset,uint8_t more),uint16_t (*datafill_callback)(uint8_t fd),uint16_t port);
+extern void client_tcp_window(uint16_t wnd);
 extern void tcp_client_send_packet(uint8_t *buf,uint16_t dest_port, uint16_t src_port, uint8_t flags, uint8_t max_segment_size, 
 	uint8_t clear_seqck, uint16_t next_ack_num, uint16_t dlength, uint8_t *dest_mac, uint8_t *dest_ip);
 extern uint16_t tcp_get_dlength ( uint8_t *buf );
@@ -145,6 +198,7 @@ extern void client_browse_url(char *urlbuf, char *urlbuf_varpart, char *hoststr,
 // statuscode=0 means a good webpage was received, with http code 200 OK
 // statuscode=1 an http error was received
 // statuscode=2 means the other side in not a web server and in this case datapos is also zero
+// statuscode=3 means the server did not answer (timeout)
 // ----- http post
 // client web browser using http POST operation:
 // additionalheaderline must be set to NULL if not used.
@@ -163,6 +217,7 @@ extern void client_http_post(char *urlbuf, char *hoststr, char *additionalheader
 // statuscode=0 means a good webpage was received, with http code 200 OK
 // statuscode=1 an http error was received
 // statuscode=2 means the other side in not a web server and in this case datapos is also zero
+// statuscode=3 means the server did not answer (timeout)
 #endif          // WWW_client
 
 #ifdef NTP_client
@@ -171,7 +226,7 @@ extern uint8_t client_ntp_process_answer(uint8_t *buf,uint32_t *time,uint8_t dst
 #endif
 
 #ifdef UDP_client
-// There are two ways of using this UDP client:
+// There are three ways of using this UDP client:
 //
 // 1) you call send_udp_prepare, you fill the data yourself into buf starting at buf[UDP_DATA_P], 
 // you send the packet by calling send_udp_transmit
@@ -179,11 +234,19 @@ extern uint8_t client_ntp_process_answer(uint8_t *buf,uint32_t *time,uint8_t dst
 // 2) You just allocate a large enough buffer for you data and you call send_udp and nothing else
 // needs to be done.
 //
+// 3) You stream the data into the transmit buffer of the chip with send_udp_stream_begin,
+// send_udp_stream, send_udp_stream_zero and send_udp_stream_end. hdr holds only the
+// UDP_DATA_P bytes of the headers.
+//
 extern void send_udp_prepare(uint8_t *buf,uint16_t sport, uint8_t *dip, uint16_t dport);
 extern void send_udp_transmit(uint8_t *buf,uint16_t datalen);
 
 // send_udp sends via gwip, you must call client_set_gwip at startup, datalen must be less than 220 bytes
 extern void send_udp(uint8_t *buf,char *data,uint16_t datalen,uint16_t sport, uint8_t *dip, uint16_t dport);
+extern void send_udp_stream_begin(uint8_t *hdr,uint16_t sport, uint8_t *dip, uint16_t dport);
+extern void send_udp_stream(const uint8_t *s,uint16_t len);
+extern void send_udp_stream_zero(uint16_t len);
+extern void send_udp_stream_end(uint8_t *hdr);
 #endif          // UDP_client
 
 
@@ -200,14 +263,24 @@ extern uint8_t packetloop_icmp_checkreply(uint8_t *buf,uint8_t *ip_monitoredhost
 extern void send_wol(uint8_t *buf,uint8_t *wolmac);
 #endif // WOL_client
 
+// The client and the web server connections follow the RFC 793 state
+// machine, the states are TCP_STATE_xxx in net.h.
+//
+// state the connection of the tcp segment in buf goes to when it is handled:
 extern uint8_t nextTcpState( uint8_t *buf,uint16_t plen );
+// state of the connection of the last segment (or the client after it was opened):
 extern uint8_t currentTcpState( );
+#ifdef TCP_client
+// client_tcp_req that sends the syn right away if it can:
 extern uint8_t tcpActiveOpen( uint8_t *buf,uint16_t plen,
         uint8_t (*result_callback)(uint8_t fd,uint8_t statuscode,uint16_t data_start_pos_in_buf, uint16_t len_of_data),
         uint16_t (*datafill_callback)(uint8_t fd),
         uint16_t port);
+#endif          // TCP_client
 
+// the web server listens, this is the default after init_ip_arp_udp_tcp:
 extern void tcpPassiveOpen( uint8_t *buf,uint16_t plen );
+// close the connection of currentTcpState or stop listening if there is none:
 extern void tcpClose( uint8_t *buf,uint16_t plen );
 
 #endif /* IP_ARP_UDP_TCP_H */
@@ -47,8 +47,39 @@
 //#undef FLASH_VARS
 
 //------------- functions in ip_arp_udp_tcp.c --------------
+// number of tcp connections the web server can track at the same time,
+// each one takes 59 bytes of RAM. When all are in use the connection that
+// was idle for the longest time is dropped for a new one.
+#define TCP_SERVER_CONNECTIONS 4
+// how often an unacknowledged tcp segment is sent again before the
+// connection is given up (the wait doubles every time, starting at 1s)
+#define TCP_MAX_RETRIES 5
+// number of hosts on the own subnet (see client_set_netmask) whose mac
+// addresses are kept, 16 bytes of RAM each, and the seconds after which
+// a mac address is asked for again
+#define ARP_CACHE_SIZE 4
+#define ARP_CACHE_TTL 300
+// number of ipv4 multicast groups that can be joined with
+// multicast_join, 5 bytes of RAM each. Comment out if not needed.
+#define MULTICAST_GROUPS 4
+// number of udp ports the application can receive on with udp_bind,
+// 14 bytes of RAM each. Comment out if not needed.
+#define UDP_SOCKETS 4
 // an NTP client (ntp clock):
 //#define NTP_client 1
+// Let the DMA engine of the ENC28J60 compute the checksum of outgoing
+// tcp/udp packets with data instead of adding up every byte on the
+// microcontroller:
+//#define ENC28J60_DMA_CHECKSUM 1
+// Number of frames that fit into the transmit buffer of the ENC28J60,
+// 1536 bytes each, the default is 2: the next frame is copied while
+// the last one is still sent. Every slot takes its space from the
+// receive buffer.
+//#define ENC28J60_TX_SLOTS 2
+// Count the SPI transfers of the ENC28J60 driver per opcode, see
+// enc28j60SpiCount. Costs 36 bytes of RAM:
+//#define ENC28J60_SPI_STATS 1
+//
 // a spontaneous sending UDP client
 #define UDP_client 1
 
@@ -77,9 +108,15 @@
 
 // DNS lookup support
 #define DNS_client 1
+// number of names kept with their ip (until the ttl of the answer runs
+// out) or as not existing, 11 bytes of RAM each. Comment out if not needed.
+#define DNS_CACHE_SIZE 4
 
 // DHCP support
 #define DHCP_client 1
+// number of options the application can ask for with
+// dhcp_option_register, 3 bytes of RAM each
+#define DHCP_OPTIONS 4
 
 #endif /* IP_CONFIG_H */
 //@}
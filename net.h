@@ -184,6 +184,32 @@
 #define DHCP_STATE_ACK 4
 #define DHCP_STATE_OK 5
 #define DHCP_STATE_RENEW 6
+#define DHCP_STATE_RENEWING 7
+#define DHCP_STATE_REBINDING 8
+#define DHCP_STATE_REBOOT 9
+// size of the lease for dhcp_lease_persist: ip, netmask, gateway,
+// dns server, dhcp server
+#define DHCP_LEASE_LEN 20
+// some options an application may ask for with dhcp_option_register
+#define DHCP_OPTION_DOMAIN 15
+#define DHCP_OPTION_MTU 26
+#define DHCP_OPTION_BROADCAST 28
+#define DHCP_OPTION_STATIC_ROUTES 33
+#define DHCP_OPTION_NTP 42
+#define DHCP_OPTION_ROUTES 121
+
+// TCP connection states (RFC 793)
+#define TCP_STATE_CLOSED 0
+#define TCP_STATE_LISTEN 1
+#define TCP_STATE_SYN_SENT 2
+#define TCP_STATE_SYN_RECEIVED 3
+#define TCP_STATE_ESTABLISHED 4
+#define TCP_STATE_FIN_WAIT_1 5
+#define TCP_STATE_FIN_WAIT_2 6
+#define TCP_STATE_CLOSE_WAIT 7
+#define TCP_STATE_CLOSING 8
+#define TCP_STATE_LAST_ACK 9
+#define TCP_STATE_TIME_WAIT 10
 
 
 #endif